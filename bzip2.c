@@ -1,3 +1,8 @@
+/*-- sigset_t and pthread_sigmask, for -p, with -std=c99 --*/
+#if defined(__STRICT_ANSI__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 /*-------------------------------------------------------------*/
 /*--- Public header file for the library.                   ---*/
 /*---                                               bzlib.h ---*/
@@ -84,6 +89,17 @@ extern "C" {
 #define BZ_OUTBUFF_FULL      (-8)
 #define BZ_CONFIG_ERROR      (-9)
 
+#define BZ_SORT_AUTO         0
+#define BZ_SORT_CLASSIC      1
+#define BZ_SORT_SUFFIX       2
+
+#define BZ_EFFORT_NORMAL     0
+#define BZ_EFFORT_HIGH       1
+
+#define BZ_UNBWT_CLASSIC     0
+#define BZ_UNBWT_INTERLEAVED 1
+#define BZ_UNBWT_PREFETCH    2
+
 typedef 
    struct {
       char *next_in;
@@ -104,6 +120,28 @@ typedef
    } 
    bz_stream;
 
+/*-- What BZ2_bzCompressStats reports for each block. --*/
+
+#define BZ_STATS_MAIN        0
+#define BZ_STATS_FALLBACK    1
+#define BZ_STATS_SUFFIX      2
+
+typedef 
+   struct {
+      int    blockNo;
+      int    nIn;          /* input bytes coded in the block */
+      int    nblock;       /* bytes in the block, after the RLE of runs of 4 */
+      int    nMTF;         /* symbols after MTF and RLE2 */
+      int    zbits;        /* size of the coded block, in bits */
+      int    sorter;       /* BZ_STATS_*: how it was sorted */
+      int    budgetInit;   /* work budget of mainSort, 0 if not run */
+      int    budgetUsed;   /* work done by mainSort */
+      double sortCycles;   /* cycles in BZ2_blockSort, */
+      double mtfCycles;    /* generateMTFValues and */
+      double codeCycles;   /* sendMTFValues; 0 if not x86 */
+   }
+   bz_block_stats;
+
 
 #ifndef BZ_IMPORT
 #define BZ_EXPORT
@@ -146,6 +184,26 @@ BZ_EXTERN int BZ_API(BZ2_bzCompress) (
       int action 
    );
 
+BZ_EXTERN int BZ_API(BZ2_bzCompressSorter) ( 
+      bz_stream* strm, 
+      int sorter 
+   );
+
+BZ_EXTERN int BZ_API(BZ2_bzCompressEffort) ( 
+      bz_stream* strm, 
+      int effort 
+   );
+
+BZ_EXTERN int BZ_API(BZ2_bzCompressStats) ( 
+      bz_stream* strm, 
+      void (*fn)(void *,bz_block_stats *),
+      void* opaque 
+   );
+
+BZ_EXTERN int BZ_API(BZ2_bzCompressReset) ( 
+      bz_stream* strm 
+   );
+
 BZ_EXTERN int BZ_API(BZ2_bzCompressEnd) ( 
       bz_stream* strm 
    );
@@ -160,6 +218,15 @@ BZ_EXTERN int BZ_API(BZ2_bzDecompress) (
       bz_stream* strm 
    );
 
+BZ_EXTERN int BZ_API(BZ2_bzDecompressUnbwt) ( 
+      bz_stream* strm, 
+      int        unbwt 
+   );
+
+BZ_EXTERN int BZ_API(BZ2_bzDecompressReset) ( 
+      bz_stream *strm 
+   );
+
 BZ_EXTERN int BZ_API(BZ2_bzDecompressEnd) ( 
       bz_stream *strm 
    );
@@ -257,6 +324,30 @@ BZ_EXTERN int BZ_API(BZ2_bzBuffToBuffDecompress) (
       int           verbosity 
    );
 
+/*--
+   As above, with a stream set up by BZ2_bzCompressInit or 
+   BZ2_bzDecompressInit, which is reset first and kept for
+   the next call, so that its arrays are allocated once.
+   They come from the bzalloc of the stream, which may hand
+   out memory of an arena owned by the caller.
+--*/
+
+BZ_EXTERN int BZ_API(BZ2_bzBuffToBuffCompressStream) ( 
+      bz_stream*    strm,
+      char*         dest, 
+      unsigned int* destLen,
+      char*         source, 
+      unsigned int  sourceLen
+   );
+
+BZ_EXTERN int BZ_API(BZ2_bzBuffToBuffDecompressStream) ( 
+      bz_stream*    strm,
+      char*         dest, 
+      unsigned int* destLen,
+      char*         source, 
+      unsigned int  sourceLen
+   );
+
 
 /*--
    Code contributed by Yoshioka Tsuneo
@@ -416,9 +507,12 @@ extern void bz_internal_error ( int errcode );
 #define BZ_N_GROUPS 6
 #define BZ_G_SIZE   50
 #define BZ_N_ITERS  4
+#define BZ_N_ITERS_HIGH 16
 
 #define BZ_MAX_SELECTORS (2 + (900000 / BZ_G_SIZE))
 
+#define BZ_FAST_BITS 10   /* prefix bits in the decode lookup table */
+
 
 
 /*-- Stuff for randomising repetitive blocks. --*/
@@ -516,6 +610,20 @@ typedef
       /* for deciding when to use the fallback sorting algorithm */
       Int32    workFactor;
 
+      /* BZ_SORT_*, and the work area of the suffix sorter */
+      Int32    sorter;
+      Int32*   sa;
+
+      /* BZ_EFFORT_*, for choosing the coding tables */
+      Int32    effort;
+
+      /* block statistics, if statsFn is set */
+      void     (*statsFn)(void *,bz_block_stats *);
+      void*    statsOpaque;
+      bz_block_stats stats;
+      UInt32   statsIn0;   /* input before the block: total_in_lo32
+                              less the pending run of state_in_len */
+
       /* run-length-encoding of the input */
       UInt32   state_in_ch;
       Int32    state_in_len;
@@ -552,9 +660,12 @@ typedef
       UChar    selectorMtf[BZ_MAX_SELECTORS];
 
       UChar    len     [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
+      UChar    bestLen [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
+      UChar    bestSelector[BZ_MAX_SELECTORS];
       Int32    code    [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
       Int32    rfreq   [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
-      /* second dimension: only 3 needed; 4 makes index calculations faster */
+      /* second dimension: only 3 needed; 4 makes index calculations
+         faster, and lets SSE2 add the 16-bit lengths of all tables */
       UInt32   len_pack[BZ_MAX_ALPHA_SIZE][4];
 
    }
@@ -570,6 +681,9 @@ BZ2_blockSort ( EState* );
 extern void 
 BZ2_compressBlock ( EState*, Bool );
 
+extern Int32 
+BZ2_compressBlockAlone ( EState* );
+
 extern void 
 BZ2_bsInitWrite ( EState* );
 
@@ -585,6 +699,7 @@ BZ2_hbMakeCodeLengths ( UChar*, Int32*, Int32, Int32 );
 
 #define BZ_X_IDLE        1
 #define BZ_X_OUTPUT      2
+#define BZ_X_SPLIT       3
 
 #define BZ_X_MAGIC_1     10
 #define BZ_X_MAGIC_2     11
@@ -636,6 +751,46 @@ BZ2_hbMakeCodeLengths ( UChar*, Int32*, Int32, Int32 );
 #define MTFL_SIZE 16
 
 
+/*-- SSE2, for move-to-front in the encoder and the
+     decoder, and for the table costs in sendMTFValues.
+     Define BZ_NO_SIMD to use plain C. --*/
+
+#if defined(__SSE2__) && !defined(BZ_NO_SIMD)
+#include <emmintrin.h>
+#define BZ_SIMD 1
+
+#define BZ_MTF_IDX16                                     \
+   _mm_setr_epi8 ( 0, 1, 2, 3, 4, 5, 6, 7,               \
+                   8, 9, 10, 11, 12, 13, 14, 15 )
+
+/*-- vvv with bytes 0 .. nnn-1 moved up to 1 .. nnn,
+     byte 0 taken from ccc, a vector with only its
+     low byte set, and bytes above nnn kept (nnn < 16). --*/
+#define BZ_MTF_SHIFT16(vvv,nnn,ccc)                      \
+   _mm_or_si128 (                                        \
+      _mm_and_si128 (                                    \
+         _mm_cmplt_epi8 ( BZ_MTF_IDX16,                  \
+            _mm_set1_epi8 ( (char)((nnn) + 1) ) ),       \
+         _mm_or_si128 ( _mm_slli_si128 ( vvv, 1 ),       \
+                        ccc ) ),                         \
+      _mm_andnot_si128 (                                 \
+         _mm_cmplt_epi8 ( BZ_MTF_IDX16,                  \
+            _mm_set1_epi8 ( (char)((nnn) + 1) ) ),       \
+         vvv ) )
+#else
+#define BZ_SIMD 0
+#endif
+
+
+/*-- Time stamp counter, for the block statistics. --*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BZ_CYCLES() ((double)__builtin_ia32_rdtsc())
+#else
+#define BZ_CYCLES() 0.0
+#endif
+
+
 
 /*-- Structure holding all the decompression-side stuff. --*/
 
@@ -663,6 +818,10 @@ typedef
       Int32    currBlockNo;
       Int32    verbosity;
 
+      /* block size tt (or ll16 and ll4) were allocated for, 
+         kept over BZ2_bzDecompressReset; 0 if none */
+      Int32    allocSize100k;
+
       /* for undoing the Burrows-Wheeler transform */
       Int32    origPtr;
       UInt32   tPos;
@@ -702,6 +861,7 @@ typedef
       Int32    base   [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
       Int32    perm   [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
       Int32    minLens[BZ_N_GROUPS];
+      UInt16   fast   [BZ_N_GROUPS][1 << BZ_FAST_BITS];
 
       /* save area for scalars in the main decompress code */
       Int32    save_i;
@@ -728,6 +888,15 @@ typedef
       Int32*   save_gLimit;
       Int32*   save_gBase;
       Int32*   save_gPerm;
+      UInt16*  save_gFast;
+
+      /* BZ_UNBWT_*, and the chunks of the interleaved engine */
+      Int32    unbwt;
+      UChar*   unbwtBuf;
+
+      /* stop in BZ_X_SPLIT after decoding the symbols of a
+         block, instead of undoing the BWT; see BZ2_unBwtSetup */
+      Bool     splitBlocks;
 
    }
    DState;
@@ -736,6 +905,17 @@ typedef
 
 /*-- Macros for decompression. --*/
 
+#define BZ_UNBWT_WAYS   8     /* cursors, interleaved engine */
+#define BZ_UNBWT_PWAYS  16    /* cursors, prefetching engine */
+#define BZ_UNBWT_CHUNK  4096
+#define BZ_UNBWT_MIN    65536 /* smaller blocks stay in cache */
+
+#if defined(__GNUC__)
+#define BZ_PREFETCH(ppp) __builtin_prefetch(ppp)
+#else
+#define BZ_PREFETCH(ppp) ((void)(ppp))
+#endif
+
 #define BZ_GET_FAST(cccc)                     \
     s->tPos = s->tt[s->tPos];                 \
     cccc = (UChar)(s->tPos & 0xff);           \
@@ -777,7 +957,10 @@ extern Int32
 BZ2_decompress ( DState* );
 
 extern void 
-BZ2_hbCreateDecodeTables ( Int32*, Int32*, Int32*, UChar*,
+BZ2_unBwtSetup ( DState*, Int32 );
+
+extern void 
+BZ2_hbCreateDecodeTables ( Int32*, Int32*, Int32*, UInt16*, UChar*,
                            Int32,  Int32, Int32 );
 
 
@@ -1798,6 +1981,233 @@ void mainSort ( UInt32* ptr,
 #undef CLEARMASK
 
 
+/*---------------------------------------------*/
+/*--- Linear-time sorting by induced suffix  ---*/
+/*--- sorting (SA-IS), for any block        ---*/
+/*---------------------------------------------*/
+
+/*--
+   Ge Nong, Sen Zhang and Wai Hong Chan, "Two
+   Efficient Algorithms for Linear Time Suffix Array
+   Construction", IEEE Trans. Computers, 2011.  O(N)
+   time however repetitive the block is.
+
+   SA-IS sorts suffixes, not rotations.  But if the
+   block is a Lyndon word (strictly smaller than all
+   its rotations), no rotation order is decided past
+   the end of the block, and a suffix that is a
+   prefix of another sorts first either way.  So the
+   block is rotated to its least rotation, sorted as
+   a string, and the result rotated back.
+
+   The text is the rotated block with a sentinel 0
+   appended, the bytes moving up to 1 .. 256.  Level
+   0 reads it through SAIS_CHR; the reduced strings
+   of the recursion are arrays of Int32 names.
+
+   The work area, s->sa, holds the suffix array of
+   nblock+1 entries and the buckets; the L/S types
+   of all levels go after the rotated block in arr2.
+--*/
+
+#define SAIS_CHR(i)                                    \
+   (w != NULL ? ((i) == n-1 ? 0 : (Int32)w[i] + 1)     \
+              : s1[i])
+
+#define SAIS_TGET(i)   ((t[(i) >> 3] >> ((i) & 7)) & 1)
+#define SAIS_TSET(i,b)                                 \
+   { if (b) t[(i) >> 3] |= (1 << ((i) & 7)); else      \
+            t[(i) >> 3] &= ~(1 << ((i) & 7)); }
+#define SAIS_LMS(i)    ((i) > 0 && SAIS_TGET(i) && !SAIS_TGET((i)-1))
+
+
+/*---------------------------------------------*/
+static
+void saisBuckets ( UChar* w, Int32* s1, Int32 n, 
+                   Int32* bkt, Int32 K, Bool end )
+{
+   Int32 i, sum = 0;
+   for (i = 0; i <= K; i++) bkt[i] = 0;
+   for (i = 0; i < n; i++) bkt[SAIS_CHR(i)]++;
+   for (i = 0; i <= K; i++) {
+      sum += bkt[i];
+      bkt[i] = end ? sum : sum - bkt[i];
+   }
+}
+
+
+/*---------------------------------------------*/
+static
+void saisInduce ( UChar* w, Int32* s1, Int32 n, UChar* t, 
+                  Int32* SA, Int32* bkt, Int32 K )
+{
+   Int32 i, j;
+
+   /*-- L-type suffixes, left to right --*/
+   saisBuckets ( w, s1, n, bkt, K, False );
+   for (i = 0; i < n; i++) {
+      j = SA[i] - 1;
+      if (j >= 0 && !SAIS_TGET(j)) SA[bkt[SAIS_CHR(j)]++] = j;
+   }
+
+   /*-- S-type suffixes, right to left --*/
+   saisBuckets ( w, s1, n, bkt, K, True );
+   for (i = n-1; i >= 0; i--) {
+      j = SA[i] - 1;
+      if (j >= 0 && SAIS_TGET(j)) SA[--bkt[SAIS_CHR(j)]] = j;
+   }
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Sort the n suffixes of w (level 0) or s1 into SA,
+   with characters 0 .. K.  t has room for the types
+   of this and all deeper levels.
+--*/
+static
+void saisSort ( UChar* w, Int32* s1, Int32 n, Int32 K,
+                Int32* SA, Int32* bkt, UChar* t )
+{
+   Int32 i, j, d, n1, name, prev, pos;
+   Bool  diff;
+   Int32* r1;
+
+   /*-- classify the suffixes: S-type or L-type --*/
+   SAIS_TSET(n-1, 1);
+   if (n > 1) SAIS_TSET(n-2, 0);
+   for (i = n-3; i >= 0; i--)
+      SAIS_TSET(i, SAIS_CHR(i) < SAIS_CHR(i+1) ||
+                   (SAIS_CHR(i) == SAIS_CHR(i+1) && SAIS_TGET(i+1)));
+
+   /*-- stage 1: sort the LMS substrings --*/
+   saisBuckets ( w, s1, n, bkt, K, True );
+   for (i = 0; i < n; i++) SA[i] = -1;
+   for (i = 1; i < n; i++) 
+      if (SAIS_LMS(i)) SA[--bkt[SAIS_CHR(i)]] = i;
+   saisInduce ( w, s1, n, t, SA, bkt, K );
+
+   /*-- name them, in the order they came out --*/
+   n1 = 0;
+   for (i = 0; i < n; i++) 
+      if (SAIS_LMS(SA[i])) SA[n1++] = SA[i];
+   for (i = n1; i < n; i++) SA[i] = -1;
+   name = 0;
+   prev = -1;
+   for (i = 0; i < n1; i++) {
+      pos  = SA[i];
+      diff = False;
+      for (d = 0; d < n; d++)
+         if (prev == -1 || 
+             SAIS_CHR(pos+d) != SAIS_CHR(prev+d) ||
+             SAIS_TGET(pos+d) != SAIS_TGET(prev+d)) {
+            diff = True; 
+            break;
+         } else
+         if (d > 0 && (SAIS_LMS(pos+d) || SAIS_LMS(prev+d))) 
+            break;
+      if (diff) { name++; prev = pos; }
+      SA[n1 + pos / 2] = name - 1;
+   }
+   for (i = n-1, j = n-1; i >= n1; i--)
+      if (SA[i] >= 0) SA[j--] = SA[i];
+
+   /*-- stage 2: sort the reduced string, recursively if
+        the names are not unique --*/
+   r1 = SA + n - n1;
+   if (name < n1)
+      saisSort ( NULL, r1, n1, name - 1, SA, bkt, t + (n >> 3) + 1 );
+   else
+      for (i = 0; i < n1; i++) SA[r1[i]] = i;
+
+   /*-- stage 3: induce the order of all suffixes from 
+        the sorted LMS suffixes --*/
+   for (i = 1, j = 0; i < n; i++)
+      if (SAIS_LMS(i)) r1[j++] = i;
+   for (i = 0; i < n1; i++) SA[i] = r1[SA[i]];
+   for (i = n1; i < n; i++) SA[i] = -1;
+   saisBuckets ( w, s1, n, bkt, K, True );
+   for (i = n1-1; i >= 0; i--) {
+      j = SA[i]; 
+      SA[i] = -1;
+      SA[--bkt[SAIS_CHR(j)]] = j;
+   }
+   saisInduce ( w, s1, n, t, SA, bkt, K );
+}
+
+#undef SAIS_CHR
+#undef SAIS_TGET
+#undef SAIS_TSET
+#undef SAIS_LMS
+
+
+/*---------------------------------------------*/
+/*--
+   Index of the least rotation of block[0 .. n-1],
+   in O(n) time and O(1) space.
+--*/
+static
+Int32 leastRotation ( UChar* block, Int32 n )
+{
+   Int32 i = 0, j = 1, k = 0, a, b;
+
+   while (i < n && j < n && k < n) {
+      a = i + k; if (a >= n) a -= n;
+      b = j + k; if (b >= n) b -= n;
+      if (block[a] == block[b]) { k++; continue; }
+      if (block[a] > block[b]) i += k + 1; else j += k + 1;
+      if (i == j) j++;
+      k = 0;
+   }
+   return i < j ? i : j;
+}
+
+
+/*---------------------------------------------*/
+/* Pre:
+      as for BZ2_blockSort
+   Post:
+      arr1 [0 .. nblock-1] holds sorted order
+      returns False, with nothing done, if the work
+      area cannot be allocated
+*/
+static
+Bool suffixSort ( EState* s )
+{
+   bz_stream* strm   = s->strm;
+   UChar*     block  = s->block;
+   UInt32*    ptr    = s->ptr;
+   Int32      nblock = s->nblock;
+   Int32      n      = nblock + 1;
+   Int32      i, k, r;
+   UChar*     w;
+   UChar*     t;
+
+   if (s->sa == NULL) {
+      /*-- suffix array, plus at most n/2 names + 1 --*/
+      s->sa = BZALLOC( ((s->nblockMAX + 20) * 3 / 2 + 260) 
+                       * sizeof(Int32) );
+      if (s->sa == NULL) return False;
+   }
+
+   /*-- the rotated block, then the types, in arr2 --*/
+   k = leastRotation ( block, nblock );
+   w = &block[nblock];
+   for (i = 0; i < nblock; i++) 
+      w[i] = block[k + i < nblock ? k + i : k + i - nblock];
+   t = &w[nblock];
+
+   saisSort ( w, NULL, n, 256, s->sa, s->sa + n, t );
+
+   /*-- s->sa[0] is the sentinel --*/
+   for (i = 0; i < nblock; i++) {
+      r = s->sa[i+1] + k;
+      ptr[i] = r < nblock ? r : r - nblock;
+   }
+   return True;
+}
+
+
 /*---------------------------------------------*/
 /* Pre:
       nblock > 0
@@ -1823,9 +2233,20 @@ void BZ2_blockSort ( EState* s )
    Int32   budget;
    Int32   budgetInit;
    Int32   i;
+   double  t0 = 0.0;
 
+   if (s->statsFn != NULL) {
+      t0 = BZ_CYCLES();
+      s->stats.budgetInit = 0;
+      s->stats.budgetUsed = 0;
+   }
+
+   if (s->sorter == BZ_SORT_SUFFIX && suffixSort ( s )) {
+      s->stats.sorter = BZ_STATS_SUFFIX;
+   } else
    if (nblock < 10000) {
       fallbackSort ( s->arr1, s->arr2, ftab, nblock, verb );
+      s->stats.sorter = BZ_STATS_FALLBACK;
    } else {
       /* Calculate the location for quadrant, remembering to get
          the alignment right.  Assumes that &(block[0]) is at least
@@ -1849,6 +2270,9 @@ void BZ2_blockSort ( EState* s )
       budget = budgetInit;
 
       mainSort ( ptr, block, quadrant, ftab, nblock, verb, &budget );
+      s->stats.sorter     = BZ_STATS_MAIN;
+      s->stats.budgetInit = budgetInit;
+      s->stats.budgetUsed = budgetInit - budget;
       if (verb >= 3) 
          VPrintf3 ( "      %d work, %d block, ratio %5.2f\n",
                     budgetInit - budget,
@@ -1856,12 +2280,21 @@ void BZ2_blockSort ( EState* s )
                     (float)(budgetInit - budget) /
                     (float)(nblock==0 ? 1 : nblock) ); 
       if (budget < 0) {
-         if (verb >= 2) 
-            VPrintf0 ( "    too repetitive; using fallback"
-                       " sorting algorithm\n" );
-         fallbackSort ( s->arr1, s->arr2, ftab, nblock, verb );
+         if (s->sorter == BZ_SORT_AUTO && suffixSort ( s )) {
+            if (verb >= 2) 
+               VPrintf0 ( "    too repetitive; using suffix"
+                          " sorting algorithm\n" );
+            s->stats.sorter = BZ_STATS_SUFFIX;
+         } else {
+            if (verb >= 2) 
+               VPrintf0 ( "    too repetitive; using fallback"
+                          " sorting algorithm\n" );
+            fallbackSort ( s->arr1, s->arr2, ftab, nblock, verb );
+            s->stats.sorter = BZ_STATS_FALLBACK;
+         }
       }
    }
+   if (s->statsFn != NULL) s->stats.sortCycles = BZ_CYCLES() - t0;
 
    s->origPtr = -1;
    for (i = 0; i < s->nblock; i++)
@@ -2014,12 +2447,13 @@ void BZ2_hbAssignCodes ( Int32 *code,
 void BZ2_hbCreateDecodeTables ( Int32 *limit,
                                 Int32 *base,
                                 Int32 *perm,
+                                UInt16 *fast,
                                 UChar *length,
                                 Int32 minLen,
                                 Int32 maxLen,
                                 Int32 alphaSize )
 {
-   Int32 pp, i, j, vec;
+   Int32 pp, i, j, vec, lo, hi;
 
    pp = 0;
    for (i = minLen; i <= maxLen; i++)
@@ -2041,6 +2475,27 @@ void BZ2_hbCreateDecodeTables ( Int32 *limit,
    }
    for (i = minLen + 1; i <= maxLen; i++)
       base[i] = ((limit[i-1] + 1) << 1) - base[i];
+
+   /*-- 
+      The lookup table: for each BZ_FAST_BITS bit prefix,
+      the symbol and length of the code it starts with,
+      or 0 when that code is longer (or the prefix is not
+      a code of an incomplete or broken table), in which
+      case the decoder walks limit[] as before.
+   --*/
+   for (i = 0; i < (1 << BZ_FAST_BITS); i++) fast[i] = 0;
+   vec = 0;
+   for (i = minLen; i <= maxLen && i <= BZ_FAST_BITS; i++) {
+      for (j = 0; j < alphaSize; j++) {
+         if (length[j] != i) continue;
+         lo = vec << (BZ_FAST_BITS - i);
+         hi = (vec + 1) << (BZ_FAST_BITS - i);
+         if (hi > (1 << BZ_FAST_BITS)) return;
+         for (; lo < hi; lo++) fast[lo] = (UInt16)((i << 9) | j);
+         vec++;
+      }
+      vec <<= 1;
+   }
 }
 
 
@@ -2295,6 +2750,38 @@ void makeMaps_e ( EState* s )
 }
 
 
+/*---------------------------------------------------*/
+#if BZ_SIMD
+/*--
+   Move c, which is in yy[1 .. 255], to the front of
+   yy, 16 bytes at a time, and return where it was.
+--*/
+static
+__inline__
+Int32 mtfToFront ( UChar* yy, UChar c )
+{
+   __m128i key, carry, v, sh;
+   Int32   b, hit, j;
+
+   key   = _mm_set1_epi8 ( (char)c );
+   carry = _mm_cvtsi32_si128 ( c );
+   for (b = 0; ; b += 16) {
+      v   = _mm_loadu_si128 ( (__m128i*)(yy + b) );
+      hit = _mm_movemask_epi8 ( _mm_cmpeq_epi8 ( v, key ) );
+      if (hit != 0) {
+         j = __builtin_ctz ( hit );
+         _mm_storeu_si128 ( (__m128i*)(yy + b), 
+                            BZ_MTF_SHIFT16 ( v, j, carry ) );
+         return b + j;
+      }
+      sh    = _mm_or_si128 ( _mm_slli_si128 ( v, 1 ), carry );
+      carry = _mm_srli_si128 ( v, 15 );
+      _mm_storeu_si128 ( (__m128i*)(yy + b), sh );
+   }
+}
+#endif
+
+
 /*---------------------------------------------------*/
 static
 void generateMTFValues ( EState* s )
@@ -2338,7 +2825,7 @@ void generateMTFValues ( EState* s )
 
    wr = 0;
    zPend = 0;
-   for (i = 0; i < s->nInUse; i++) yy[i] = (UChar) i;
+   for (i = 0; i < 256; i++) yy[i] = (UChar) i;
 
    for (i = 0; i < s->nblock; i++) {
       UChar ll_i;
@@ -2366,6 +2853,10 @@ void generateMTFValues ( EState* s )
             };
             zPend = 0;
          }
+#if BZ_SIMD
+         j = mtfToFront ( yy, ll_i );
+         mtfv[wr] = j+1; wr++; s->mtfFreq[j+1]++;
+#else
          {
             register UChar  rtmp;
             register UChar* ryy_j;
@@ -2385,6 +2876,7 @@ void generateMTFValues ( EState* s )
             j = ryy_j - &(yy[0]);
             mtfv[wr] = j+1; wr++; s->mtfFreq[j+1]++;
          }
+#endif
 
       }
    }
@@ -2411,6 +2903,43 @@ void generateMTFValues ( EState* s )
 }
 
 
+/*---------------------------------------------------*/
+/*--
+   The size in bits of the selectors and the coding
+   tables, as sendMTFValues writes them.
+--*/
+static
+Int32 tableBits ( EState* s, Int32 nGroups, Int32 alphaSize, 
+                  Int32 nSelectors )
+{
+   UChar pos[BZ_N_GROUPS], ll_i;
+   Int32 i, j, t, curr, n;
+
+   n = 0;
+   for (i = 0; i < nGroups; i++) pos[i] = i;
+   for (i = 0; i < nSelectors; i++) {
+      ll_i = s->selector[i];
+      j = 0;
+      while (pos[j] != ll_i) j++;
+      n += j + 1;
+      for (; j > 0; j--) pos[j] = pos[j-1];
+      pos[0] = ll_i;
+   }
+
+   for (t = 0; t < nGroups; t++) {
+      curr = s->len[t][0];
+      n += 5;
+      for (i = 0; i < alphaSize; i++) {
+         if (s->len[t][i] > curr)
+            n += 1 + 2 * (s->len[t][i] - curr); else
+            n += 1 + 2 * (curr - s->len[t][i]);
+         curr = s->len[t][i];
+      }
+   }
+   return n;
+}
+
+
 /*---------------------------------------------------*/
 #define BZ_LESSER_ICOST  0
 #define BZ_GREATER_ICOST 15
@@ -2420,7 +2949,7 @@ void sendMTFValues ( EState* s )
 {
    Int32 v, t, i, j, gs, ge, totc, bt, bc, iter;
    Int32 nSelectors, alphaSize, minLen, maxLen, selCtr;
-   Int32 nGroups, nBytes;
+   Int32 nGroups, nBytes, nIters, est, bestc, bestIter;
 
    /*--
    UChar  len [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
@@ -2433,7 +2962,7 @@ void sendMTFValues ( EState* s )
    --*/
 
 
-   UInt16 cost[BZ_N_GROUPS];
+   UInt16 cost[8];   /* 8 for the SSE2 store */
    Int32  fave[BZ_N_GROUPS];
 
    UInt16* mtfv = s->mtfv;
@@ -2498,8 +3027,12 @@ void sendMTFValues ( EState* s )
 
    /*--- 
       Iterate up to BZ_N_ITERS times to improve the tables.
+      With BZ_EFFORT_HIGH, up to BZ_N_ITERS_HIGH times.
    ---*/
-   for (iter = 0; iter < BZ_N_ITERS; iter++) {
+   nIters   = s->effort == BZ_EFFORT_HIGH ? BZ_N_ITERS_HIGH : BZ_N_ITERS;
+   bestc    = 0x7fffffff;
+   bestIter = 0;
+   for (iter = 0; iter < nIters; iter++) {
 
       for (t = 0; t < nGroups; t++) fave[t] = 0;
 
@@ -2511,6 +3044,16 @@ void sendMTFValues ( EState* s )
         Set up an auxiliary length table which is used to fast-track
 	the common case (nGroups == 6). 
       ---*/
+#if BZ_SIMD
+      /*-- With SSE2 it is used for any nGroups: the lengths
+           of unused tables are never looked at. --*/
+      for (v = 0; v < alphaSize; v++) {
+         s->len_pack[v][0] = (s->len[1][v] << 16) | s->len[0][v];
+         s->len_pack[v][1] = (s->len[3][v] << 16) | s->len[2][v];
+         s->len_pack[v][2] = (s->len[5][v] << 16) | s->len[4][v];
+         s->len_pack[v][3] = 0;
+      }
+#else
       if (nGroups == 6) {
          for (v = 0; v < alphaSize; v++) {
             s->len_pack[v][0] = (s->len[1][v] << 16) | s->len[0][v];
@@ -2518,6 +3061,7 @@ void sendMTFValues ( EState* s )
             s->len_pack[v][2] = (s->len[5][v] << 16) | s->len[4][v];
 	 }
       }
+#endif
 
       nSelectors = 0;
       totc = 0;
@@ -2533,6 +3077,22 @@ void sendMTFValues ( EState* s )
             Calculate the cost of this group as coded
             by each of the coding tables.
          --*/
+#if BZ_SIMD
+         /*-- all tables at once, one 16-bit lane each --*/
+         {
+#           define BZ_LENS(nn) \
+               _mm_loadu_si128 ( (__m128i*)&(s->len_pack[mtfv[nn]][0]) )
+            __m128i c0 = _mm_setzero_si128 ();
+            __m128i c1 = _mm_setzero_si128 ();
+            for (i = gs; i < ge; i += 2) {
+               c0 = _mm_add_epi16 ( c0, BZ_LENS(i) );
+               c1 = _mm_add_epi16 ( c1, BZ_LENS(i+1) );
+            }
+            if (i == ge) c0 = _mm_add_epi16 ( c0, BZ_LENS(i) );
+            _mm_storeu_si128 ( (__m128i*)cost, _mm_add_epi16 ( c0, c1 ) );
+#           undef BZ_LENS
+         }
+#else
          for (t = 0; t < nGroups; t++) cost[t] = 0;
 
          if (nGroups == 6 && 50 == ge-gs+1) {
@@ -2571,6 +3131,7 @@ void sendMTFValues ( EState* s )
                for (t = 0; t < nGroups; t++) cost[t] += s->len[t][icv];
             }
          }
+#endif
  
          /*-- 
             Find the coding table which is best for this group,
@@ -2621,6 +3182,27 @@ void sendMTFValues ( EState* s )
          VPrintf0 ( "\n" );
       }
 
+      /*--
+        With BZ_EFFORT_HIGH, keep the tables and the selectors
+        (chosen for them) of the smallest pass so far, and
+        stop when two passes in a row do no better.  The
+        first pass uses the initial tables, which are not
+        Huffman codes.
+      --*/
+      if (s->effort == BZ_EFFORT_HIGH && iter > 0) {
+         est = totc + tableBits ( s, nGroups, alphaSize, nSelectors );
+         if (est < bestc) {
+            bestc = est;
+            bestIter = iter;
+            for (t = 0; t < nGroups; t++)
+               for (v = 0; v < alphaSize; v++)
+                  s->bestLen[t][v] = s->len[t][v];
+            for (i = 0; i < nSelectors; i++)
+               s->bestSelector[i] = s->selector[i];
+         } else
+         if (iter - bestIter >= 2) break;
+      }
+
       /*--
         Recompute the tables based on the accumulated frequencies.
       --*/
@@ -2629,6 +3211,15 @@ void sendMTFValues ( EState* s )
                                  alphaSize, 20 );
    }
 
+   if (s->effort == BZ_EFFORT_HIGH) {
+      if (s->verbosity >= 3)
+         VPrintf1 ( "      using pass %d\n", bestIter+1 );
+      for (t = 0; t < nGroups; t++)
+         for (v = 0; v < alphaSize; v++)
+            s->len[t][v] = s->bestLen[t][v];
+      for (i = 0; i < nSelectors; i++)
+         s->selector[i] = s->bestSelector[i];
+   }
 
    AssertH( nGroups < 8, 3002 );
    AssertH( nSelectors < 32768 &&
@@ -2776,6 +3367,55 @@ void sendMTFValues ( EState* s )
 }
 
 
+/*---------------------------------------------------*/
+static
+void codeBlock ( EState* s )
+{
+   Int32  bits0 = 8 * s->numZ + s->bsLive;
+   double t0, t1, t2;
+
+   bsPutUChar ( s, 0x31 ); bsPutUChar ( s, 0x41 );
+   bsPutUChar ( s, 0x59 ); bsPutUChar ( s, 0x26 );
+   bsPutUChar ( s, 0x53 ); bsPutUChar ( s, 0x59 );
+
+   /*-- Now the block's CRC, so it is in a known place. --*/
+   bsPutUInt32 ( s, s->blockCRC );
+
+   /*-- 
+      Now a single bit indicating (non-)randomisation. 
+      As of version 0.9.5, we use a better sorting algorithm
+      which makes randomisation unnecessary.  So always set
+      the randomised bit to 'no'.  Of course, the decoder
+      still needs to be able to handle randomised blocks
+      so as to maintain backwards compatibility with
+      older versions of bzip2.
+   --*/
+   bsW(s,1,0);
+
+   bsW ( s, 24, s->origPtr );
+   if (s->statsFn == NULL) {
+      generateMTFValues ( s );
+      sendMTFValues ( s );
+      return;
+   }
+
+   t0 = BZ_CYCLES();
+   generateMTFValues ( s );
+   t1 = BZ_CYCLES();
+   sendMTFValues ( s );
+   t2 = BZ_CYCLES();
+   s->stats.blockNo    = s->blockNo;
+   s->stats.nIn        = (Int32)(s->strm->total_in_lo32 -
+                                 (UInt32)s->state_in_len - s->statsIn0);
+   s->stats.nblock     = s->nblock;
+   s->stats.nMTF       = s->nMTF;
+   s->stats.zbits      = 8 * s->numZ + s->bsLive - bits0;
+   s->stats.mtfCycles  = t1 - t0;
+   s->stats.codeCycles = t2 - t1;
+   s->statsFn ( s->statsOpaque, &(s->stats) );
+}
+
+
 /*---------------------------------------------------*/
 void BZ2_compressBlock ( EState* s, Bool is_last_block )
 {
@@ -2805,30 +3445,7 @@ void BZ2_compressBlock ( EState* s, Bool is_last_block )
       bsPutUChar ( s, (UChar)(BZ_HDR_0 + s->blockSize100k) );
    }
 
-   if (s->nblock > 0) {
-
-      bsPutUChar ( s, 0x31 ); bsPutUChar ( s, 0x41 );
-      bsPutUChar ( s, 0x59 ); bsPutUChar ( s, 0x26 );
-      bsPutUChar ( s, 0x53 ); bsPutUChar ( s, 0x59 );
-
-      /*-- Now the block's CRC, so it is in a known place. --*/
-      bsPutUInt32 ( s, s->blockCRC );
-
-      /*-- 
-         Now a single bit indicating (non-)randomisation. 
-         As of version 0.9.5, we use a better sorting algorithm
-         which makes randomisation unnecessary.  So always set
-         the randomised bit to 'no'.  Of course, the decoder
-         still needs to be able to handle randomised blocks
-         so as to maintain backwards compatibility with
-         older versions of bzip2.
-      --*/
-      bsW(s,1,0);
-
-      bsW ( s, 24, s->origPtr );
-      generateMTFValues ( s );
-      sendMTFValues ( s );
-   }
+   if (s->nblock > 0) codeBlock ( s );
 
 
    /*-- If this is the last block, add the stream trailer. --*/
@@ -2845,6 +3462,34 @@ void BZ2_compressBlock ( EState* s, Bool is_last_block )
 }
 
 
+/*---------------------------------------------------*/
+/*--
+   Compress the block in s on its own, without the
+   stream header and trailer, for the parallel
+   compressor in bzip2.c.  The coded block is left
+   in s->zbits, starting on a byte boundary; returns
+   its length in bits.  The caller combines the
+   block CRCs.
+--*/
+Int32 BZ2_compressBlockAlone ( EState* s )
+{
+   Int32 nbits;
+
+   BZ_FINALISE_CRC ( s->blockCRC );
+   if (s->nblock == 0) return 0;
+
+   BZ2_blockSort ( s );
+   s->zbits = (UChar*) (&((UChar*)s->arr2)[s->nblock]);
+   s->numZ = 0;
+   BZ2_bsInitWrite ( s );
+   codeBlock ( s );
+
+   nbits = 8 * s->numZ + s->bsLive;
+   bsFinishWrite ( s );
+   return nbits;
+}
+
+
 /*-------------------------------------------------------------*/
 /*--- end                                        compress.c ---*/
 /*-------------------------------------------------------------*/
@@ -2870,36 +3515,252 @@ void makeMaps_d ( DState* s )
 
 
 /*---------------------------------------------------*/
-#define RETURN(rrr)                               \
-   { retVal = rrr; goto save_state_and_return; };
+/*--
+   Another way to follow T^(-1) through tt[].  Done one
+   byte at a time, each load depends on the one before
+   and usually misses the cache.  Here several cursors,
+   starting at spaced points of the cycle, walk it side
+   by side, so their misses overlap.  Each one copies
+   its bytes to chunks of s->unbwtBuf, and stops at the
+   start of the next cursor.  The segments are then
+   joined, and tt[] rewritten in output order with each
+   entry pointing to the next, so that BZ_GET_FAST
+   reads it sequentially from tPos == 0.  With prefetch,
+   more cursors are used, and the next entry of each is
+   prefetched, which keeps loads in flight without
+   filling the out-of-order window.
+
+   Returns False, leaving tt[] unchanged, if the
+   segments do not make up the whole block, as happens
+   when T^(-1) of a damaged block is not one cycle.
+--*/
+#define BZ_UNBWT_NCHUNK \
+   (900000 / BZ_UNBWT_CHUNK + BZ_UNBWT_PWAYS + 1)
 
-#define GET_BITS(lll,vvv,nnn)                     \
-   case lll: s->state = lll;                      \
-   while (True) {                                 \
-      if (s->bsLive >= nnn) {                     \
-         UInt32 v;                                \
-         v = (s->bsBuff >>                        \
-             (s->bsLive-nnn)) & ((1 << nnn)-1);   \
-         s->bsLive -= nnn;                        \
-         vvv = v;                                 \
-         break;                                   \
-      }                                           \
-      if (s->strm->avail_in == 0) RETURN(BZ_OK);  \
-      s->bsBuff                                   \
-         = (s->bsBuff << 8) |                     \
-           ((UInt32)                              \
-              (*((UChar*)(s->strm->next_in))));   \
-      s->bsLive += 8;                             \
-      s->strm->next_in++;                         \
-      s->strm->avail_in--;                        \
-      s->strm->total_in_lo32++;                   \
-      if (s->strm->total_in_lo32 == 0)            \
-         s->strm->total_in_hi32++;                \
+static
+Bool unBwtInterleaved ( DState* s, Int32 nblock, Bool prefetch )
+{
+   UInt32* tt  = s->tt;
+   UChar*  buf = s->unbwtBuf;
+   Int32   link[BZ_UNBWT_NCHUNK];
+   UInt32  start[BZ_UNBWT_PWAYS];
+   UInt32  pos  [BZ_UNBWT_PWAYS];
+   UChar*  out  [BZ_UNBWT_PWAYS];
+   UChar*  end  [BZ_UNBWT_PWAYS];
+   Int32   first[BZ_UNBWT_PWAYS];
+   Int32   cur  [BZ_UNBWT_PWAYS];
+   Int32   succ [BZ_UNBWT_PWAYS];
+   Int32   act  [BZ_UNBWT_PWAYS];
+   Int32   ways, nAct, nChunk, a, k, c, i, n, total;
+   UInt32  e;
+   UChar*  p;
+
+   ways = prefetch ? BZ_UNBWT_PWAYS : BZ_UNBWT_WAYS;
+   if (ways > nblock / BZ_UNBWT_CHUNK) ways = nblock / BZ_UNBWT_CHUNK;
+   if (ways < 1) ways = 1;
+
+   /*-- Start the cursors, and mark their entries
+        (tt[] entries use only the low 28 bits) --*/
+   start[0] = tt[s->origPtr] >> 8;
+   for (k = 1; k < ways; k++)
+      start[k] = (start[0] + k * (nblock / ways)) % nblock;
+   nChunk = 0;
+   for (k = 0; k < ways; k++) {
+      e          = tt[start[k]];
+      tt[start[k]] = e | 0x80000000;
+      first[k]   = cur[k] = nChunk;
+      link[nChunk] = -1;
+      out[k]     = buf + nChunk * BZ_UNBWT_CHUNK;
+      end[k]     = out[k] + BZ_UNBWT_CHUNK;
+      nChunk++;
+      *(out[k])++ = (UChar)(e & 0xff);
+      pos[k]     = e >> 8;
+      act[k]     = k;
    }
 
-#define GET_UCHAR(lll,uuu)                        \
-   GET_BITS(lll,uuu,8)
-
+   /*-- Walk --*/
+   nAct = ways;
+   while (nAct > 0) {
+      for (a = 0; a < nAct; a++) {
+         k = act[a];
+         e = tt[pos[k]];
+         if (e & 0x80000000) {
+            for (c = 0; start[c] != pos[k]; c++) ;
+            succ[k] = c;
+            nAct--;
+            act[a] = act[nAct];
+            a--;
+            continue;
+         }
+         if (out[k] == end[k]) {
+            link[cur[k]] = nChunk;
+            cur[k]       = nChunk;
+            link[nChunk] = -1;
+            out[k]       = buf + nChunk * BZ_UNBWT_CHUNK;
+            end[k]       = out[k] + BZ_UNBWT_CHUNK;
+            nChunk++;
+         }
+         *(out[k])++ = (UChar)(e & 0xff);
+         pos[k] = e >> 8;
+         if (prefetch) BZ_PREFETCH ( &tt[pos[k]] );
+      }
+   }
+
+   for (k = 0; k < ways; k++) tt[start[k]] &= 0x7fffffff;
+
+   /*-- Check that the segments, from the first one
+        round to it again, make up the block --*/
+   total = 0;
+   k = 0;
+   do {
+      for (c = first[k]; c != cur[k]; c = link[c])
+         total += BZ_UNBWT_CHUNK;
+      total += out[k] - (buf + cur[k] * BZ_UNBWT_CHUNK);
+      k = succ[k];
+   }
+      while (k != 0);
+   if (total != nblock) return False;
+
+   /*-- Rewrite tt[] in output order --*/
+   n = 0;
+   k = 0;
+   do {
+      c = first[k];
+      while (True) {
+         p = buf + c * BZ_UNBWT_CHUNK;
+         i = (c == cur[k]) ? out[k] - p : BZ_UNBWT_CHUNK;
+         for (; i > 0; i--, n++, p++)
+            tt[n] = ((UInt32)(n + 1) << 8) | *p;
+         if (c == cur[k]) break;
+         c = link[c];
+      }
+      k = succ[k];
+   }
+      while (k != 0);
+   tt[nblock - 1] &= 0xff;
+   return True;
+}
+
+
+/*---------------------------------------------------*/
+/*--
+   Set up the output of a block of nblock symbols in
+   tt[] (or ll16[]): build T^(-1) and fetch the first
+   byte.  BZ2_decompress calls it at the end of each
+   block, unless splitBlocks is set; then it stops in
+   BZ_X_SPLIT instead, and the caller may move tt[],
+   with origPtr, unzftab, blockRandomised and
+   storedBlockCRC, to another DState, and call this
+   there, while the first one decodes the next block.
+--*/
+void BZ2_unBwtSetup ( DState* s, Int32 nblock )
+{
+   Int32 i, j;
+   UChar uc;
+
+   s->state_out_len = 0;
+   s->state_out_ch  = 0;
+   BZ_INITIALISE_CRC ( s->calculatedBlockCRC );
+   s->state = BZ_X_OUTPUT;
+   if (s->verbosity >= 2) VPrintf0 ( "rt+rld" );
+
+   /*-- Set up cftab to facilitate generation of T^(-1) --*/
+   s->cftab[0] = 0;
+   for (i = 1; i <= 256; i++) s->cftab[i] = s->unzftab[i-1];
+   for (i = 1; i <= 256; i++) s->cftab[i] += s->cftab[i-1];
+
+   if (s->smallDecompress) {
+
+      /*-- Make a copy of cftab, used in generation of T --*/
+      for (i = 0; i <= 256; i++) s->cftabCopy[i] = s->cftab[i];
+
+      /*-- compute the T vector --*/
+      for (i = 0; i < nblock; i++) {
+         uc = (UChar)(s->ll16[i]);
+         SET_LL(i, s->cftabCopy[uc]);
+         s->cftabCopy[uc]++;
+      }
+
+      /*-- Compute T^(-1) by pointer reversal on T --*/
+      i = s->origPtr;
+      j = GET_LL(i);
+      do {
+         Int32 tmp = GET_LL(j);
+         SET_LL(j, i);
+         i = j;
+         j = tmp;
+      }
+         while (i != s->origPtr);
+
+      s->tPos = s->origPtr;
+      s->nblock_used = 0;
+      if (s->blockRandomised) {
+         BZ_RAND_INIT_MASK;
+         BZ_GET_SMALL(s->k0); s->nblock_used++;
+         BZ_RAND_UPD_MASK; s->k0 ^= BZ_RAND_MASK; 
+      } else {
+         BZ_GET_SMALL(s->k0); s->nblock_used++;
+      }
+
+   } else {
+
+      /*-- compute the T^(-1) vector --*/
+      for (i = 0; i < nblock; i++) {
+         uc = (UChar)(s->tt[i] & 0xff);
+         s->tt[s->cftab[uc]] |= (i << 8);
+         s->cftab[uc]++;
+      }
+
+      if (s->unbwt != BZ_UNBWT_CLASSIC && s->unbwtBuf != NULL
+          && nblock >= BZ_UNBWT_MIN
+          && unBwtInterleaved ( s, nblock,
+                                s->unbwt == BZ_UNBWT_PREFETCH ))
+         s->tPos = 0; else
+         s->tPos = s->tt[s->origPtr] >> 8;
+      s->nblock_used = 0;
+      if (s->blockRandomised) {
+         BZ_RAND_INIT_MASK;
+         BZ_GET_FAST(s->k0); s->nblock_used++;
+         BZ_RAND_UPD_MASK; s->k0 ^= BZ_RAND_MASK; 
+      } else {
+         BZ_GET_FAST(s->k0); s->nblock_used++;
+      }
+
+   }
+}
+
+
+/*---------------------------------------------------*/
+#define RETURN(rrr)                               \
+   { retVal = rrr; goto save_state_and_return; };
+
+#define GET_BITS(lll,vvv,nnn)                     \
+   case lll: s->state = lll;                      \
+   while (True) {                                 \
+      if (s->bsLive >= nnn) {                     \
+         UInt32 v;                                \
+         v = (s->bsBuff >>                        \
+             (s->bsLive-nnn)) & ((1 << nnn)-1);   \
+         s->bsLive -= nnn;                        \
+         vvv = v;                                 \
+         break;                                   \
+      }                                           \
+      if (s->strm->avail_in == 0) RETURN(BZ_OK);  \
+      s->bsBuff                                   \
+         = (s->bsBuff << 8) |                     \
+           ((UInt32)                              \
+              (*((UChar*)(s->strm->next_in))));   \
+      s->bsLive += 8;                             \
+      s->strm->next_in++;                         \
+      s->strm->avail_in--;                        \
+      s->strm->total_in_lo32++;                   \
+      if (s->strm->total_in_lo32 == 0)            \
+         s->strm->total_in_hi32++;                \
+   }
+
+#define GET_UCHAR(lll,uuu)                        \
+   GET_BITS(lll,uuu,8)
+
 #define GET_BIT(lll,uuu)                          \
    GET_BITS(lll,uuu,1)
 
@@ -2916,22 +3777,46 @@ void makeMaps_d ( DState* s )
       gLimit = &(s->limit[gSel][0]);              \
       gPerm = &(s->perm[gSel][0]);                \
       gBase = &(s->base[gSel][0]);                \
+      gFast = &(s->fast[gSel][0]);                \
    }                                              \
    groupPos--;                                    \
-   zn = gMinlen;                                  \
-   GET_BITS(label1, zvec, zn);                    \
-   while (1) {                                    \
-      if (zn > 20 /* the longest code */)         \
+   while (s->bsLive <= 24                         \
+          && s->strm->avail_in > 0) {             \
+      s->bsBuff                                   \
+         = (s->bsBuff << 8) |                     \
+           ((UInt32)                              \
+              (*((UChar*)(s->strm->next_in))));   \
+      s->bsLive += 8;                             \
+      s->strm->next_in++;                         \
+      s->strm->avail_in--;                        \
+      s->strm->total_in_lo32++;                   \
+      if (s->strm->total_in_lo32 == 0)            \
+         s->strm->total_in_hi32++;                \
+   }                                              \
+   zj = 0;                                        \
+   if (s->bsLive >= BZ_FAST_BITS)                 \
+      zj = gFast[(s->bsBuff >>                    \
+                  (s->bsLive - BZ_FAST_BITS))     \
+                 & ((1 << BZ_FAST_BITS) - 1)];    \
+   if (zj != 0) {                                 \
+      s->bsLive -= zj >> 9;                       \
+      lval = zj & 0x1ff;                          \
+   } else {                                       \
+      zn = gMinlen;                               \
+      GET_BITS(label1, zvec, zn);                 \
+      while (1) {                                 \
+         if (zn > 20 /* the longest code */)      \
+            RETURN(BZ_DATA_ERROR);                \
+         if (zvec <= gLimit[zn]) break;           \
+         zn++;                                    \
+         GET_BIT(label2, zj);                     \
+         zvec = (zvec << 1) | zj;                 \
+      };                                          \
+      if (zvec - gBase[zn] < 0                    \
+          || zvec - gBase[zn] >= BZ_MAX_ALPHA_SIZE) \
          RETURN(BZ_DATA_ERROR);                   \
-      if (zvec <= gLimit[zn]) break;              \
-      zn++;                                       \
-      GET_BIT(label2, zj);                        \
-      zvec = (zvec << 1) | zj;                    \
-   };                                             \
-   if (zvec - gBase[zn] < 0                       \
-       || zvec - gBase[zn] >= BZ_MAX_ALPHA_SIZE)  \
-      RETURN(BZ_DATA_ERROR);                      \
-   lval = gPerm[zvec - gBase[zn]];                \
+      lval = gPerm[zvec - gBase[zn]];             \
+   }                                              \
 }
 
 
@@ -2968,6 +3853,7 @@ Int32 BZ2_decompress ( DState* s )
    Int32* gLimit;
    Int32* gBase;
    Int32* gPerm;
+   UInt16* gFast;
 
    if (s->state == BZ_X_MAGIC_1) {
       /*initialise the save area*/
@@ -2995,6 +3881,7 @@ Int32 BZ2_decompress ( DState* s )
       s->save_gLimit      = NULL;
       s->save_gBase       = NULL;
       s->save_gPerm       = NULL;
+      s->save_gFast       = NULL;
    }
 
    /*restore from the save area*/
@@ -3022,6 +3909,7 @@ Int32 BZ2_decompress ( DState* s )
    gLimit      = s->save_gLimit;
    gBase       = s->save_gBase;
    gPerm       = s->save_gPerm;
+   gFast       = s->save_gFast;
 
    retVal = BZ_OK;
 
@@ -3041,16 +3929,34 @@ Int32 BZ2_decompress ( DState* s )
           s->blockSize100k > (BZ_HDR_0 + 9)) RETURN(BZ_DATA_ERROR_MAGIC);
       s->blockSize100k -= BZ_HDR_0;
 
-      if (s->smallDecompress) {
-         s->ll16 = BZALLOC( s->blockSize100k * 100000 * sizeof(UInt16) );
-         s->ll4  = BZALLOC( 
-                      ((1 + s->blockSize100k * 100000) >> 1) * sizeof(UChar) 
-                   );
-         if (s->ll16 == NULL || s->ll4 == NULL) RETURN(BZ_MEM_ERROR);
-      } else {
-         s->tt  = BZALLOC( s->blockSize100k * 100000 * sizeof(Int32) );
-         if (s->tt == NULL) RETURN(BZ_MEM_ERROR);
+      /*-- A reset stream keeps its arrays if they are
+           big enough --*/
+      if (s->blockSize100k > s->allocSize100k) {
+         if (s->tt   != NULL) BZFREE(s->tt);
+         if (s->ll16 != NULL) BZFREE(s->ll16);
+         if (s->ll4  != NULL) BZFREE(s->ll4);
+         if (s->unbwtBuf != NULL) BZFREE(s->unbwtBuf);
+         s->tt = NULL;
+         s->ll16 = NULL;
+         s->ll4 = NULL;
+         s->unbwtBuf = NULL;
+         s->allocSize100k = 0;
+         if (s->smallDecompress) {
+            s->ll16 = BZALLOC( s->blockSize100k * 100000 * sizeof(UInt16) );
+            s->ll4  = BZALLOC( 
+                         ((1 + s->blockSize100k * 100000) >> 1) * sizeof(UChar) 
+                      );
+            if (s->ll16 == NULL || s->ll4 == NULL) RETURN(BZ_MEM_ERROR);
+         } else {
+            s->tt  = BZALLOC( s->blockSize100k * 100000 * sizeof(Int32) );
+            if (s->tt == NULL) RETURN(BZ_MEM_ERROR);
+         }
+         s->allocSize100k = s->blockSize100k;
       }
+      if (!s->smallDecompress && s->unbwt != BZ_UNBWT_CLASSIC
+          && s->unbwtBuf == NULL)
+         s->unbwtBuf = BZALLOC( s->allocSize100k * 100000 
+                                + BZ_UNBWT_PWAYS * BZ_UNBWT_CHUNK );
 
       GET_UCHAR(BZ_X_BLKHDR_1, uc);
 
@@ -3173,6 +4079,7 @@ Int32 BZ2_decompress ( DState* s )
             &(s->limit[t][0]), 
             &(s->base[t][0]), 
             &(s->perm[t][0]), 
+            &(s->fast[t][0]),
             &(s->len[t][0]),
             minLen, maxLen, alphaSize
          );
@@ -3256,6 +4163,12 @@ Int32 BZ2_decompress ( DState* s )
                   /* avoid general-case expense */
                   pp = s->mtfbase[0];
                   uc = s->mtfa[pp+nn];
+#if BZ_SIMD
+                  _mm_storeu_si128 ( (__m128i*)(s->mtfa + pp),
+                     BZ_MTF_SHIFT16 ( 
+                        _mm_loadu_si128 ( (__m128i*)(s->mtfa + pp) ),
+                        nn, _mm_cvtsi32_si128 ( uc ) ) );
+#else
                   while (nn > 3) {
                      Int32 z = pp+nn;
                      s->mtfa[(z)  ] = s->mtfa[(z)-1];
@@ -3268,15 +4181,24 @@ Int32 BZ2_decompress ( DState* s )
                      s->mtfa[(pp+nn)] = s->mtfa[(pp+nn)-1]; nn--; 
                   };
                   s->mtfa[pp] = uc;
+#endif
                } else { 
                   /* general case */
                   lno = nn / MTFL_SIZE;
                   off = nn % MTFL_SIZE;
                   pp = s->mtfbase[lno] + off;
                   uc = s->mtfa[pp];
+#if BZ_SIMD
+                  pp = s->mtfbase[lno];
+                  _mm_storeu_si128 ( (__m128i*)(s->mtfa + pp),
+                     BZ_MTF_SHIFT16 ( 
+                        _mm_loadu_si128 ( (__m128i*)(s->mtfa + pp) ),
+                        off, _mm_setzero_si128 () ) );
+#else
                   while (pp > s->mtfbase[lno]) { 
                      s->mtfa[pp] = s->mtfa[pp-1]; pp--; 
                   };
+#endif
                   s->mtfbase[lno]++;
                   while (lno > 0) {
                      s->mtfbase[lno]--;
@@ -3317,71 +4239,12 @@ Int32 BZ2_decompress ( DState* s )
       if (s->origPtr < 0 || s->origPtr >= nblock)
          RETURN(BZ_DATA_ERROR);
 
-      s->state_out_len = 0;
-      s->state_out_ch  = 0;
-      BZ_INITIALISE_CRC ( s->calculatedBlockCRC );
-      s->state = BZ_X_OUTPUT;
-      if (s->verbosity >= 2) VPrintf0 ( "rt+rld" );
-
-      /*-- Set up cftab to facilitate generation of T^(-1) --*/
-      s->cftab[0] = 0;
-      for (i = 1; i <= 256; i++) s->cftab[i] = s->unzftab[i-1];
-      for (i = 1; i <= 256; i++) s->cftab[i] += s->cftab[i-1];
-
-      if (s->smallDecompress) {
-
-         /*-- Make a copy of cftab, used in generation of T --*/
-         for (i = 0; i <= 256; i++) s->cftabCopy[i] = s->cftab[i];
-
-         /*-- compute the T vector --*/
-         for (i = 0; i < nblock; i++) {
-            uc = (UChar)(s->ll16[i]);
-            SET_LL(i, s->cftabCopy[uc]);
-            s->cftabCopy[uc]++;
-         }
-
-         /*-- Compute T^(-1) by pointer reversal on T --*/
-         i = s->origPtr;
-         j = GET_LL(i);
-         do {
-            Int32 tmp = GET_LL(j);
-            SET_LL(j, i);
-            i = j;
-            j = tmp;
-         }
-            while (i != s->origPtr);
-
-         s->tPos = s->origPtr;
-         s->nblock_used = 0;
-         if (s->blockRandomised) {
-            BZ_RAND_INIT_MASK;
-            BZ_GET_SMALL(s->k0); s->nblock_used++;
-            BZ_RAND_UPD_MASK; s->k0 ^= BZ_RAND_MASK; 
-         } else {
-            BZ_GET_SMALL(s->k0); s->nblock_used++;
-         }
-
-      } else {
-
-         /*-- compute the T^(-1) vector --*/
-         for (i = 0; i < nblock; i++) {
-            uc = (UChar)(s->tt[i] & 0xff);
-            s->tt[s->cftab[uc]] |= (i << 8);
-            s->cftab[uc]++;
-         }
-
-         s->tPos = s->tt[s->origPtr] >> 8;
-         s->nblock_used = 0;
-         if (s->blockRandomised) {
-            BZ_RAND_INIT_MASK;
-            BZ_GET_FAST(s->k0); s->nblock_used++;
-            BZ_RAND_UPD_MASK; s->k0 ^= BZ_RAND_MASK; 
-         } else {
-            BZ_GET_FAST(s->k0); s->nblock_used++;
-         }
-
+      if (s->splitBlocks) {
+         s->state = BZ_X_SPLIT;
+         RETURN(BZ_OK);
       }
 
+      BZ2_unBwtSetup ( s, nblock );
       RETURN(BZ_OK);
 
 
@@ -3443,6 +4306,7 @@ Int32 BZ2_decompress ( DState* s )
    s->save_gLimit      = gLimit;
    s->save_gBase       = gBase;
    s->save_gPerm       = gPerm;
+   s->save_gFast       = gFast;
 
    return retVal;   
 }
@@ -3546,6 +4410,7 @@ void prepare_new_block ( EState* s )
    s->nblock = 0;
    s->numZ = 0;
    s->state_out_pos = 0;
+   s->statsIn0 = s->strm->total_in_lo32 - (UInt32)s->state_in_len;
    BZ_INITIALISE_CRC ( s->blockCRC );
    for (i = 0; i < 256; i++) s->inUse[i] = False;
    s->blockNo++;
@@ -3598,6 +4463,7 @@ int BZ_API(BZ2_bzCompressInit)
    s->arr1 = NULL;
    s->arr2 = NULL;
    s->ftab = NULL;
+   s->sa   = NULL;
 
    n       = 100000 * blockSize100k;
    s->arr1 = BZALLOC( n                  * sizeof(UInt32) );
@@ -3620,6 +4486,10 @@ int BZ_API(BZ2_bzCompressInit)
    s->nblockMAX         = 100000 * blockSize100k - 19;
    s->verbosity         = verbosity;
    s->workFactor        = workFactor;
+   s->sorter            = BZ_SORT_AUTO;
+   s->effort            = BZ_EFFORT_NORMAL;
+   s->statsFn           = NULL;
+   s->statsOpaque       = NULL;
 
    s->block             = (UChar*)s->arr2;
    s->mtfv              = (UInt16*)s->arr1;
@@ -3890,6 +4760,80 @@ int BZ_API(BZ2_bzCompress) ( bz_stream *strm, int action )
 }
 
 
+/*---------------------------------------------------*/
+int BZ_API(BZ2_bzCompressSorter) ( bz_stream *strm, int sorter )
+{
+   EState* s;
+   if (strm == NULL) return BZ_PARAM_ERROR;
+   s = strm->state;
+   if (s == NULL) return BZ_PARAM_ERROR;
+   if (s->strm != strm) return BZ_PARAM_ERROR;
+   if (sorter < BZ_SORT_AUTO || sorter > BZ_SORT_SUFFIX)
+      return BZ_PARAM_ERROR;
+
+   s->sorter = sorter;
+   return BZ_OK;
+}
+
+
+/*---------------------------------------------------*/
+int BZ_API(BZ2_bzCompressStats) ( bz_stream *strm, 
+                                  void (*fn)(void *,bz_block_stats *),
+                                  void *opaque )
+{
+   EState* s;
+   if (strm == NULL) return BZ_PARAM_ERROR;
+   s = strm->state;
+   if (s == NULL) return BZ_PARAM_ERROR;
+   if (s->strm != strm) return BZ_PARAM_ERROR;
+
+   s->statsFn     = fn;
+   s->statsOpaque = opaque;
+   return BZ_OK;
+}
+
+
+/*---------------------------------------------------*/
+int BZ_API(BZ2_bzCompressEffort) ( bz_stream *strm, int effort )
+{
+   EState* s;
+   if (strm == NULL) return BZ_PARAM_ERROR;
+   s = strm->state;
+   if (s == NULL) return BZ_PARAM_ERROR;
+   if (s->strm != strm) return BZ_PARAM_ERROR;
+   if (effort < BZ_EFFORT_NORMAL || effort > BZ_EFFORT_HIGH)
+      return BZ_PARAM_ERROR;
+
+   s->effort = effort;
+   return BZ_OK;
+}
+
+
+/*---------------------------------------------------*/
+int BZ_API(BZ2_bzCompressReset) ( bz_stream *strm )
+{
+   EState* s;
+   if (strm == NULL) return BZ_PARAM_ERROR;
+   s = strm->state;
+   if (s == NULL) return BZ_PARAM_ERROR;
+   if (s->strm != strm) return BZ_PARAM_ERROR;
+
+   s->blockNo           = 0;
+   s->state             = BZ_S_INPUT;
+   s->mode              = BZ_M_RUNNING;
+   s->combinedCRC       = 0;
+   s->zbits             = NULL;
+
+   strm->total_in_lo32  = 0;
+   strm->total_in_hi32  = 0;
+   strm->total_out_lo32 = 0;
+   strm->total_out_hi32 = 0;
+   init_RL ( s );
+   prepare_new_block ( s );
+   return BZ_OK;
+}
+
+
 /*---------------------------------------------------*/
 int BZ_API(BZ2_bzCompressEnd)  ( bz_stream *strm )
 {
@@ -3902,6 +4846,7 @@ int BZ_API(BZ2_bzCompressEnd)  ( bz_stream *strm )
    if (s->arr1 != NULL) BZFREE(s->arr1);
    if (s->arr2 != NULL) BZFREE(s->arr2);
    if (s->ftab != NULL) BZFREE(s->ftab);
+   if (s->sa   != NULL) BZFREE(s->sa);
    BZFREE(strm->state);
 
    strm->state = NULL;   
@@ -3947,6 +4892,10 @@ int BZ_API(BZ2_bzDecompressInit)
    s->ll4                   = NULL;
    s->ll16                  = NULL;
    s->tt                    = NULL;
+   s->unbwt                 = BZ_UNBWT_PREFETCH;
+   s->unbwtBuf              = NULL;
+   s->splitBlocks           = False;
+   s->allocSize100k         = 0;
    s->currBlockNo           = 0;
    s->verbosity             = verbosity;
 
@@ -4219,6 +5168,7 @@ int BZ_API(BZ2_bzDecompress) ( bz_stream *strm )
 
    while (True) {
       if (s->state == BZ_X_IDLE) return BZ_SEQUENCE_ERROR;
+      if (s->state == BZ_X_SPLIT) return BZ_SEQUENCE_ERROR;
       if (s->state == BZ_X_OUTPUT) {
          if (s->smallDecompress)
             unRLE_obuf_to_output_SMALL ( s ); else
@@ -4260,6 +5210,45 @@ int BZ_API(BZ2_bzDecompress) ( bz_stream *strm )
 }
 
 
+/*---------------------------------------------------*/
+int BZ_API(BZ2_bzDecompressUnbwt) ( bz_stream *strm, int unbwt )
+{
+   DState* s;
+   if (strm == NULL) return BZ_PARAM_ERROR;
+   s = strm->state;
+   if (s == NULL) return BZ_PARAM_ERROR;
+   if (s->strm != strm) return BZ_PARAM_ERROR;
+   if (unbwt < BZ_UNBWT_CLASSIC || unbwt > BZ_UNBWT_PREFETCH)
+      return BZ_PARAM_ERROR;
+   if (s->state != BZ_X_MAGIC_1) return BZ_SEQUENCE_ERROR;
+
+   s->unbwt = unbwt;
+   return BZ_OK;
+}
+
+
+/*---------------------------------------------------*/
+int BZ_API(BZ2_bzDecompressReset) ( bz_stream *strm )
+{
+   DState* s;
+   if (strm == NULL) return BZ_PARAM_ERROR;
+   s = strm->state;
+   if (s == NULL) return BZ_PARAM_ERROR;
+   if (s->strm != strm) return BZ_PARAM_ERROR;
+
+   s->state                 = BZ_X_MAGIC_1;
+   s->bsLive                = 0;
+   s->bsBuff                = 0;
+   s->calculatedCombinedCRC = 0;
+   s->currBlockNo           = 0;
+   strm->total_in_lo32      = 0;
+   strm->total_in_hi32      = 0;
+   strm->total_out_lo32     = 0;
+   strm->total_out_hi32     = 0;
+   return BZ_OK;
+}
+
+
 /*---------------------------------------------------*/
 int BZ_API(BZ2_bzDecompressEnd)  ( bz_stream *strm )
 {
@@ -4270,6 +5259,7 @@ int BZ_API(BZ2_bzDecompressEnd)  ( bz_stream *strm )
    if (s->strm != strm) return BZ_PARAM_ERROR;
 
    if (s->tt   != NULL) BZFREE(s->tt);
+   if (s->unbwtBuf != NULL) BZFREE(s->unbwtBuf);
    if (s->ll16 != NULL) BZFREE(s->ll16);
    if (s->ll4  != NULL) BZFREE(s->ll4);
 
@@ -4750,6 +5740,67 @@ int BZ_API(BZ2_bzBuffToBuffDecompress)
 }
 
 
+/*---------------------------------------------------*/
+int BZ_API(BZ2_bzBuffToBuffCompressStream) 
+                         ( bz_stream*    strm,
+                           char*         dest, 
+                           unsigned int* destLen,
+                           char*         source, 
+                           unsigned int  sourceLen )
+{
+   int ret;
+
+   if (dest == NULL || destLen == NULL || source == NULL)
+      return BZ_PARAM_ERROR;
+
+   ret = BZ2_bzCompressReset ( strm );
+   if (ret != BZ_OK) return ret;
+
+   strm->next_in = source;
+   strm->next_out = dest;
+   strm->avail_in = sourceLen;
+   strm->avail_out = *destLen;
+
+   ret = BZ2_bzCompress ( strm, BZ_FINISH );
+   if (ret == BZ_FINISH_OK) return BZ_OUTBUFF_FULL;
+   if (ret != BZ_STREAM_END) return ret;
+
+   *destLen -= strm->avail_out;   
+   return BZ_OK;
+}
+
+
+/*---------------------------------------------------*/
+int BZ_API(BZ2_bzBuffToBuffDecompressStream) 
+                           ( bz_stream*    strm,
+                             char*         dest, 
+                             unsigned int* destLen,
+                             char*         source, 
+                             unsigned int  sourceLen )
+{
+   int ret;
+
+   if (dest == NULL || destLen == NULL || source == NULL)
+      return BZ_PARAM_ERROR;
+
+   ret = BZ2_bzDecompressReset ( strm );
+   if (ret != BZ_OK) return ret;
+
+   strm->next_in = source;
+   strm->next_out = dest;
+   strm->avail_in = sourceLen;
+   strm->avail_out = *destLen;
+
+   ret = BZ2_bzDecompress ( strm );
+   if (ret == BZ_OK)
+      return strm->avail_out > 0 ? BZ_UNEXPECTED_EOF : BZ_OUTBUFF_FULL;
+   if (ret != BZ_STREAM_END) return ret;
+
+   *destLen -= strm->avail_out;
+   return BZ_OK;
+}
+
+
 /*---------------------------------------------------*/
 /*--
    Code contributed by Yoshioka Tsuneo
@@ -5059,6 +6110,7 @@ const char * BZ_API(BZ2_bzerror) (BZFILE *b, int *errnum)
 #include <math.h>
 #include <errno.h>
 #include <ctype.h>
+#include <time.h>
 
 #define ERROR_IF_EOF(i)       { if ((i) == EOF)  ioError(); }
 #define ERROR_IF_NOT_ZERO(i)  { if ((i) != 0)    ioError(); }
@@ -5157,6 +6209,22 @@ const char * BZ_API(BZ2_bzerror) (BZFILE *b, int *errnum)
 #endif /* BZ_LCCWIN32 */
 
 
+/*---------------------------------------------*/
+/*--
+  Compressing and decompressing with several
+  threads (-p) needs POSIX threads and mmap.
+  Define BZ_NO_THREADS to build without them.
+--*/
+
+#if BZ_UNIX && !defined(BZ_NO_THREADS)
+#   define BZ_THREADS 1
+#   include <pthread.h>
+#   include <sys/mman.h>
+#else
+#   define BZ_THREADS 0
+#endif
+
+
 /*---------------------------------------------*/
 /*--
   Some more stuff for all platforms :-)
@@ -5180,6 +6248,12 @@ Int32   verbosity;
 Bool    keepInputFiles, smallMode, deleteOutputOnInterrupt;
 Bool    forceOverwrite, testFailsExist, unzFailsExist, noisy;
 Int32   numFileNames, numFilesProcessed, blockSize100k;
+Int32   numThreads;
+Int32   blockSorter;
+Int32   tableEffort;
+Bool    showStats;
+Bool    pipeline;
+Bool    verifyJson;
 Int32   exitValue;
 
 /*-- source modes; F==file, I==stdin, O==stdout --*/
@@ -5191,6 +6265,7 @@ Int32   exitValue;
 #define OM_Z             1
 #define OM_UNZ           2
 #define OM_TEST          3
+#define OM_BENCH         4
 
 Int32   opMode;
 Int32   srcMode;
@@ -5304,6 +6379,1266 @@ void uInt64_toAscii ( char* outbuf, UInt64* n )
 }
 
 
+/*---------------------------------------------------*/
+/*--- Block statistics (--stats)                  ---*/
+/*---------------------------------------------------*/
+
+/*--
+   The library reports each block it codes through
+   BZ2_bzCompressStats.  With --stats, a line per block
+   goes to stderr, and the totals of the stream after
+   it.  The totals are also kept for --bench.
+--*/
+
+static Int32  statsBlocks, statsFallback, statsSuffix;
+static double statsIn, statsOut;
+static double statsBudgetInit, statsBudgetUsed;
+static double statsSort, statsMtf, statsCode;
+
+/*---------------------------------------------*/
+static 
+void statsReset ( void )
+{
+   statsBlocks     = statsFallback = statsSuffix = 0;
+   statsIn         = statsOut = 0.0;
+   statsBudgetInit = statsBudgetUsed = 0.0;
+   statsSort       = statsMtf = statsCode = 0.0;
+}
+
+
+/*---------------------------------------------*/
+static 
+void statsAdd ( bz_block_stats* st )
+{
+   static Char* sorters[] = { "main", "fallback", "suffix" };
+
+   statsBlocks++;
+   if (st->sorter == BZ_STATS_FALLBACK) statsFallback++;
+   if (st->sorter == BZ_STATS_SUFFIX) statsSuffix++;
+   statsIn         += st->nIn;
+   statsOut        += st->zbits / 8.0;
+   statsBudgetInit += st->budgetInit;
+   statsBudgetUsed += st->budgetUsed;
+   statsSort       += st->sortCycles;
+   statsMtf        += st->mtfCycles;
+   statsCode       += st->codeCycles;
+
+   if (!showStats) return;
+   fprintf ( stderr, "    block %d: %d -> %d bytes, %d in block, "
+             "%d mtf symbols, %s sort",
+             st->blockNo, st->nIn, (st->zbits + 7) / 8, st->nblock,
+             st->nMTF, sorters[st->sorter] );
+   if (st->budgetInit > 0)
+      fprintf ( stderr, ", budget %d of %d used", 
+                st->budgetUsed, st->budgetInit );
+   fprintf ( stderr, "\n"
+             "       cycles/byte: sort %.1f, mtf %.1f, code %.1f\n",
+             st->sortCycles / st->nIn, st->mtfCycles / st->nIn,
+             st->codeCycles / st->nIn );
+}
+
+
+/*---------------------------------------------*/
+/*--
+   The callback.  The parallel code passes the job's
+   copy, to print its blocks in order; others pass NULL.
+--*/
+static 
+void statsBlock ( void* opaque, bz_block_stats* st )
+{
+   if (opaque != NULL)
+      *(bz_block_stats*)opaque = *st; else
+      statsAdd ( st );
+}
+
+
+/*---------------------------------------------*/
+static 
+void statsTotal ( void )
+{
+   if (statsBlocks == 0 || statsIn == 0.0) return;
+   fprintf ( stderr, "    %d blocks, %d by fallback sort, "
+             "%d by suffix sort, %.0f -> %.0f bytes\n",
+             statsBlocks, statsFallback, statsSuffix, 
+             statsIn, statsOut );
+   if (statsBudgetInit > 0.0)
+      fprintf ( stderr, "    %.1f%% of the mainSort budget used\n",
+                100.0 * statsBudgetUsed / statsBudgetInit );
+   fprintf ( stderr, "    cycles/byte: sort %.1f, mtf %.1f, code %.1f\n",
+             statsSort / statsIn, statsMtf / statsIn, 
+             statsCode / statsIn );
+}
+
+
+/*---------------------------------------------------*/
+/*--- Compression and decompression with several  ---*/
+/*--- threads (-p)                                ---*/
+/*---------------------------------------------------*/
+
+/*--
+   The main thread cuts the input into blocks exactly
+   as BZ2_bzWrite would, run-length coding it into the
+   EState of a job, and hands the jobs to numThreads
+   workers, which sort and code each block on its own.
+   The coded blocks are not byte aligned, so the main
+   thread then shifts them into place, in order, and
+   combines the block CRCs into the stream CRC.  The
+   output is the same as that of the serial code.
+
+   There are 2 * numThreads jobs in a ring, so that
+   the workers do not wait while the main thread
+   writes a block or reads the next one.
+--*/
+
+#if BZ_THREADS
+
+typedef
+   struct {
+      bz_stream strm;      /* its EState holds the block */
+      Int32     nbits;     /* length of the coded block */
+      Bool      done;      /* set when nbits is valid */
+      bz_block_stats stats; /* for --stats */
+   }
+   ParJob;
+
+static ParJob*         parJobs;
+static UInt32          parNJobs;
+static UInt32          parAvail;  /* number of jobs handed out */
+static UInt32          parNext;   /* next job for a worker */
+static Bool            parQuit;
+static pthread_mutex_t parLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  parWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  parDone = PTHREAD_COND_INITIALIZER;
+
+/*-- the bit stream being written, as in compress.c --*/
+static FILE*   parHandle;
+static UInt32  parBuff;
+static Int32   parLive;
+static UChar   parObuf[5000];
+static Int32   parNObuf;
+static UInt32  parOutLo32, parOutHi32;
+static UInt32  parCombinedCRC;
+
+
+/*---------------------------------------------*/
+static 
+void parFlushObuf ( void )
+{
+   if (parNObuf == 0) return;
+   fwrite ( parObuf, sizeof(UChar), parNObuf, parHandle );
+   if (ferror(parHandle)) ioError();
+   parOutLo32 += parNObuf;
+   if (parOutLo32 < (UInt32)parNObuf) parOutHi32++;
+   parNObuf = 0;
+}
+
+
+/*---------------------------------------------*/
+static 
+void parPutBits ( Int32 n, UInt32 v )
+{
+   parBuff |= (v << (32 - parLive - n));
+   parLive += n;
+   while (parLive >= 8) {
+      if (parNObuf == sizeof(parObuf)) parFlushObuf();
+      parObuf[parNObuf++] = (UChar)(parBuff >> 24);
+      parBuff <<= 8;
+      parLive -= 8;
+   }
+}
+
+
+/*---------------------------------------------*/
+static 
+void parPutUInt32 ( UInt32 u )
+{
+   parPutBits ( 16, (u >> 16) & 0xffffL );
+   parPutBits ( 16,  u        & 0xffffL );
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Append the nbits bits at p to the output.
+--*/
+static 
+void parPutBlock ( UChar* p, Int32 nbits )
+{
+   Int32 i, nbytes = nbits >> 3;
+
+   if (parLive == 0) {
+      parFlushObuf();
+      fwrite ( p, sizeof(UChar), nbytes, parHandle );
+      if (ferror(parHandle)) ioError();
+      parOutLo32 += nbytes;
+      if (parOutLo32 < (UInt32)nbytes) parOutHi32++;
+   } else {
+      for (i = 0; i < nbytes; i++) parPutBits ( 8, p[i] );
+   }
+   if (nbits & 7)
+      parPutBits ( nbits & 7, p[nbytes] >> (8 - (nbits & 7)) );
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Block the signals that mySignalCatcher handles,
+   so that they are taken by the main thread, and
+   leave the old mask in oset.  SIGSEGV and SIGBUS
+   are not blocked: a fault in a worker must still
+   reach mySIGSEGVorSIGBUScatcher.
+--*/
+static 
+void parBlockSignals ( sigset_t* oset )
+{
+   sigset_t set;
+
+   sigemptyset ( &set );
+   sigaddset ( &set, SIGINT );
+   sigaddset ( &set, SIGTERM );
+#  if BZ_UNIX
+   sigaddset ( &set, SIGHUP );
+#  endif
+   pthread_sigmask ( SIG_BLOCK, &set, oset );
+}
+
+
+/*---------------------------------------------*/
+static 
+void* parWorker ( void* arg )
+{
+   ParJob* job;
+   Int32   nbits;
+
+   (void)arg;
+   pthread_mutex_lock ( &parLock );
+   while (True) {
+      while (parNext == parAvail && !parQuit)
+         pthread_cond_wait ( &parWork, &parLock );
+      if (parNext == parAvail) break;
+      job = &parJobs[parNext % parNJobs];
+      parNext++;
+      pthread_mutex_unlock ( &parLock );
+
+      nbits = BZ2_compressBlockAlone ( (EState*)job->strm.state );
+
+      pthread_mutex_lock ( &parLock );
+      job->nbits = nbits;
+      job->done  = True;
+      pthread_cond_broadcast ( &parDone );
+   }
+   pthread_mutex_unlock ( &parLock );
+   return NULL;
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Wait for the job to be done and write its block.
+--*/
+static 
+void parWrite ( ParJob* job )
+{
+   EState* s = (EState*)job->strm.state;
+
+   pthread_mutex_lock ( &parLock );
+   while (!job->done) pthread_cond_wait ( &parDone, &parLock );
+   pthread_mutex_unlock ( &parLock );
+
+   if (s->nblock > 0) {
+      parCombinedCRC = (parCombinedCRC << 1) | (parCombinedCRC >> 31);
+      parCombinedCRC ^= s->blockCRC;
+      if (verbosity >= 2)
+         fprintf ( stderr, "    block %d: crc = 0x%8x, "
+                   "combined CRC = 0x%8x, size = %d\n",
+                   s->blockNo, s->blockCRC, parCombinedCRC, s->nblock );
+      parPutBlock ( s->zbits, job->nbits );
+      if (showStats) statsAdd ( &job->stats );
+   }
+}
+
+
+/*---------------------------------------------*/
+static 
+void parCompressStream ( FILE *stream, FILE *zStream,
+                         UInt32 *nbytes_in_lo32,
+                         UInt32 *nbytes_in_hi32,
+                         UInt32 *nbytes_out_lo32,
+                         UInt32 *nbytes_out_hi32 )
+{
+   pthread_t* tid;
+   sigset_t   oset;
+   ParJob*    job;
+   EState*    s;
+   UChar      ibuf[5000];
+   UChar*     next   = ibuf;
+   Int32      nIbuf  = 0;
+   UInt32     in_ch  = 256;
+   Int32      in_len = 0;
+   Bool       eof    = False;
+   UInt32     seq;
+   Int32      i, ret;
+
+   parNJobs = 2 * numThreads;
+   parJobs  = (ParJob*) myMalloc ( parNJobs * sizeof(ParJob) );
+   for (i = 0; i < (Int32)parNJobs; i++) {
+      parJobs[i].strm.bzalloc = NULL;
+      parJobs[i].strm.bzfree  = NULL;
+      parJobs[i].strm.opaque  = NULL;
+      ret = BZ2_bzCompressInit ( &parJobs[i].strm, blockSize100k,
+                                 verbosity, workFactor );
+      if (ret == BZ_MEM_ERROR) outOfMemory();
+      if (ret != BZ_OK) configError();
+      BZ2_bzCompressSorter ( &parJobs[i].strm, blockSorter );
+      BZ2_bzCompressEffort ( &parJobs[i].strm, tableEffort );
+      if (showStats)
+         BZ2_bzCompressStats ( &parJobs[i].strm, statsBlock, 
+                               &parJobs[i].stats );
+      parJobs[i].done = False;
+   }
+   parAvail = parNext = 0;
+   parQuit  = False;
+
+   parHandle      = zStream;
+   parBuff        = 0;
+   parLive        = 0;
+   parNObuf       = 0;
+   parOutLo32     = parOutHi32 = 0;
+   parCombinedCRC = 0;
+   *nbytes_in_lo32 = *nbytes_in_hi32 = 0;
+
+   parPutBits ( 8, BZ_HDR_B );
+   parPutBits ( 8, BZ_HDR_Z );
+   parPutBits ( 8, BZ_HDR_h );
+   parPutBits ( 8, BZ_HDR_0 + blockSize100k );
+
+   tid = (pthread_t*) myMalloc ( numThreads * sizeof(pthread_t) );
+   parBlockSignals ( &oset );
+   for (i = 0; i < numThreads; i++)
+      if (pthread_create ( &tid[i], NULL, parWorker, NULL ) != 0)
+         panic ( "compress:cannot create thread" );
+   pthread_sigmask ( SIG_SETMASK, &oset, NULL );
+
+   for (seq = 0; ; seq++) {
+      job = &parJobs[seq % parNJobs];
+      if (seq >= parNJobs) parWrite ( job );
+      s = (EState*)job->strm.state;
+
+      /*-- the run pending at the end of the previous block --*/
+      prepare_new_block ( s );
+      s->blockNo      = seq + 1;
+      s->state_in_ch  = in_ch;
+      s->state_in_len = in_len;
+      s->statsIn0     = s->strm->total_in_lo32 - (UInt32)in_len;
+      job->done       = False;
+
+      while (s->nblock < s->nblockMAX) {
+         if (nIbuf == 0) {
+            if (myfeof(stream)) { eof = True; break; }
+            nIbuf = fread ( ibuf, sizeof(UChar), 5000, stream );
+            if (ferror(stream)) ioError();
+            next = ibuf;
+            *nbytes_in_lo32 += nIbuf;
+            if (*nbytes_in_lo32 < (UInt32)nIbuf) (*nbytes_in_hi32)++;
+            continue;
+         }
+         s->strm->next_in  = (char*)next;
+         s->strm->avail_in = nIbuf;
+         copy_input_until_stop ( s );
+         next  = (UChar*)s->strm->next_in;
+         nIbuf = s->strm->avail_in;
+      }
+      if (eof) flush_RL ( s );
+      in_ch  = s->state_in_ch;
+      in_len = s->state_in_len;
+
+      pthread_mutex_lock ( &parLock );
+      parAvail = seq + 1;
+      pthread_cond_signal ( &parWork );
+      pthread_mutex_unlock ( &parLock );
+
+      if (eof) break;
+   }
+
+   /*-- write the jobs still in the ring, and the trailer --*/
+   for (seq = seq + 1 > parNJobs ? seq + 1 - parNJobs : 0; 
+        seq < parAvail; seq++)
+      parWrite ( &parJobs[seq % parNJobs] );
+
+   parPutBits ( 8, 0x17 ); parPutBits ( 8, 0x72 );
+   parPutBits ( 8, 0x45 ); parPutBits ( 8, 0x38 );
+   parPutBits ( 8, 0x50 ); parPutBits ( 8, 0x90 );
+   parPutUInt32 ( parCombinedCRC );
+   if (verbosity >= 2)
+      fprintf ( stderr, "    final combined CRC = 0x%x\n   ", 
+                parCombinedCRC );
+   if (parLive > 0) parPutBits ( 8 - parLive, 0 );
+   parFlushObuf();
+   *nbytes_out_lo32 = parOutLo32;
+   *nbytes_out_hi32 = parOutHi32;
+
+   pthread_mutex_lock ( &parLock );
+   parQuit = True;
+   pthread_cond_broadcast ( &parWork );
+   pthread_mutex_unlock ( &parLock );
+   for (i = 0; i < numThreads; i++) pthread_join ( tid[i], NULL );
+   free ( tid );
+   for (i = 0; i < (Int32)parNJobs; i++)
+      BZ2_bzCompressEnd ( &parJobs[i].strm );
+   free ( parJobs );
+}
+
+
+/*--
+   Decompression.  A regular input file is mapped,
+   and scanned at bit granularity for the 48-bit
+   magic numbers which start a block (0x314159265359)
+   or end a stream (0x177245385090).  Each range from
+   one magic to the next is taken to be a block, and
+   a worker decodes it on its own, with its own
+   DState, as a stream of one block: a stream header,
+   the block shifted to a byte boundary, and a stream
+   trailer whose CRC is the block CRC.  The decoder
+   then checks the block CRC as usual.
+
+   The magic numbers may also occur by chance inside
+   the coded data, so a range is only a candidate.
+   The main thread takes the blocks in order from the
+   end of the last good one.  When a block fails to
+   decode, it decodes it again itself up to the next
+   magic, and so on, until it decodes or exceeds the
+   largest possible block; then the data is bad.  It
+   also checks the stream CRCs, and goes on with the
+   next stream of a concatenated file.
+
+   Input that is not a regular file, and -s, use the
+   serial code.
+
+   Testing (-t) works the same way, with no output:
+   a worker keeps only the last part of a block it
+   decodes, since the decoder checks the block CRC.
+   The good blocks are listed in parBlocks, for
+   --verify-json.
+--*/
+
+typedef unsigned long ParPos;     /* a bit offset in the input */
+
+#define PAR_NONE ((ParPos)(-1))
+
+/*-- A generous bound on the coded length of a block:
+     codes are at most 20 bits, plus the tables. --*/
+#define PAR_MAXBITS(lev) ((ParPos)(lev) * 100000 * 24 + 1000000)
+
+/*-- A bound on the decoded length of a block: each
+     run of 4 and its count give at most 259 bytes. --*/
+#define PAR_MAXOUT(lev) ((size_t)(lev) * 100000 * 52)
+
+typedef
+   struct {
+      ParPos  start;       /* first bit of the block magic */
+      ParPos  end;         /* first bit of the next magic */
+      Bool    eos;         /* the next magic ends the stream */
+      Int32   level;       /* block size of the stream, 1 .. 9 */
+      Int32   err;         /* BZ_OK, or why the block is bad */
+      UChar*  in;          /* the block as a stream of its own */
+      size_t  insize;
+      UChar*  out;         /* the decompressed block */
+      size_t  outlen;
+      size_t  outsize;
+      Bool    done;        /* set when err and out are valid */
+   }
+   ParUnJob;
+
+#define PAR_NMEM 3
+
+/*-- The DState, tt and unbwtBuf of a decoding thread, kept from
+     one block to the next, which saves faulting them
+     in again, and keeps them in its cache. --*/
+typedef
+   struct {
+      void*   mem[PAR_NMEM];
+      Int32   size[PAR_NMEM];
+      Bool    used[PAR_NMEM];
+   }
+   ParMem;
+
+typedef
+   struct {
+      Int32   stream;      /* 1 .. */
+      Int32   block;       /* 1 .. in its stream */
+      ParPos  start;       /* first bit of the block magic */
+      ParPos  end;
+      UInt32  crc;
+   }
+   ParBlock;
+
+static ParUnJob* parUnJobs;
+static ParUnJob  parSpare;   /* for blocks the main thread decodes */
+static Bool      parTesting; /* no output, only the CRCs */
+static ParBlock* parBlocks;  /* the good blocks, with --verify-json */
+static Int32     parNBlocks;
+static Int32     parMaxBlocks;
+static ParMem    parMainMem;
+static UChar*    parIn;      /* the mapped input */
+static size_t    parInSize;
+static ParPos    parInBits;
+
+/*-- the end of the last good block, its stream and
+     the number of blocks of the stream so far --*/
+static ParPos    parWpos;
+static Int32     parWlevel;
+static Int32     parStreamNo;
+static Int32     parBlockNo;
+
+
+/*---------------------------------------------*/
+/*--
+   Return the n <= 24 bits at bit offset pos of the
+   input, reading zeros after its end.
+--*/
+static 
+UInt32 parGetBits ( ParPos pos, Int32 n )
+{
+   size_t i = pos >> 3;
+   UInt32 v = 0;
+   Int32  k;
+
+   for (k = 0; k < 4; k++, i++) 
+      v = (v << 8) | (i < parInSize ? parIn[i] : 0);
+   return (v << (pos & 7)) >> (32 - n);
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Find the first block or stream end magic at or
+   after bit offset from.  Return PAR_NONE if there
+   is none.
+--*/
+static 
+ParPos parScan ( ParPos from, Bool* eos )
+{
+   size_t b = from >> 3;
+   UInt32 hi, w;
+   UChar  nx;
+   Int32  k;
+
+   if (parInSize < 6 || from + 48 > parInBits) return PAR_NONE;
+   hi = ((UInt32)parIn[b] << 24) | (parIn[b+1] << 16) |
+        (parIn[b+2] << 8) | parIn[b+3];
+   k  = from & 7;
+   for (; 8 * (ParPos)b + 48 <= parInBits; b++) {
+      nx = b + 4 < parInSize ? parIn[b+4] : 0;
+      for (; k < 8; k++) {
+         w = k == 0 ? hi : (hi << k) | (nx >> (8 - k));
+         if (w == 0x31415926 || w == 0x17724538) {
+            ParPos pos = 8 * (ParPos)b + k;
+            if (pos + 48 > parInBits) return PAR_NONE;
+            w = (w << 16) | parGetBits ( pos + 32, 16 );
+            if (w == 0x59265359 || w == 0x45385090) {
+               *eos = (Bool)(w == 0x45385090);
+               return pos;
+            }
+         }
+      }
+      k  = 0;
+      hi = (hi << 8) | nx;
+   }
+   return PAR_NONE;
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Read the stream header at byte b.  Set *start to
+   the offset of its first block, and *level.
+   Return BZ_OK, BZ_STREAM_END at the end of the
+   input, BZ_DATA_ERROR_MAGIC if there is no header,
+   or BZ_UNEXPECTED_EOF if it is cut short.
+--*/
+static 
+Int32 parStream ( size_t b, ParPos* start, Int32* level )
+{
+   static UChar hdr[3] = { BZ_HDR_B, BZ_HDR_Z, BZ_HDR_h };
+   size_t i;
+
+   if (b >= parInSize) return BZ_STREAM_END;
+   for (i = 0; i < 4; i++) {
+      if (b + i >= parInSize) return BZ_UNEXPECTED_EOF;
+      if (i < 3 && parIn[b+i] != hdr[i]) return BZ_DATA_ERROR_MAGIC;
+   }
+   if (parIn[b+3] < BZ_HDR_0 + 1 || parIn[b+3] > BZ_HDR_0 + 9) 
+      return BZ_DATA_ERROR_MAGIC;
+   *level = parIn[b+3] - BZ_HDR_0;
+   *start = 8 * (ParPos)(b + 4);
+   return BZ_OK;
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Set bits pos .. pos+n-1 of p to the n low bits
+   of v.
+--*/
+static 
+void parStoreBits ( UChar* p, ParPos pos, Int32 n, UInt32 v )
+{
+   UChar bit;
+
+   for (; n > 0; n--, pos++) {
+      bit = (UChar)(0x80 >> (pos & 7));
+      if ((v >> (n - 1)) & 1)
+         p[pos >> 3] |= bit; else
+         p[pos >> 3] &= ~bit;
+   }
+}
+
+
+/*---------------------------------------------*/
+/*--
+   The allocator of the decoders, opaque is a ParMem.
+--*/
+static 
+void* parAlloc ( void* opaque, Int32 items, Int32 size )
+{
+   ParMem* m = (ParMem*)opaque;
+   Int32   i, n = items * size;
+
+   for (i = 0; i < PAR_NMEM; i++)
+      if (m->mem[i] != NULL && !m->used[i] && m->size[i] == n) {
+         m->used[i] = True;
+         return m->mem[i];
+      }
+   for (i = 0; i < PAR_NMEM; i++)
+      if (!m->used[i]) {
+         free ( m->mem[i] );
+         m->mem[i] = malloc ( n );
+         if (m->mem[i] == NULL) return NULL;
+         m->size[i] = n;
+         m->used[i] = True;
+         return m->mem[i];
+      }
+   return malloc ( n );
+}
+
+static 
+void parFree ( void* opaque, void* addr )
+{
+   ParMem* m = (ParMem*)opaque;
+   Int32   i;
+
+   for (i = 0; i < PAR_NMEM; i++)
+      if (addr == m->mem[i]) {
+         m->used[i] = False;
+         return;
+      }
+   free ( addr );
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Decode the block job->start .. job->end - 1 into
+   job->out, with the memory of the thread m.  Sets
+   job->err.
+--*/
+static 
+void parDecode ( ParUnJob* job, ParMem* m )
+{
+   ParPos    nbits = job->end - job->start;
+   size_t    b     = job->start >> 3;
+   Int32     k     = job->start & 7;
+   Int32     nbytes, i, ret;
+   size_t    need, total;
+   size_t    max   = PAR_MAXOUT(job->level);
+   UInt32    crc;
+   bz_stream strm;
+   void*     p;
+
+   job->outlen = 0;
+   job->err    = BZ_OK;
+   if (nbits == 0) return;              /* an empty stream */
+   if (nbits > PAR_MAXBITS(job->level)) {
+      job->err = BZ_DATA_ERROR;
+      return;
+   }
+
+   nbytes = (Int32)((nbits + 7) >> 3);
+   need   = 4 + (size_t)nbytes + 11;
+   if (job->insize < need) {
+      p = realloc ( job->in, need );
+      if (p == NULL) { job->err = BZ_MEM_ERROR; return; }
+      job->in     = (UChar*)p;
+      job->insize = need;
+   }
+   job->in[0] = BZ_HDR_B;
+   job->in[1] = BZ_HDR_Z;
+   job->in[2] = BZ_HDR_h;
+   job->in[3] = (UChar)(BZ_HDR_0 + job->level);
+   for (i = 0; i < nbytes; i++)
+      job->in[4+i] = k == 0 ? parIn[b+i] :
+         (UChar)((parIn[b+i] << k) | 
+                 (b+i+1 < parInSize ? parIn[b+i+1] >> (8 - k) : 0));
+   crc = (parGetBits ( job->start + 48, 16 ) << 16) |
+          parGetBits ( job->start + 64, 16 );
+   parStoreBits ( job->in, 32 + nbits, 24, 0x177245 );
+   parStoreBits ( job->in, 56 + nbits, 24, 0x385090 );
+   parStoreBits ( job->in, 80 + nbits, 16, crc >> 16 );
+   parStoreBits ( job->in, 96 + nbits, 16, crc & 0xffff );
+
+   strm.bzalloc = parAlloc;
+   strm.bzfree  = parFree;
+   strm.opaque  = (void*)m;
+   ret = BZ2_bzDecompressInit ( &strm, 0, 0 );
+   if (ret != BZ_OK) { job->err = ret; return; }
+   strm.next_in  = (char*)job->in;
+   strm.avail_in = (112 + nbits + 7) >> 3;
+   total = 0;
+   while (True) {
+      if (job->outlen == job->outsize) {
+         if (total + job->outlen >= max) { ret = BZ_DATA_ERROR; break; }
+         if (parTesting && job->outsize > 0) {
+            total      += job->outlen;
+            job->outlen = 0;
+         } else {
+            need = job->outsize ? 2 * job->outsize
+                                : 100000 * (size_t)job->level;
+            if (need > max) need = max;
+            p = realloc ( job->out, need );
+            if (p == NULL) { ret = BZ_MEM_ERROR; break; }
+            job->out     = (UChar*)p;
+            job->outsize = need;
+         }
+      }
+      strm.next_out  = (char*)job->out + job->outlen;
+      strm.avail_out = (unsigned int)(job->outsize - job->outlen);
+      ret = BZ2_bzDecompress ( &strm );
+      job->outlen = job->outsize - strm.avail_out;
+      if (ret != BZ_OK) break;
+      if (strm.avail_out > 0) { ret = BZ_UNEXPECTED_EOF; break; }
+   }
+   if (ret == BZ_STREAM_END) 
+      ret = strm.avail_in == 0 ? BZ_OK : BZ_DATA_ERROR;
+   job->err = ret;
+   BZ2_bzDecompressEnd ( &strm );
+}
+
+
+/*---------------------------------------------*/
+static 
+void* parUnWorker ( void* arg )
+{
+   ParUnJob* job;
+   ParMem    m;
+   Int32     i;
+
+   (void)arg;
+   for (i = 0; i < PAR_NMEM; i++) {
+      m.mem[i]  = NULL;
+      m.used[i] = False;
+   }
+
+   pthread_mutex_lock ( &parLock );
+   while (True) {
+      while (parNext == parAvail && !parQuit)
+         pthread_cond_wait ( &parWork, &parLock );
+      if (parNext == parAvail) break;
+      job = &parUnJobs[parNext % parNJobs];
+      parNext++;
+      pthread_mutex_unlock ( &parLock );
+
+      parDecode ( job, &m );
+
+      pthread_mutex_lock ( &parLock );
+      job->done = True;
+      pthread_cond_broadcast ( &parDone );
+   }
+   pthread_mutex_unlock ( &parLock );
+   for (i = 0; i < PAR_NMEM; i++) free ( m.mem[i] );
+   return NULL;
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Write the good block in job, which starts at
+   parWpos, and check the stream CRC if the stream
+   ends there.  Return BZ_OK to go on, BZ_STREAM_END
+   at the end of the input, or an error.
+--*/
+static 
+Int32 parEmit ( ParUnJob* job, FILE* stream )
+{
+   UInt32    crc;
+   ParBlock* pb;
+
+   if (job->end > job->start) {
+      crc = (parGetBits ( job->start + 48, 16 ) << 16) |
+             parGetBits ( job->start + 64, 16 );
+      parCombinedCRC = (parCombinedCRC << 1) | (parCombinedCRC >> 31);
+      parCombinedCRC ^= crc;
+      parBlockNo++;
+      if (!parTesting) {
+         if (job->outlen > 0)
+            fwrite ( job->out, sizeof(UChar), job->outlen, stream );
+         if (ferror(stream)) ioError();
+      }
+      if (verifyJson) {
+         if (parNBlocks == parMaxBlocks) {
+            parMaxBlocks = parMaxBlocks ? 2 * parMaxBlocks : 64;
+            pb = realloc ( parBlocks, parMaxBlocks * sizeof(ParBlock) );
+            if (pb == NULL) outOfMemory ();
+            parBlocks = pb;
+         }
+         pb = &parBlocks[parNBlocks++];
+         pb->stream = parStreamNo;
+         pb->block  = parBlockNo;
+         pb->start  = job->start;
+         pb->end    = job->end;
+         pb->crc    = crc;
+      }
+   }
+   parWpos = job->end;
+   if (!job->eos) return BZ_OK;
+
+   if (job->end + 80 > parInBits) return BZ_UNEXPECTED_EOF;
+   crc = (parGetBits ( job->end + 48, 16 ) << 16) |
+          parGetBits ( job->end + 64, 16 );
+   if (crc != parCombinedCRC) return BZ_DATA_ERROR;
+   parCombinedCRC = 0;
+   parStreamNo++;
+   parBlockNo = 0;
+   return parStream ( (job->end + 80 + 7) >> 3, &parWpos, &parWlevel );
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Decode the block at parWpos in the main thread,
+   up to the first magic at or after from that gives
+   a good block, using job.  err is the error of the
+   attempts so far.
+--*/
+static 
+Int32 parDirect ( ParUnJob* job, ParPos from, Int32 err, FILE* stream )
+{
+   ParPos end = from;
+   Bool   eos;
+
+   while (True) {
+      end = parScan ( end, &eos );
+      if (end == PAR_NONE) 
+         return err != BZ_OK ? err : BZ_UNEXPECTED_EOF;
+      if (end == parWpos && !eos) { end++; continue; }
+      if (end - parWpos > PAR_MAXBITS(parWlevel))
+         return err != BZ_OK ? err : BZ_DATA_ERROR;
+      job->start = parWpos;
+      job->end   = end;
+      job->eos   = eos;
+      job->level = parWlevel;
+      parDecode ( job, &parMainMem );
+      if (job->err == BZ_MEM_ERROR) return BZ_MEM_ERROR;
+      if (job->err == BZ_OK) return parEmit ( job, stream );
+      if (err == BZ_OK) err = job->err;
+      end++;
+   }
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Take the next job in order: write it if it starts
+   at parWpos, skip it if that is inside the last good
+   block.
+--*/
+static 
+Int32 parTake ( ParUnJob* job, FILE* stream )
+{
+   Int32 err = BZ_OK;
+
+   pthread_mutex_lock ( &parLock );
+   while (!job->done) pthread_cond_wait ( &parDone, &parLock );
+   pthread_mutex_unlock ( &parLock );
+
+   while (err == BZ_OK && job->start > parWpos)
+      err = parDirect ( &parSpare, parWpos, BZ_OK, stream );
+   if (err != BZ_OK || job->start < parWpos) return err;
+   if (job->err == BZ_OK) return parEmit ( job, stream );
+   if (job->err == BZ_MEM_ERROR) return BZ_MEM_ERROR;
+   return parDirect ( job, job->end + 1, job->err, stream );
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Decompress zStream to stream, or test it if stream
+   is NULL.  Return False if the serial code must do
+   it, else set *bzerr to BZ_STREAM_END or the error,
+   and *streamNo.
+--*/
+static 
+Bool parUncompressStream ( FILE *zStream, FILE *stream, 
+                           Int32 *bzerr, Int32 *streamNo )
+{
+   struct MY_STAT statBuf;
+   pthread_t* tid;
+   sigset_t   oset;
+   ParUnJob*  job;
+   ParPos     spos, end;
+   Int32      slevel, err, i;
+   Bool       eos, more;
+   UInt32     seq, taken;
+   void*      map;
+
+   if (fstat ( fileno(zStream), &statBuf ) != 0 ||
+       !MY_S_ISREG(statBuf.st_mode) || statBuf.st_size < 4 ||
+       (ParPos)statBuf.st_size > (PAR_NONE >> 4))
+      return False;
+   parInSize = (size_t)statBuf.st_size;
+   map = mmap ( NULL, parInSize, PROT_READ, MAP_SHARED, 
+                fileno(zStream), 0 );
+   if (map == MAP_FAILED) return False;
+   parIn     = (UChar*)map;
+   parInBits = 8 * (ParPos)parInSize;
+   if (parStream ( 0, &parWpos, &parWlevel ) != BZ_OK) {
+      munmap ( map, parInSize );
+      return False;
+   }
+   parStreamNo    = 1;
+   parBlockNo     = 0;
+   parNBlocks     = 0;
+   parTesting     = (Bool)(stream == NULL);
+   parCombinedCRC = 0;
+
+   parNJobs  = 2 * numThreads;
+   parUnJobs = (ParUnJob*) myMalloc ( parNJobs * sizeof(ParUnJob) );
+   for (i = 0; i <= (Int32)parNJobs; i++) {
+      job = i < (Int32)parNJobs ? &parUnJobs[i] : &parSpare;
+      job->in     = job->out     = NULL;
+      job->insize = job->outsize = 0;
+   }
+   for (i = 0; i < PAR_NMEM; i++) {
+      parMainMem.mem[i]  = NULL;
+      parMainMem.used[i] = False;
+   }
+   parAvail = parNext = 0;
+   parQuit  = False;
+
+   tid = (pthread_t*) myMalloc ( numThreads * sizeof(pthread_t) );
+   parBlockSignals ( &oset );
+   for (i = 0; i < numThreads; i++)
+      if (pthread_create ( &tid[i], NULL, parUnWorker, NULL ) != 0)
+         panic ( "decompress:cannot create thread" );
+   pthread_sigmask ( SIG_SETMASK, &oset, NULL );
+
+   /*-- hand out the candidate blocks, writing the old ones --*/
+   err    = BZ_OK;
+   taken  = 0;
+   spos   = parWpos;
+   slevel = parWlevel;
+   more   = True;
+   for (seq = 0; more && err == BZ_OK; seq++) {
+      job = &parUnJobs[seq % parNJobs];
+      if (seq >= parNJobs) {
+         err = parTake ( job, stream );
+         taken++;
+         if (err != BZ_OK) break;
+      }
+
+      end = parScan ( spos, &eos );
+      if (end == spos && !eos) end = parScan ( spos + 1, &eos );
+      if (end == PAR_NONE) break;
+      job->start = spos;
+      job->end   = end;
+      job->eos   = eos;
+      job->level = slevel;
+      job->done  = False;
+      spos = end;
+      if (eos) 
+         more = (Bool)(parStream ( (end + 80 + 7) >> 3, 
+                                   &spos, &slevel ) == BZ_OK);
+
+      pthread_mutex_lock ( &parLock );
+      parAvail = seq + 1;
+      pthread_cond_signal ( &parWork );
+      pthread_mutex_unlock ( &parLock );
+   }
+   for (; taken < parAvail && err == BZ_OK; taken++)
+      err = parTake ( &parUnJobs[taken % parNJobs], stream );
+   while (err == BZ_OK)
+      err = parDirect ( &parSpare, parWpos, BZ_OK, stream );
+
+   pthread_mutex_lock ( &parLock );
+   parQuit = True;
+   pthread_cond_broadcast ( &parWork );
+   pthread_mutex_unlock ( &parLock );
+   for (i = 0; i < numThreads; i++) pthread_join ( tid[i], NULL );
+   free ( tid );
+   for (i = 0; i <= (Int32)parNJobs; i++) {
+      job = i < (Int32)parNJobs ? &parUnJobs[i] : &parSpare;
+      free ( job->in );
+      free ( job->out );
+   }
+   free ( parUnJobs );
+   parUnJobs = NULL;
+   for (i = 0; i < PAR_NMEM; i++) free ( parMainMem.mem[i] );
+   munmap ( map, parInSize );
+
+   *bzerr    = err;
+   *streamNo = parStreamNo;
+   return True;
+}
+
+
+/*--
+   Decompression in two threads (--pipeline), in
+   bounded memory, from any input.  The main thread
+   reads the input and decodes the Huffman and MTF
+   coding of each block into tt[], with splitBlocks
+   set, so that BZ2_decompress stops before undoing
+   the BWT.  It then swaps tt[] with that of a second
+   DState, the writer's, which undoes the BWT, checks
+   the block CRC and writes the block, while the main
+   thread decodes the next one.
+
+   So there are two tt[] of the block size, and one
+   unbwtBuf: at most 4.5M more than the serial code
+   for -9 files.  Both DStates are kept from one file
+   to the next, with their arrays, and the writer
+   runs on a small stack of its own.
+--*/
+
+#define PIPE_STACK 262144
+
+static bz_stream pipeDs;     /* decodes the symbols */
+static bz_stream pipeWs;     /* undoes the BWT */
+static Bool      pipeReady;  /* set when they are initialised */
+static Bool      pipeFull;   /* set while the writer has a block */
+static Int32     pipeErr;    /* BZ_OK, or why the writer failed */
+static FILE*     pipeStream;
+
+/*---------------------------------------------*/
+static 
+Int32 pipeOutput ( DState* w )
+{
+   UChar obuf[5000];
+   Int32 n;
+
+   BZ2_unBwtSetup ( w, w->save_nblock );
+   do {
+      w->strm->next_out  = (char*)obuf;
+      w->strm->avail_out = 5000;
+      unRLE_obuf_to_output_FAST ( w );
+      n = 5000 - w->strm->avail_out;
+      if (n > 0) fwrite ( obuf, sizeof(UChar), n, pipeStream );
+      if (ferror(pipeStream)) return BZ_IO_ERROR;
+   }
+      while (w->nblock_used != w->save_nblock+1 || w->state_out_len != 0);
+
+   BZ_FINALISE_CRC ( w->calculatedBlockCRC );
+   if (verbosity >= 2) 
+      fprintf ( stderr, "\n    [%d: huff+mtf rt+rld", w->currBlockNo );
+   if (verbosity >= 3) 
+      fprintf ( stderr, " {0x%x, 0x%x}", w->storedBlockCRC, 
+                w->calculatedBlockCRC );
+   if (verbosity >= 2) fprintf ( stderr, "]" );
+   if (w->calculatedBlockCRC != w->storedBlockCRC) return BZ_DATA_ERROR;
+   w->calculatedCombinedCRC = (w->calculatedCombinedCRC << 1) | 
+                              (w->calculatedCombinedCRC >> 31);
+   w->calculatedCombinedCRC ^= w->calculatedBlockCRC;
+   return BZ_OK;
+}
+
+
+/*---------------------------------------------*/
+static 
+void* pipeWriter ( void* arg )
+{
+   Int32 err;
+
+   (void)arg;
+   pthread_mutex_lock ( &parLock );
+   while (True) {
+      while (!pipeFull && !parQuit)
+         pthread_cond_wait ( &parWork, &parLock );
+      if (!pipeFull) break;
+      pthread_mutex_unlock ( &parLock );
+
+      err = pipeOutput ( (DState*)pipeWs.state );
+
+      pthread_mutex_lock ( &parLock );
+      if (pipeErr == BZ_OK) pipeErr = err;
+      pipeFull = False;
+      pthread_cond_signal ( &parDone );
+   }
+   pthread_mutex_unlock ( &parLock );
+   return NULL;
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Wait until the writer is idle.
+--*/
+static 
+Int32 pipeWait ( void )
+{
+   Int32 err;
+
+   pthread_mutex_lock ( &parLock );
+   while (pipeFull) pthread_cond_wait ( &parDone, &parLock );
+   err = pipeErr;
+   pthread_mutex_unlock ( &parLock );
+   return err;
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Hand the block the decoder has just finished to
+   the idle writer, and give the decoder the tt[] of
+   the writer's last block, which is made as large as
+   the one it replaces: the decoder only allocates
+   tt[] at the stream header.
+--*/
+static 
+void pipeHandOff ( DState* d, DState* w )
+{
+   UInt32* tt   = w->tt;
+   Int32   size = w->allocSize100k;
+   Int32   i;
+
+   if (size < d->allocSize100k) {
+      free ( tt );
+      size = d->allocSize100k;
+      tt   = myMalloc ( size * 100000 * sizeof(UInt32) );
+   }
+   w->tt            = d->tt;
+   w->allocSize100k = d->allocSize100k;
+   d->tt            = tt;
+   d->allocSize100k = size;
+
+   if (w->unbwtBuf == NULL)
+      w->unbwtBuf = myMalloc ( 900000 + BZ_UNBWT_PWAYS * BZ_UNBWT_CHUNK );
+   w->save_nblock     = d->save_nblock;
+   w->origPtr         = d->origPtr;
+   w->blockRandomised = d->blockRandomised;
+   w->storedBlockCRC  = d->storedBlockCRC;
+   w->currBlockNo     = d->currBlockNo;
+   for (i = 0; i < 256; i++) w->unzftab[i] = d->unzftab[i];
+   d->state = BZ_X_BLKHDR_1;
+
+   pthread_mutex_lock ( &parLock );
+   pipeFull = True;
+   pthread_cond_signal ( &parWork );
+   pthread_mutex_unlock ( &parLock );
+}
+
+
+/*---------------------------------------------*/
+static 
+Bool pipeUncompressStream ( FILE *zStream, FILE *stream, 
+                            Int32 *bzerr, Int32 *streamNo )
+{
+   pthread_t      tid;
+   pthread_attr_t attr;
+   sigset_t       oset;
+   DState*        d;
+   DState*        w;
+   UChar          ibuf[BZ_MAX_UNUSED];
+   Int32          n, r, err;
+
+   if (!pipeReady) {
+      pipeDs.bzalloc = pipeWs.bzalloc = NULL;
+      pipeDs.bzfree  = pipeWs.bzfree  = NULL;
+      pipeDs.opaque  = pipeWs.opaque  = NULL;
+      if (BZ2_bzDecompressInit ( &pipeDs, 0, 0 ) != BZ_OK) return False;
+      if (BZ2_bzDecompressInit ( &pipeWs, 0, 0 ) != BZ_OK) {
+         BZ2_bzDecompressEnd ( &pipeDs );
+         return False;
+      }
+      d = (DState*)pipeDs.state;
+      d->splitBlocks = True;
+      d->unbwt       = BZ_UNBWT_CLASSIC;
+      pipeReady = True;
+   }
+   BZ2_bzDecompressReset ( &pipeDs );
+   d = (DState*)pipeDs.state;
+   w = (DState*)pipeWs.state;
+   w->calculatedCombinedCRC = 0;
+   pipeDs.avail_in = 0;
+
+   pipeStream = stream;
+   pipeFull   = False;
+   pipeErr    = BZ_OK;
+   parQuit    = False;
+   pthread_attr_init ( &attr );
+   pthread_attr_setstacksize ( &attr, PIPE_STACK );
+   parBlockSignals ( &oset );
+   if (pthread_create ( &tid, &attr, pipeWriter, NULL ) != 0)
+      panic ( "decompress:cannot create thread" );
+   pthread_sigmask ( SIG_SETMASK, &oset, NULL );
+   pthread_attr_destroy ( &attr );
+
+   *streamNo = 1;
+   while (True) {
+      if (pipeDs.avail_in == 0 && !myfeof(zStream)) {
+         n = fread ( ibuf, sizeof(UChar), BZ_MAX_UNUSED, zStream );
+         if (ferror(zStream)) { err = BZ_IO_ERROR; break; }
+         pipeDs.next_in  = (char*)ibuf;
+         pipeDs.avail_in = n;
+      }
+
+      r = BZ2_decompress ( d );
+      if (r == BZ_OK && d->state == BZ_X_SPLIT) {
+         err = pipeWait();
+         if (err != BZ_OK) break;
+         pipeHandOff ( d, w );
+         continue;
+      }
+      if (r == BZ_STREAM_END) {
+         err = pipeWait();
+         if (err != BZ_OK) break;
+         if (verbosity >= 3)
+            fprintf ( stderr, "\n    combined CRCs: stored = 0x%x, "
+                      "computed = 0x%x", d->storedCombinedCRC, 
+                      w->calculatedCombinedCRC );
+         if (w->calculatedCombinedCRC != d->storedCombinedCRC) {
+            err = BZ_DATA_ERROR;
+            break;
+         }
+         if (pipeDs.avail_in == 0 && myfeof(zStream)) {
+            err = BZ_STREAM_END;
+            break;
+         }
+         BZ2_bzDecompressReset ( &pipeDs );
+         w->calculatedCombinedCRC = 0;
+         (*streamNo)++;
+         continue;
+      }
+      if (r != BZ_OK) { err = r; break; }
+      if (pipeDs.avail_in == 0 && myfeof(zStream)) {
+         err = BZ_UNEXPECTED_EOF;
+         break;
+      }
+   }
+
+   /*-- an error in an earlier block comes first --*/
+   r = pipeWait();
+   if (r != BZ_OK) err = r;
+   pthread_mutex_lock ( &parLock );
+   parQuit = True;
+   pthread_cond_broadcast ( &parWork );
+   pthread_mutex_unlock ( &parLock );
+   pthread_join ( tid, NULL );
+
+   *bzerr = err;
+   return True;
+}
+
+#endif /* BZ_THREADS */
+
+
 /*---------------------------------------------------*/
 /*--- Processing of complete files and streams    ---*/
 /*---------------------------------------------------*/
@@ -5326,28 +7661,43 @@ void compressStream ( FILE *stream, FILE *zStream )
 
    if (ferror(stream)) goto errhandler_io;
    if (ferror(zStream)) goto errhandler_io;
+   statsReset();
+
+#  if BZ_THREADS
+   if (numThreads > 1) {
+      if (verbosity >= 2) fprintf ( stderr, "\n" );
+      parCompressStream ( stream, zStream,
+                          &nbytes_in_lo32, &nbytes_in_hi32,
+                          &nbytes_out_lo32, &nbytes_out_hi32 );
+   } else
+#  endif
+   {
+      bzf = BZ2_bzWriteOpen ( &bzerr, zStream, 
+                              blockSize100k, verbosity, workFactor );   
+      if (bzerr != BZ_OK) goto errhandler;
+      BZ2_bzCompressSorter ( &((bzFile*)bzf)->strm, blockSorter );
+      BZ2_bzCompressEffort ( &((bzFile*)bzf)->strm, tableEffort );
+      if (showStats)
+         BZ2_bzCompressStats ( &((bzFile*)bzf)->strm, statsBlock, NULL );
+
+      if (verbosity >= 2) fprintf ( stderr, "\n" );
 
-   bzf = BZ2_bzWriteOpen ( &bzerr, zStream, 
-                           blockSize100k, verbosity, workFactor );   
-   if (bzerr != BZ_OK) goto errhandler;
+      while (True) {
 
-   if (verbosity >= 2) fprintf ( stderr, "\n" );
+         if (myfeof(stream)) break;
+         nIbuf = fread ( ibuf, sizeof(UChar), 5000, stream );
+         if (ferror(stream)) goto errhandler_io;
+         if (nIbuf > 0) BZ2_bzWrite ( &bzerr, bzf, (void*)ibuf, nIbuf );
+         if (bzerr != BZ_OK) goto errhandler;
 
-   while (True) {
+      }
 
-      if (myfeof(stream)) break;
-      nIbuf = fread ( ibuf, sizeof(UChar), 5000, stream );
-      if (ferror(stream)) goto errhandler_io;
-      if (nIbuf > 0) BZ2_bzWrite ( &bzerr, bzf, (void*)ibuf, nIbuf );
+      BZ2_bzWriteClose64 ( &bzerr, bzf, 0, 
+                           &nbytes_in_lo32, &nbytes_in_hi32,
+                           &nbytes_out_lo32, &nbytes_out_hi32 );
       if (bzerr != BZ_OK) goto errhandler;
-
    }
 
-   BZ2_bzWriteClose64 ( &bzerr, bzf, 0, 
-                        &nbytes_in_lo32, &nbytes_in_hi32,
-                        &nbytes_out_lo32, &nbytes_out_hi32 );
-   if (bzerr != BZ_OK) goto errhandler;
-
    if (ferror(zStream)) goto errhandler_io;
    ret = fflush ( zStream );
    if (ret == EOF) goto errhandler_io;
@@ -5360,6 +7710,7 @@ void compressStream ( FILE *stream, FILE *zStream )
    if (ferror(stream)) goto errhandler_io;
    ret = fclose ( stream );
    if (ret == EOF) goto errhandler_io;
+   if (showStats) statsTotal();
 
    if (verbosity >= 1) {
       if (nbytes_in_lo32 == 0 && nbytes_in_hi32 == 0) {
@@ -5431,6 +7782,20 @@ Bool uncompressStream ( FILE *zStream, FILE *stream )
    if (ferror(stream)) goto errhandler_io;
    if (ferror(zStream)) goto errhandler_io;
 
+#  if BZ_THREADS
+   if (numThreads > 1 && !smallMode &&
+       parUncompressStream ( zStream, stream, &bzerr, &streamNo )) {
+      if (bzerr == BZ_STREAM_END) goto closeok;
+      goto errhandler;
+   }
+   if (pipeline && !smallMode &&
+       pipeUncompressStream ( zStream, stream, &bzerr, &streamNo )) {
+      if (bzerr == BZ_STREAM_END) goto closeok;
+      if (bzerr == BZ_DATA_ERROR_MAGIC && streamNo == 1) goto trycat;
+      goto errhandler;
+   }
+#  endif
+
    while (True) {
 
       bzf = BZ2_bzReadOpen ( 
@@ -5525,6 +7890,54 @@ Bool uncompressStream ( FILE *zStream, FILE *stream )
 }
 
 
+/*---------------------------------------------*/
+/*--
+   --verify-json: a line of JSON on stdout for each
+   file tested.  When the parallel code tested it,
+   the line lists the good blocks, with their bit
+   offsets in the file, and gives the offset of the
+   first bad one, if any; the serial code gives only
+   the status.
+--*/
+static 
+void verifyReport ( Char* status, Bool blocks, Int32 streamNo )
+{
+   Char* p;
+
+   fprintf ( stdout, "{\"file\": \"" );
+   for (p = inName; *p != '\0'; p++) {
+      if (*p == '"' || *p == '\\')
+         fprintf ( stdout, "\\%c", *p ); else
+      if ((UChar)*p < 0x20)
+         fprintf ( stdout, "\\u%04x", (UChar)*p ); else
+         fputc ( *p, stdout );
+   }
+   fprintf ( stdout, "\", \"status\": \"%s\", \"streams\": %d", 
+             status, streamNo );
+#  if BZ_THREADS
+   if (blocks) {
+      Int32 i;
+      if (strcmp ( status, "ok" ) != 0 &&
+          strcmp ( status, "trailing_garbage" ) != 0)
+         fprintf ( stdout, ", \"error_offset\": %lu", parWpos );
+      fprintf ( stdout, ", \"blocks\": [" );
+      for (i = 0; i < parNBlocks; i++)
+         fprintf ( stdout, "%s{\"stream\": %d, \"block\": %d, "
+                   "\"offset\": %lu, \"bits\": %lu, "
+                   "\"crc\": \"0x%08x\", \"status\": \"ok\"}",
+                   i == 0 ? "" : ", ", 
+                   parBlocks[i].stream, parBlocks[i].block,
+                   parBlocks[i].start, 
+                   parBlocks[i].end - parBlocks[i].start, 
+                   parBlocks[i].crc );
+      fprintf ( stdout, "]" );
+   }
+#  endif
+   fprintf ( stdout, "}\n" );
+   fflush ( stdout );
+}
+
+
 /*---------------------------------------------*/
 static 
 Bool testStream ( FILE *zStream )
@@ -5535,6 +7948,7 @@ Bool testStream ( FILE *zStream )
    UChar   unused[BZ_MAX_UNUSED];
    Int32   nUnused;
    UChar*  unusedTmp;
+   Bool    blocks = False;
 
    nUnused = 0;
    streamNo = 0;
@@ -5542,6 +7956,15 @@ Bool testStream ( FILE *zStream )
    SET_BINARY_MODE(zStream);
    if (ferror(zStream)) goto errhandler_io;
 
+#  if BZ_THREADS
+   if ((numThreads > 1 || verifyJson) && !smallMode &&
+       parUncompressStream ( zStream, NULL, &bzerr, &streamNo )) {
+      blocks = True;
+      if (bzerr == BZ_STREAM_END) { streamNo--; goto closeok; }
+      goto errhandler;
+   }
+#  endif
+
    while (True) {
 
       bzf = BZ2_bzReadOpen ( 
@@ -5568,10 +7991,12 @@ Bool testStream ( FILE *zStream )
 
    }
 
+   closeok:
    if (ferror(zStream)) goto errhandler_io;
    ret = fclose ( zStream );
    if (ret == EOF) goto errhandler_io;
 
+   if (verifyJson) verifyReport ( "ok", blocks, streamNo );
    if (verbosity >= 2) fprintf ( stderr, "\n    " );
    return True;
 
@@ -5588,23 +8013,29 @@ Bool testStream ( FILE *zStream )
       case BZ_DATA_ERROR:
          fprintf ( stderr,
                    "data integrity (CRC) error in data\n" );
+         if (verifyJson) verifyReport ( "data_error", blocks, streamNo );
          return False;
       case BZ_MEM_ERROR:
          outOfMemory();
       case BZ_UNEXPECTED_EOF:
          fprintf ( stderr,
                    "file ends unexpectedly\n" );
+         if (verifyJson) 
+            verifyReport ( "unexpected_eof", blocks, streamNo );
          return False;
       case BZ_DATA_ERROR_MAGIC:
          if (zStream != stdin) fclose(zStream);
          if (streamNo == 1) {
           fprintf ( stderr, 
                     "bad magic number (file not created by bzip2)\n" );
+            if (verifyJson) verifyReport ( "bad_magic", blocks, 0 );
             return False;
          } else {
             if (noisy)
             fprintf ( stderr, 
                       "trailing garbage after EOF ignored\n" );
+            if (verifyJson) 
+               verifyReport ( "trailing_garbage", blocks, streamNo - 1 );
             return True;       
          }
       default:
@@ -6560,6 +8991,130 @@ void testf ( Char *name )
 }
 
 
+/*---------------------------------------------*/
+/*--
+   --bench: compress and decompress each file in
+   memory, again and again for about BZ_BENCH_SECS
+   each, and print the speeds to stdout.  The streams
+   are set up once and reused, so the times do not
+   include setting up the arrays.  The first pass
+   also collects the block statistics.
+--*/
+
+#define BZ_BENCH_SECS 1.0
+
+static 
+void benchFile ( Char *name )
+{
+   FILE*        inStr;
+   Char*        in;
+   Char*        z;
+   Char*        out;
+   Int32        inSize, inMax, n, reps, ret;
+   unsigned int zLen, outLen;
+   bz_stream    cs, ds;
+   clock_t      t0;
+   double       zSecs, uSecs, zSpeed, uSpeed;
+
+   deleteOutputOnInterrupt = False;
+   copyFileName ( inName, name );
+   copyFileName ( outName, "(none)" );
+
+   inStr = fopen ( inName, "rb" );
+   if (inStr == NULL) {
+      fprintf ( stderr, "%s: Can't open input file %s: %s.\n",
+                progName, inName, strerror(errno) );
+      setExit(1);
+      return;
+   }
+   inMax  = 1 << 20;
+   inSize = 0;
+   in     = myMalloc ( inMax );
+   while (True) {
+      if (inSize == inMax) {
+         if (inMax >= (1 << 29)) {
+            fprintf ( stderr, "%s: %s is too large to benchmark.\n",
+                      progName, inName );
+            setExit(1);
+            fclose ( inStr );
+            free ( in );
+            return;
+         }
+         inMax *= 2;
+         in = realloc ( in, inMax );
+         if (in == NULL) outOfMemory ();
+      }
+      n = fread ( in + inSize, sizeof(UChar), inMax - inSize, inStr );
+      if (ferror(inStr)) ioError();
+      if (n == 0) break;
+      inSize += n;
+   }
+   fclose ( inStr );
+
+   z   = myMalloc ( inSize + inSize / 100 + 600 );
+   out = myMalloc ( inSize + 1 );
+
+   cs.bzalloc = ds.bzalloc = NULL;
+   cs.bzfree  = ds.bzfree  = NULL;
+   cs.opaque  = ds.opaque  = NULL;
+   ret = BZ2_bzCompressInit ( &cs, blockSize100k, 0, workFactor );
+   if (ret == BZ_MEM_ERROR) outOfMemory();
+   if (ret != BZ_OK) configError();
+   ret = BZ2_bzDecompressInit ( &ds, 0, smallMode );
+   if (ret == BZ_MEM_ERROR) outOfMemory();
+   if (ret != BZ_OK) configError();
+   BZ2_bzCompressSorter ( &cs, blockSorter );
+   BZ2_bzCompressEffort ( &cs, tableEffort );
+
+   statsReset();
+   BZ2_bzCompressStats ( &cs, statsBlock, NULL );
+   reps = 0;
+   t0   = clock();
+   do {
+      zLen = inSize + inSize / 100 + 600;
+      ret  = BZ2_bzBuffToBuffCompressStream ( &cs, z, &zLen, in, inSize );
+      if (ret != BZ_OK) panic ( "benchFile:compress" );
+      BZ2_bzCompressStats ( &cs, NULL, NULL );
+      reps++;
+      zSecs = (double)(clock() - t0) / CLOCKS_PER_SEC;
+   } while (zSecs < BZ_BENCH_SECS);
+   zSpeed = zSecs > 0.0 ? inSize * (double)reps / zSecs / 1e6 : 0.0;
+
+   reps  = 0;
+   uSecs = 0.0;
+   t0    = clock();
+   do {
+      outLen = inSize + 1;
+      ret = BZ2_bzBuffToBuffDecompressStream ( &ds, out, &outLen, z, zLen );
+      if (ret != BZ_OK || outLen != (unsigned int)inSize ||
+          memcmp ( in, out, inSize ) != 0)
+         panic ( "benchFile:round trip" );
+      reps++;
+      uSecs = (double)(clock() - t0) / CLOCKS_PER_SEC;
+   } while (uSecs < BZ_BENCH_SECS);
+   uSpeed = uSecs > 0.0 ? inSize * (double)reps / uSecs / 1e6 : 0.0;
+
+   fprintf ( stdout, "%s: %d -> %u bytes, %6.3f:1, "
+             "compress %.2f MB/s, decompress %.2f MB/s\n",
+             inName, inSize, zLen, 
+             zLen > 0 ? (double)inSize / zLen : 0.0, zSpeed, uSpeed );
+   if (statsIn > 0.0)
+      fprintf ( stdout, "    %d blocks, %d by fallback sort, "
+                "%d by suffix sort, cycles/byte: "
+                "sort %.1f, mtf %.1f, code %.1f\n",
+                statsBlocks, statsFallback, statsSuffix,
+                statsSort / statsIn, statsMtf / statsIn, 
+                statsCode / statsIn );
+   if (showStats) statsTotal();
+
+   BZ2_bzCompressEnd ( &cs );
+   BZ2_bzDecompressEnd ( &ds );
+   free ( in );
+   free ( z );
+   free ( out );
+}
+
+
 /*---------------------------------------------*/
 static 
 void license ( void )
@@ -6607,9 +9162,16 @@ void usage ( Char *fullProgName )
       "   -L --license        display software version & license\n"
       "   -V --version        display software version & license\n"
       "   -s --small          use less memory (at most 2500k)\n"
+      "   -p N                compress or decompress using N threads\n"
       "   -1 .. -9            set block size to 100k .. 900k\n"
       "   --fast              alias for -1\n"
       "   --best              alias for -9\n"
+      "   --suffix-sort       sort every block in linear time\n"
+      "   --high-effort       spend more time choosing coding tables\n"
+      "   --stats             print timings and sorting cost of each block\n"
+      "   --bench             time compressing the files in memory\n"
+      "   --pipeline          decompress in two threads, in bounded memory\n"
+      "   --verify-json       test, and report the blocks as JSON on stdout\n"
       "\n"
       "   If invoked as `bzip2', default action is to compress.\n"
       "              as `bunzip2',  default action is to decompress.\n"
@@ -6764,6 +9326,12 @@ IntNative main ( IntNative argc, Char *argv[] )
    numFileNames            = 0;
    numFilesProcessed       = 0;
    workFactor              = 30;
+   numThreads              = 1;
+   blockSorter             = BZ_SORT_AUTO;
+   tableEffort             = BZ_EFFORT_NORMAL;
+   showStats               = False;
+   pipeline                = False;
+   verifyJson              = False;
    deleteOutputOnInterrupt = False;
    exitValue               = 0;
    i = j = 0; /* avoid bogus warning from egcs-1.1.X */
@@ -6795,6 +9363,26 @@ IntNative main ( IntNative argc, Char *argv[] )
       APPEND_FILESPEC(argList, argv[i]);
 
 
+   /*-- Join `-p N' into `-pN', so that N is not taken 
+        for a file name.
+   --*/
+   for (aa = argList; aa != NULL; aa = aa->link) {
+      if (ISFLAG("--")) break;
+      if (ISFLAG("-p") && aa->link != NULL &&
+          isdigit((Int32)(aa->link->name[0]))) {
+         Cell *num = aa->link;
+         tmp = (Char*) myMalloc ( 5 + strlen(num->name) );
+         strcpy ( tmp, "-p" );
+         strcat ( tmp, num->name );
+         free ( aa->name );
+         aa->name = tmp;
+         aa->link = num->link;
+         free ( num->name );
+         free ( num );
+      }
+   }
+
+
    /*-- Find the length of the longest filename --*/
    longestFileName = 7;
    numFileNames    = 0;
@@ -6856,6 +9444,11 @@ IntNative main ( IntNative argc, Char *argv[] )
                case 'V':
                case 'L': license();            break;
                case 'v': verbosity++; break;
+               case 'p': numThreads = 0;
+                         while (isdigit((Int32)(aa->name[j+1])))
+                            numThreads = 10 * numThreads 
+                                         + (aa->name[++j] - '0');
+                         break;
                case 'h': usage ( progName );
                          exit ( 0 );
                          break;
@@ -6883,6 +9476,13 @@ IntNative main ( IntNative argc, Char *argv[] )
       if (ISFLAG("--version"))           license();                  else
       if (ISFLAG("--license"))           license();                  else
       if (ISFLAG("--exponential"))       workFactor = 1;             else 
+      if (ISFLAG("--suffix-sort"))       blockSorter = BZ_SORT_SUFFIX; else
+      if (ISFLAG("--high-effort"))       tableEffort = BZ_EFFORT_HIGH;   else
+      if (ISFLAG("--stats"))             showStats        = True;    else
+      if (ISFLAG("--pipeline"))          pipeline         = True;    else
+      if (ISFLAG("--verify-json"))       { opMode = OM_TEST; verifyJson = True; }
+         else
+      if (ISFLAG("--bench"))             opMode           = OM_BENCH; else
       if (ISFLAG("--repetitive-best"))   redundant(aa->name);        else
       if (ISFLAG("--repetitive-fast"))   redundant(aa->name);        else
       if (ISFLAG("--fast"))              blockSize100k = 1;          else
@@ -6898,6 +9498,16 @@ IntNative main ( IntNative argc, Char *argv[] )
    }
 
    if (verbosity > 4) verbosity = 4;
+   if (numThreads < 1) numThreads = 1;
+#  if !BZ_THREADS
+   if (numThreads > 1 && noisy)
+      fprintf ( stderr, "%s: -p ignored, no thread support\n", progName );
+   numThreads = 1;
+   if (pipeline && noisy)
+      fprintf ( stderr, "%s: --pipeline ignored, no thread support\n", 
+                progName );
+   pipeline = False;
+#  endif
    if (opMode == OM_Z && smallMode && blockSize100k > 2) 
       blockSize100k = 2;
 
@@ -6910,7 +9520,13 @@ IntNative main ( IntNative argc, Char *argv[] )
    if (srcMode == SM_F2O && numFileNames == 0)
       srcMode = SM_I2O;
 
-   if (opMode != OM_Z) blockSize100k = 0;
+   if (opMode == OM_BENCH && srcMode != SM_F2F) {
+      fprintf ( stderr, "%s: --bench needs input files.\n",
+                progName );
+      exit ( 1 );
+   }
+
+   if (opMode != OM_Z && opMode != OM_BENCH) blockSize100k = 0;
 
    if (srcMode == SM_F2F) {
       signal (SIGINT,  mySignalCatcher);
@@ -6935,6 +9551,17 @@ IntNative main ( IntNative argc, Char *argv[] )
    } 
    else
 
+   if (opMode == OM_BENCH) {
+      decode = True;
+      for (aa = argList; aa != NULL; aa = aa->link) {
+         if (ISFLAG("--")) { decode = False; continue; }
+         if (aa->name[0] == '-' && decode) continue;
+         numFilesProcessed++;
+         benchFile ( aa->name );
+      }
+   } 
+   else
+
    if (opMode == OM_UNZ) {
       unzFailsExist = False;
       if (srcMode == SM_I2O) {
@@ -152,6 +152,13 @@ struct Obj {
   // Local variable
   int offset;
 
+  // Register allocation with -O1
+  int reg;        // callee-saved register, or 0 if it lives in memory
+  bool addr_taken;
+  int live_begin;
+  int live_end;
+  int weight;     // references weighted by loop nesting
+
   // Global variable or function
   bool is_function;
   bool is_definition;
@@ -171,6 +178,7 @@ struct Obj {
   Obj *va_area;
   Obj *alloca_bottom;
   int stack_size;
+  bool use_regs; // callee-saved registers may be used with -O1
 
   // Static inline function
   bool is_live;
@@ -470,6 +478,7 @@ bool file_exists(char *path);
 extern StringArray include_paths;
 extern bool opt_fpic;
 extern bool opt_fcommon;
+extern bool opt_O1;
 extern char *base_file;
 
 // codegen.c
@@ -524,6 +533,46 @@ static void popf(int reg) {
   depth--;
 }
 
+// With -O1, local variables whose address is not taken are kept in
+// callee-saved registers, and the registers left over hold temporary
+// values instead of the stack. Register 0 means "in memory".
+#define NREG 5
+
+static char *reg64[] = {NULL, "%rbx", "%r12", "%r13", "%r14", "%r15"};
+static char *reg32[] = {NULL, "%ebx", "%r12d", "%r13d", "%r14d", "%r15d"};
+
+static int tmp_reg[NREG];
+static int tmp_max;
+static int tmp_depth;
+static int tmp_used;
+
+// Save %rax as a temporary value, in a register if there is a free
+// one and on the stack otherwise.
+static void push_tmp(void) {
+  if (tmp_depth < tmp_max) {
+    println("  mov %%rax, %s", reg64[tmp_reg[tmp_depth++]]);
+    tmp_used = MAX(tmp_used, tmp_depth);
+    return;
+  }
+  tmp_depth++;
+  push();
+}
+
+static void pop_tmp(char *arg) {
+  if (--tmp_depth < tmp_max) {
+    println("  mov %s, %s", reg64[tmp_reg[tmp_depth]], arg);
+    return;
+  }
+  pop(arg);
+}
+
+// Returns the location of the last temporary value.
+static char *top_tmp(void) {
+  if (tmp_depth <= tmp_max)
+    return reg64[tmp_reg[tmp_depth - 1]];
+  return "(%rsp)";
+}
+
 // Round up `n` to the nearest multiple of `align`. For instance,
 // align_to(5, 8) returns 8 and align_to(11, 8) returns 16.
 int align_to(int n, int align) {
@@ -563,6 +612,7 @@ static void gen_addr(Node *node) {
 
     // Local variable
     if (node->var->is_local) {
+      assert(!node->var->reg);
       println("  lea %d(%%rbp), %%rax", node->var->offset);
       return;
     }
@@ -699,10 +749,8 @@ static void load(Type *ty) {
     println("  mov (%%rax), %%rax");
 }
 
-// Store %rax to an address that the stack top is pointing to.
-static void store(Type *ty) {
-  pop("%rdi");
-
+// Store %rax to an address that %rdi is pointing to.
+static void store_rdi(Type *ty) {
   switch (ty->kind) {
   case TY_STRUCT:
   case TY_UNION:
@@ -732,6 +780,28 @@ static void store(Type *ty) {
     println("  mov %%rax, (%%rdi)");
 }
 
+// Store %rax to an address that the stack top is pointing to.
+static void store(Type *ty) {
+  pop_tmp("%rdi");
+  store_rdi(ty);
+}
+
+// Store a register, whose names are given for each size, to a register
+// variable. The value is extended in the same way as load() does.
+static void store_reg(Obj *var, char *r8, char *r16, char *r32, char *r64) {
+  Type *ty = var->ty;
+  char *insn = ty->is_unsigned ? "movz" : "movs";
+
+  if (ty->size == 1)
+    println("  %sbl %s, %s", insn, r8, reg32[var->reg]);
+  else if (ty->size == 2)
+    println("  %swl %s, %s", insn, r16, reg32[var->reg]);
+  else if (ty->size == 4)
+    println("  movsxd %s, %s", r32, reg64[var->reg]);
+  else
+    println("  mov %s, %s", r64, reg64[var->reg]);
+}
+
 static void cmp_zero(Type *ty) {
   switch (ty->kind) {
   case TY_FLOAT:
@@ -952,7 +1022,10 @@ static void push_args2(Node *args, bool first_pass) {
     depth += 2;
     break;
   default:
-    push();
+    if (first_pass)
+      push();
+    else
+      push_tmp();
   }
 }
 
@@ -1038,7 +1111,7 @@ static int push_args(Node *node) {
   // a pointer to a buffer as if it were the first argument.
   if (node->ret_buffer && node->ty->size > 16) {
     println("  lea %d(%%rbp), %%rax", node->ret_buffer->offset);
-    push();
+    push_tmp();
   }
 
   return stack;
@@ -1162,6 +1235,176 @@ static void builtin_alloca(void) {
   println("  mov %%rax, %d(%%rbp)", current_fn->alloca_bottom->offset);
 }
 
+static bool is_local_var(Node *node) {
+  return node->kind == ND_VAR && node->var->is_local &&
+         node->var->ty->kind != TY_VLA;
+}
+
+static bool is_int_cast(Node *node) {
+  if (node->kind != ND_CAST)
+    return false;
+
+  Type *from = node->lhs->ty;
+  Type *to = node->ty;
+  return (is_integer(from) || from->kind == TY_PTR) &&
+         (is_integer(to) || to->kind == TY_PTR);
+}
+
+// Skip casts that do not emit any instruction.
+static Node *skip_nop_cast(Node *node) {
+  while (is_int_cast(node) && node->ty->kind != TY_BOOL &&
+         node->lhs->ty->size == node->ty->size &&
+         !cast_table[getTypeId(node->lhs->ty)][getTypeId(node->ty)])
+    node = node->lhs;
+  return node;
+}
+
+// Returns true if a node can be evaluated without touching registers
+// other than %rax.
+static bool is_leaf(Node *node) {
+  while (is_int_cast(node))
+    node = node->lhs;
+  return node->kind == ND_NUM || is_local_var(node);
+}
+
+// Returns true if the right operand of an integer binary operator of
+// size `sz` can be used as an instruction operand without loading it.
+static bool is_operand(Node *node, int sz) {
+  node = skip_nop_cast(node);
+  if (node->kind == ND_NUM)
+    return is_integer(node->ty) && node->val == (int)node->val;
+  if (node->kind == ND_VAR && node->var->reg)
+    return true;
+  return is_local_var(node) && node->ty->size == sz &&
+         (is_integer(node->ty) || node->ty->kind == TY_PTR);
+}
+
+static char *operand(Node *node, int sz) {
+  node = skip_nop_cast(node);
+  if (node->kind == ND_NUM)
+    return format("$%ld", node->val);
+  if (node->var->reg)
+    return (sz == 8) ? reg64[node->var->reg] : reg32[node->var->reg];
+  return format("%d(%%rbp)", node->var->offset);
+}
+
+// Sethi-Ullman number of a node, i.e. the number of temporary values
+// that are alive at the same time while evaluating it. It is an
+// estimate for statements and function calls.
+static int reg_need(Node *node) {
+  if (!node)
+    return 0;
+
+  switch (node->kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_MOD:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+  case ND_SHL:
+  case ND_SHR:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE: {
+    if (is_flonum(node->lhs->ty))
+      break;
+
+    int l = reg_need(node->lhs);
+    int sz = (node->lhs->ty->kind == TY_LONG || node->lhs->ty->base) ? 8 : 4;
+    if (is_operand(node->rhs, sz))
+      return l;
+
+    int r = reg_need(node->rhs);
+    if (is_leaf(node->lhs))
+      return r;
+    return (l == r) ? l + 1 : MAX(l, r);
+  }
+  case ND_ASSIGN: {
+    int r = reg_need(node->rhs);
+    if (is_local_var(node->lhs))
+      return r;
+
+    int l = reg_need(node->lhs);
+    return (l == r) ? l + 1 : MAX(l, r);
+  }
+  case ND_FUNCALL: {
+    int n = reg_need(node->lhs), nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next) {
+      int k = reg_need(arg);
+      n = MAX(n, k);
+      nargs++;
+    }
+    return n + MIN(nargs, GP_MAX);
+  }
+  case ND_CAS: {
+    int a = reg_need(node->cas_addr);
+    int b = reg_need(node->cas_new) + 1;
+    int c = reg_need(node->cas_old) + 2;
+    return MAX(a, MAX(b, c));
+  }
+  case ND_EXCH: {
+    int l = reg_need(node->lhs);
+    int r = reg_need(node->rhs) + 1;
+    return MAX(l, r);
+  }
+  }
+
+  Node *kids[] = {node->lhs, node->rhs, node->cond, node->then, node->els,
+                  node->init, node->inc};
+  int n = 0;
+
+  for (int i = 0; i < sizeof(kids) / sizeof(*kids); i++) {
+    int k = reg_need(kids[i]);
+    n = MAX(n, k);
+  }
+
+  for (Node *n2 = node->body; n2; n2 = n2->next) {
+    int k = reg_need(n2);
+    n = MAX(n, k);
+  }
+  return n;
+}
+
+// Evaluate the operands of an integer binary operator. The left one
+// goes to %rax and the right one to %rdi, unless the right one can be
+// used as an instruction operand as is. Returns the right operand.
+static char *gen_operands(Node *node, char *di, int sz) {
+  if (opt_O1) {
+    if (is_operand(node->rhs, sz)) {
+      gen_expr(node->lhs);
+      return operand(node->rhs, sz);
+    }
+
+    if (is_leaf(node->lhs)) {
+      gen_expr(node->rhs);
+      println("  mov %%rax, %%rdi");
+      gen_expr(node->lhs);
+      return di;
+    }
+
+    // Evaluate the side that needs more registers first, so that the
+    // other one is kept in a register for a shorter time.
+    if (reg_need(node->lhs) > reg_need(node->rhs)) {
+      gen_expr(node->lhs);
+      push_tmp();
+      gen_expr(node->rhs);
+      println("  mov %%rax, %%rdi");
+      pop_tmp("%rax");
+      return di;
+    }
+  }
+
+  gen_expr(node->rhs);
+  push_tmp();
+  gen_expr(node->lhs);
+  pop_tmp("%rdi");
+  return di;
+}
+
 // Generate code for a given node.
 static void gen_expr(Node *node) {
   println("  .loc %d %d", node->tok->file->file_no, node->tok->line_no);
@@ -1223,6 +1466,10 @@ static void gen_expr(Node *node) {
     println("  neg %%rax");
     return;
   case ND_VAR:
+    if (node->var->reg) {
+      println("  mov %s, %%rax", reg64[node->var->reg]);
+      return;
+    }
     gen_addr(node);
     load(node->ty);
     return;
@@ -1248,8 +1495,34 @@ static void gen_expr(Node *node) {
     gen_addr(node->lhs);
     return;
   case ND_ASSIGN:
+    if (node->lhs->kind == ND_VAR && node->lhs->var->reg) {
+      gen_expr(node->rhs);
+      store_reg(node->lhs->var, "%al", "%ax", "%eax", "%rax");
+      return;
+    }
+
+    if (opt_O1 && is_local_var(node->lhs)) {
+      gen_expr(node->rhs);
+      println("  lea %d(%%rbp), %%rdi", node->lhs->var->offset);
+      store_rdi(node->ty);
+      return;
+    }
+
+    // Evaluate the side that needs more registers first.
+    if (opt_O1 && (is_integer(node->ty) || node->ty->kind == TY_PTR) &&
+        reg_need(node->rhs) > reg_need(node->lhs) &&
+        !(node->lhs->kind == ND_MEMBER && node->lhs->member->is_bitfield)) {
+      gen_expr(node->rhs);
+      push_tmp();
+      gen_addr(node->lhs);
+      println("  mov %%rax, %%rdi");
+      pop_tmp("%rax");
+      store_rdi(node->ty);
+      return;
+    }
+
     gen_addr(node->lhs);
-    push();
+    push_tmp();
     gen_expr(node->rhs);
 
     if (node->lhs->kind == ND_MEMBER && node->lhs->member->is_bitfield) {
@@ -1262,7 +1535,7 @@ static void gen_expr(Node *node) {
       println("  and $%ld, %%rdi", (1L << mem->bit_width) - 1);
       println("  shl $%d, %%rdi", mem->bit_offset);
 
-      println("  mov (%%rsp), %%rax");
+      println("  mov %s, %%rax", top_tmp());
       load(mem->ty);
 
       long mask = ((1L << mem->bit_width) - 1) << mem->bit_offset;
@@ -1289,6 +1562,11 @@ static void gen_expr(Node *node) {
     cast(node->lhs->ty, node->ty);
     return;
   case ND_MEMZERO:
+    if (node->var->reg) {
+      println("  xor %s, %s", reg32[node->var->reg], reg32[node->var->reg]);
+      return;
+    }
+
     // `rep stosb` is equivalent to `memset(%rdi, %al, %rcx)`.
     println("  mov $%d, %%rcx", node->var->ty->size);
     println("  lea %d(%%rbp), %%rdi", node->var->offset);
@@ -1363,7 +1641,7 @@ static void gen_expr(Node *node) {
     // If the return type is a large struct/union, the caller passes
     // a pointer to a buffer as if it were the first argument.
     if (node->ret_buffer && node->ty->size > 16)
-      pop(argreg64[gp++]);
+      pop_tmp(argreg64[gp++]);
 
     for (Node *arg = node->args; arg; arg = arg->next) {
       Type *ty = arg->ty;
@@ -1400,7 +1678,7 @@ static void gen_expr(Node *node) {
         break;
       default:
         if (gp < GP_MAX)
-          pop(argreg64[gp++]);
+          pop_tmp(argreg64[gp++]);
       }
     }
 
@@ -1446,14 +1724,14 @@ static void gen_expr(Node *node) {
     return;
   case ND_CAS: {
     gen_expr(node->cas_addr);
-    push();
+    push_tmp();
     gen_expr(node->cas_new);
-    push();
+    push_tmp();
     gen_expr(node->cas_old);
     println("  mov %%rax, %%r8");
     load(node->cas_old->ty->base);
-    pop("%rdx"); // new
-    pop("%rdi"); // addr
+    pop_tmp("%rdx"); // new
+    pop_tmp("%rdi"); // addr
 
     int sz = node->cas_addr->ty->base->size;
     println("  lock cmpxchg %s, (%%rdi)", reg_dx(sz));
@@ -1466,9 +1744,9 @@ static void gen_expr(Node *node) {
   }
   case ND_EXCH: {
     gen_expr(node->lhs);
-    push();
+    push_tmp();
     gen_expr(node->rhs);
-    pop("%rdi");
+    pop_tmp("%rdi");
 
     int sz = node->lhs->ty->base->size;
     println("  xchg %s, (%%rdi)", reg_ax(sz));
@@ -1567,35 +1845,40 @@ static void gen_expr(Node *node) {
   }
   }
 
-  gen_expr(node->rhs);
-  push();
-  gen_expr(node->lhs);
-  pop("%rdi");
-
   char *ax, *di, *dx;
+  int sz;
 
   if (node->lhs->ty->kind == TY_LONG || node->lhs->ty->base) {
     ax = "%rax";
     di = "%rdi";
     dx = "%rdx";
+    sz = 8;
   } else {
     ax = "%eax";
     di = "%edi";
     dx = "%edx";
+    sz = 4;
   }
 
+  // The right operand is in %rdi, or it is something that can be used
+  // as an instruction operand as is.
+  char *op = gen_operands(node, di, sz);
+
   switch (node->kind) {
   case ND_ADD:
-    println("  add %s, %s", di, ax);
+    println("  add %s, %s", op, ax);
     return;
   case ND_SUB:
-    println("  sub %s, %s", di, ax);
+    println("  sub %s, %s", op, ax);
     return;
   case ND_MUL:
-    println("  imul %s, %s", di, ax);
+    println("  imul %s, %s", op, ax);
     return;
   case ND_DIV:
   case ND_MOD:
+    if (op != di)
+      println("  mov %s, %s", op, di);
+
     if (node->ty->is_unsigned) {
       println("  mov $0, %s", dx);
       println("  div %s", di);
@@ -1611,19 +1894,19 @@ static void gen_expr(Node *node) {
       println("  mov %%rdx, %%rax");
     return;
   case ND_BITAND:
-    println("  and %s, %s", di, ax);
+    println("  and %s, %s", op, ax);
     return;
   case ND_BITOR:
-    println("  or %s, %s", di, ax);
+    println("  or %s, %s", op, ax);
     return;
   case ND_BITXOR:
-    println("  xor %s, %s", di, ax);
+    println("  xor %s, %s", op, ax);
     return;
   case ND_EQ:
   case ND_NE:
   case ND_LT:
   case ND_LE:
-    println("  cmp %s, %s", di, ax);
+    println("  cmp %s, %s", op, ax);
 
     if (node->kind == ND_EQ) {
       println("  sete %%al");
@@ -1644,17 +1927,23 @@ static void gen_expr(Node *node) {
     println("  movzb %%al, %%rax");
     return;
   case ND_SHL:
+  case ND_SHR: {
+    char *insn = (node->kind == ND_SHL) ? "shl" :
+                 node->lhs->ty->is_unsigned ? "shr" : "sar";
+
+    Node *rhs = skip_nop_cast(node->rhs);
+    if (op[0] == '$' && 0 <= rhs->val && rhs->val < 64) {
+      println("  %s %s, %s", insn, op, ax);
+      return;
+    }
+
+    if (op != di)
+      println("  mov %s, %s", op, di);
     println("  mov %%rdi, %%rcx");
-    println("  shl %%cl, %s", ax);
-    return;
-  case ND_SHR:
-    println("  mov %%rdi, %%rcx");
-    if (node->lhs->ty->is_unsigned)
-      println("  shr %%cl, %s", ax);
-    else
-      println("  sar %%cl, %s", ax);
+    println("  %s %%cl, %s", insn, ax);
     return;
   }
+  }
 
   error_tok(node->tok, "invalid expression");
 }
@@ -1780,6 +2069,301 @@ static void gen_stmt(Node *node) {
   error_tok(node->tok, "invalid statement");
 }
 
+// A range of positions in a function in which a variable that is
+// referenced must stay in its register all the time, such as a loop
+// or an expression. Labels and gotos are recorded in the same way to
+// find backward jumps.
+typedef struct Region Region;
+struct Region {
+  Region *next;
+  int begin;
+  int end;
+  char *label;
+};
+
+static int scan_pos;
+static int scan_loop_depth;
+static bool scan_no_regs;
+static bool scan_computed_goto;
+static Region *scan_regions;
+static Region *scan_labels;
+static Region *scan_gotos;
+
+static void add_region(Region **list, int begin, int end, char *label) {
+  Region *r = calloc(1, sizeof(Region));
+  r->begin = begin;
+  r->end = end;
+  r->label = label;
+  r->next = *list;
+  *list = r;
+}
+
+// Functions after which callee-saved registers may be restored to
+// older values by longjmp() and the like.
+static bool returns_twice(char *name) {
+  static char *names[] = {
+    "setjmp", "_setjmp", "__sigsetjmp", "sigsetjmp", "savectx",
+    "vfork", "getcontext",
+  };
+
+  for (int i = 0; i < sizeof(names) / sizeof(*names); i++)
+    if (!strcmp(name, names[i]))
+      return true;
+  return false;
+}
+
+// Record a reference to a variable at the current position.
+static void scan_var(Obj *var) {
+  if (!var->is_local)
+    return;
+  if (!var->weight)
+    var->live_begin = scan_pos;
+  var->live_end = scan_pos++;
+  var->weight += 1 << (MIN(scan_loop_depth, 4) * 3);
+}
+
+static void scan(Node *node);
+
+// Scan a node whose address is computed by gen_addr().
+static void scan_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+  case ND_VLA_PTR:
+    node->var->addr_taken = true;
+    scan_var(node->var);
+    return;
+  case ND_MEMBER:
+    scan_addr(node->lhs);
+    return;
+  case ND_COMMA:
+    scan(node->lhs);
+    scan_addr(node->rhs);
+    return;
+  }
+  scan(node);
+}
+
+// Scan an expression, whose temporary values may be evaluated in any
+// order.
+static void scan_expr(Node *node) {
+  int begin = scan_pos;
+  scan(node);
+  add_region(&scan_regions, begin, scan_pos, NULL);
+}
+
+static void scan(Node *node) {
+  if (!node)
+    return;
+
+  switch (node->kind) {
+  case ND_VAR:
+  case ND_MEMZERO:
+    scan_var(node->var);
+    return;
+  case ND_ADDR:
+  case ND_MEMBER:
+    scan_addr(node->lhs);
+    return;
+  case ND_ASSIGN:
+    if (node->lhs->kind == ND_VAR)
+      scan_var(node->lhs->var);
+    else
+      scan_addr(node->lhs);
+    scan(node->rhs);
+    return;
+  case ND_FUNCALL:
+    if (node->lhs->kind == ND_VAR && returns_twice(node->lhs->var->name))
+      scan_no_regs = true;
+    scan(node->lhs);
+    for (Node *arg = node->args; arg; arg = arg->next)
+      scan(arg);
+    return;
+  case ND_CAS:
+    scan(node->cas_addr);
+    scan(node->cas_new);
+    scan(node->cas_old);
+    return;
+  case ND_ASM:
+    scan_no_regs = true;
+    return;
+  case ND_FOR: {
+    scan(node->init);
+    int begin = scan_pos;
+    scan_loop_depth++;
+    scan_expr(node->cond);
+    scan(node->then);
+    scan_expr(node->inc);
+    scan_loop_depth--;
+    add_region(&scan_regions, begin, scan_pos, NULL);
+    return;
+  }
+  case ND_DO: {
+    int begin = scan_pos;
+    scan_loop_depth++;
+    scan(node->then);
+    scan_expr(node->cond);
+    scan_loop_depth--;
+    add_region(&scan_regions, begin, scan_pos, NULL);
+    return;
+  }
+  case ND_IF:
+  case ND_SWITCH:
+    scan_expr(node->cond);
+    scan(node->then);
+    scan(node->els);
+    return;
+  case ND_EXPR_STMT:
+  case ND_RETURN:
+    scan_expr(node->lhs);
+    return;
+  case ND_GOTO:
+    add_region(&scan_gotos, scan_pos, scan_pos, node->unique_label);
+    scan_pos++;
+    return;
+  case ND_LABEL:
+    add_region(&scan_labels, scan_pos, scan_pos, node->unique_label);
+    scan_pos++;
+    scan(node->lhs);
+    return;
+  case ND_GOTO_EXPR:
+  case ND_LABEL_VAL:
+    scan_computed_goto = true;
+    scan_expr(node->lhs);
+    return;
+  }
+
+  scan(node->lhs);
+  scan(node->rhs);
+  scan(node->cond);
+  scan(node->then);
+  scan(node->els);
+  for (Node *n = node->body; n; n = n->next)
+    scan(n);
+}
+
+static bool can_be_reg(Obj *fn, Obj *var) {
+  if (var->addr_taken || !var->weight || var->offset > 0)
+    return false;
+  if (var == fn->alloca_bottom)
+    return false;
+
+  // The buffer for a large struct return value is read by
+  // copy_struct_mem() from the stack.
+  Type *rty = fn->ty->return_ty;
+  if (var == fn->params && (rty->kind == TY_STRUCT || rty->kind == TY_UNION) &&
+      rty->size > 16)
+    return false;
+
+  Type *ty = var->ty;
+  return (is_integer(ty) || ty->kind == TY_PTR) && !ty->is_atomic;
+}
+
+static int compare_live_begin(const void *x, const void *y) {
+  Obj *a = *(Obj **)x;
+  Obj *b = *(Obj **)y;
+  return a->live_begin - b->live_begin;
+}
+
+// Assign callee-saved registers to local variables by linear scan over
+// their live ranges, which are computed roughly by numbering variable
+// references in the order of code generation. A variable that is
+// referenced in a loop lives through the entire loop.
+static void alloc_regs(Obj *fn) {
+  for (Obj *var = fn->locals; var; var = var->next) {
+    var->reg = 0;
+    var->addr_taken = false;
+    var->weight = 0;
+  }
+
+  scan_pos = 0;
+  scan_loop_depth = 0;
+  scan_no_regs = false;
+  scan_computed_goto = false;
+  scan_regions = scan_labels = scan_gotos = NULL;
+  scan(fn->body);
+
+  fn->use_regs = !scan_no_regs;
+  if (scan_no_regs)
+    return;
+
+  if (scan_computed_goto)
+    add_region(&scan_regions, 0, scan_pos, NULL);
+
+  for (Region *g = scan_gotos; g; g = g->next)
+    for (Region *l = scan_labels; l; l = l->next)
+      if (!strcmp(g->label, l->label) && l->begin < g->begin)
+        add_region(&scan_regions, l->begin, g->begin, NULL);
+
+  int nvars = 0;
+  for (Obj *var = fn->locals; var; var = var->next) {
+    if (!can_be_reg(fn, var))
+      continue;
+
+    // A parameter lives from the start of the function.
+    for (Obj *param = fn->params; param; param = param->next)
+      if (param == var)
+        var->live_begin = 0;
+    nvars++;
+  }
+
+  Obj **vars = calloc(nvars, sizeof(Obj *));
+  nvars = 0;
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (can_be_reg(fn, var))
+      vars[nvars++] = var;
+
+  // Extend live ranges to regions that they overlap.
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (Region *r = scan_regions; r; r = r->next) {
+      for (int i = 0; i < nvars; i++) {
+        Obj *var = vars[i];
+        if (var->live_end < r->begin || r->end < var->live_begin)
+          continue;
+        if (r->begin < var->live_begin || var->live_end < r->end) {
+          var->live_begin = MIN(var->live_begin, r->begin);
+          var->live_end = MAX(var->live_end, r->end);
+          changed = true;
+        }
+      }
+    }
+  }
+
+  qsort(vars, nvars, sizeof(Obj *), compare_live_begin);
+
+  // Leave some registers for temporary values.
+  int need = reg_need(fn->body);
+  int nregs = NREG - MIN(need, 2);
+  Obj *active[NREG + 1] = {0};
+
+  for (int i = 0; i < nvars; i++) {
+    Obj *var = vars[i];
+    int reg = 0;
+
+    for (int r = 1; r <= nregs; r++) {
+      if (active[r] && active[r]->live_end < var->live_begin)
+        active[r] = NULL;
+      if (!active[r] && !reg)
+        reg = r;
+    }
+
+    // If no register is free, take one from the variable that is used
+    // the least, if it is used less than this one.
+    if (!reg) {
+      for (int r = 1; r <= nregs; r++)
+        if (!reg || active[r]->weight < active[reg]->weight)
+          reg = r;
+      if (active[reg]->weight >= var->weight)
+        continue;
+      active[reg]->reg = 0;
+    }
+
+    var->reg = reg;
+    active[reg] = var;
+  }
+  free(vars);
+}
+
 // Assign offsets to local variables.
 static void assign_lvar_offsets(Obj *prog) {
   for (Obj *fn = prog; fn; fn = fn->next) {
@@ -1828,9 +2412,12 @@ static void assign_lvar_offsets(Obj *prog) {
       top += var->ty->size;
     }
 
+    if (opt_O1)
+      alloc_regs(fn);
+
     // Assign offsets to pass-by-register parameters and local variables.
     for (Obj *var = fn->locals; var; var = var->next) {
-      if (var->offset)
+      if (var->offset || var->reg)
         continue;
 
       // AMD64 System V ABI has a special alignment rule for an array of
@@ -1961,10 +2548,46 @@ static void emit_text(Obj *prog) {
     println("%s:", fn->name);
     current_fn = fn;
 
+    // With -O1, the registers that are not assigned to variables hold
+    // temporary values.
+    bool used[NREG + 1] = {0};
+    for (Obj *var = fn->locals; var; var = var->next)
+      used[var->reg] = true;
+
+    tmp_max = tmp_used = 0;
+    for (int r = 1; r <= NREG; r++)
+      if (opt_O1 && fn->use_regs && !used[r])
+        tmp_reg[tmp_max++] = r;
+
+    // Emit code. The body is generated first, because the prologue
+    // has to save the callee-saved registers that it uses.
+    FILE *out = codegen_output_file;
+    char *body;
+    size_t bodylen;
+    codegen_output_file = open_memstream(&body, &bodylen);
+    gen_stmt(fn->body);
+    assert(depth == 0);
+    assert(tmp_depth == 0);
+    fclose(codegen_output_file);
+    codegen_output_file = out;
+
+    int nsaved = 0;
+    char *saved[NREG];
+    for (int i = 0; i < tmp_used; i++)
+      used[tmp_reg[i]] = true;
+    for (int r = 1; r <= NREG; r++)
+      if (used[r])
+        saved[nsaved++] = reg64[r];
+
+    // Callee-saved registers are saved below local variables.
+    int stack_size = fn->stack_size + align_to(nsaved * 8, 16);
+
     // Prologue
     println("  push %%rbp");
     println("  mov %%rsp, %%rbp");
-    println("  sub $%d, %%rsp", fn->stack_size);
+    println("  sub $%d, %%rsp", stack_size);
+    for (int i = 0; i < nsaved; i++)
+      println("  mov %s, %d(%%rbp)", saved[i], -fn->stack_size - (i + 1) * 8);
     println("  mov %%rsp, %d(%%rbp)", fn->alloca_bottom->offset);
 
     // Save arg registers if function is variadic
@@ -2033,13 +2656,16 @@ static void emit_text(Obj *prog) {
         store_fp(fp++, var->offset, ty->size);
         break;
       default:
-        store_gp(gp++, var->offset, ty->size);
+        if (var->reg)
+          store_reg(var, argreg8[gp], argreg16[gp], argreg32[gp], argreg64[gp]);
+        else
+          store_gp(gp, var->offset, ty->size);
+        gp++;
       }
     }
 
-    // Emit code
-    gen_stmt(fn->body);
-    assert(depth == 0);
+    fwrite(body, bodylen, 1, codegen_output_file);
+    free(body);
 
     // [https://www.sigbus.info/n1570#5.1.2.2.3p1] The C spec defines
     // a special rule for the main function. Reaching the end of the
@@ -2050,6 +2676,8 @@ static void emit_text(Obj *prog) {
 
     // Epilogue
     println(".L.return.%s:", fn->name);
+    for (int i = 0; i < nsaved; i++)
+      println("  mov %d(%%rbp), %s", -fn->stack_size - (i + 1) * 8, saved[i]);
     println("  mov %%rbp, %%rsp");
     println("  pop %%rbp");
     println("  ret");
@@ -2242,6 +2870,7 @@ typedef enum {
 StringArray include_paths;
 bool opt_fcommon = true;
 bool opt_fpic;
+bool opt_O1;
 
 static FileType opt_x;
 static StringArray opt_include;
@@ -2550,9 +3179,19 @@ static void parse_args(int argc, char **argv) {
       exit(0);
     }
 
+    if (!strcmp(argv[i], "-O0")) {
+      opt_O1 = false;
+      continue;
+    }
+
+    // -O, -O2, -Os and so on are the same as -O1.
+    if (!strncmp(argv[i], "-O", 2)) {
+      opt_O1 = true;
+      continue;
+    }
+
     // These options are ignored for now.
-    if (!strncmp(argv[i], "-O", 2) ||
-        !strncmp(argv[i], "-W", 2) ||
+    if (!strncmp(argv[i], "-W", 2) ||
         !strncmp(argv[i], "-g", 2) ||
         !strncmp(argv[i], "-std=", 5) ||
         !strcmp(argv[i], "-ffreestanding") ||
@@ -5121,6 +5760,12 @@ static Node *to_assign(Node *binary) {
     return node;
   }
 
+  // With -O1, convert `A op= B` to `A = A op B` if A is a local
+  // variable, so that taking its address does not keep A in memory.
+  if (opt_O1 && binary->lhs->kind == ND_VAR && binary->lhs->var->is_local)
+    return new_binary(ND_ASSIGN, new_var_node(binary->lhs->var, tok),
+                      binary, tok);
+
   // Convert `A op= B` to ``tmp = &A, *tmp = *tmp op B`.
   Obj *var = new_lvar("", pointer_to(binary->lhs->ty));
 
@@ -1,3 +1,6 @@
+#if defined(__STRICT_ANSI__) && !defined(_POSIX_C_SOURCE)
+#  define _POSIX_C_SOURCE 200809L /* for sigset_t with -std=c99 */
+#endif
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
@@ -5,12 +8,15 @@
 #include <limits.h>
 #include <malloc.h>
 #include <memory.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/dir.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -183,6 +189,10 @@
  *      left-to-right output (useful for code strings from the tree routines),
  *      the bits must have been reversed first with bi_reverse().
  *
+ *      The bits are gathered in bi_buf, an unsigned long, and written to
+ *      outbuf a whole bi_buf at a time. The bit strings may be up to
+ *      Buf_size-1 bits long, so that several codes can be sent at once.
+ *
  *      For in-memory compression, the compressed bit stream goes directly
  *      into the requested output buffer. The input data is read in blocks
  *      by the mem_read() function. The buffer is limited to 64K on 16 bit
@@ -193,9 +203,9 @@
  *      void bi_init (FILE *zipfile)
  *          Initialize the bit string routines.
  *
- *      void send_bits (int value, int length)
+ *      void send_bits (ulg value, int length)
  *          Write out a bit string, taking the source bits right to
- *          left.
+ *          left. SEND_BITS is the same as a macro.
  *
  *      int bi_reverse (int value, int length)
  *          Reverse the bits of a bit string, taking the source bits left to
@@ -404,7 +414,6 @@ typedef unsigned long  ulg;
 /* methods 4 to 7 reserved */
 #define DEFLATED    8
 #define MAX_METHODS 9
-extern int method;         /* compression method */
 
 /* To save memory for 16 bit systems, some arrays are overlaid between
  * the various modules:
@@ -445,6 +454,18 @@ extern int method;         /* compression method */
 
 #define near
 
+#ifdef DYN_ALLOC
+#  define NO_THREADS /* worker threads need statically allocated buffers */
+#endif
+
+#ifndef NO_THREADS
+#  define TLS __thread /* one copy of the (de)compression state per thread */
+#else
+#  define TLS
+#endif
+
+extern TLS int method;     /* compression method */
+
 #ifdef DYN_ALLOC
 #  define EXTERN(type, array)  extern type * near array
 #  define DECLARE(type, array, size)  type * near array
@@ -454,8 +475,8 @@ extern int method;         /* compression method */
    }
 #  define FREE(array) {if (array != NULL) fcfree(array), array=NULL;}
 #else
-#  define EXTERN(type, array)  extern type array[]
-#  define DECLARE(type, array, size)  type array[size]
+#  define EXTERN(type, array)  extern TLS type array[]
+#  define DECLARE(type, array, size)  TLS type array[size]
 #  define ALLOC(type, array, size)
 #  define FREE(array)
 #endif
@@ -476,23 +497,29 @@ EXTERN(uch, window);         /* Sliding window and suffix table (unlzw) */
    EXTERN(ush, tab_prefix1); /* prefix for odd  codes */
 #endif
 
-extern unsigned insize; /* valid bytes in inbuf */
-extern unsigned inptr;  /* index of next byte to be processed in inbuf */
-extern unsigned outcnt; /* bytes in output buffer */
+extern TLS unsigned insize; /* valid bytes in inbuf */
+extern TLS unsigned inptr;  /* index of next byte to be processed in inbuf */
+extern TLS unsigned outcnt; /* bytes in output buffer */
 extern int rsync;  /* deflate into rsyncable chunks */
-
-extern off_t bytes_in;   /* number of input bytes */
-extern off_t bytes_out;  /* number of output bytes */
-extern off_t header_bytes;/* number of bytes in gzip header */
-
-extern int  ifd;        /* input file descriptor */
-extern int  ofd;        /* output file descriptor */
-extern char ifname[];   /* input file name or "stdin" */
-extern char ofname[];   /* output file name or "stdout" */
+extern int processes; /* number of compression threads (-p) */
+extern int mmap_io;   /* map input files, batch output writes (--mmap) */
+extern int fast_greedy; /* single-probe greedy matching for -1, -2 */
+extern off_t index_span;  /* distance between access points (--index) */
+extern off_t range_start; /* first byte to extract (--range), or -1 */
+extern off_t range_end;   /* end of the range, or -1 for end of file */
+
+extern TLS off_t bytes_in;   /* number of input bytes */
+extern TLS off_t bytes_out;  /* number of output bytes */
+extern TLS off_t header_bytes;/* number of bytes in gzip header */
+
+extern TLS int  ifd;        /* input file descriptor */
+extern TLS int  ofd;        /* output file descriptor */
+extern TLS char ifname[]; /* input file name or "stdin" */
+extern TLS char ofname[]; /* output file name or "stdout" */
 extern char *progname;  /* program name */
 
-extern time_t time_stamp; /* original time stamp (modification time) */
-extern off_t ifile_size; /* input file size, -1 for devices (debug only) */
+extern TLS time_t time_stamp; /* original time stamp (modification time) */
+extern TLS off_t ifile_size; /* input file size, -1 for devices (debug only) */
 
 typedef int file_t;     /* Do not use stdio */
 #define NO_FILE  (-1)   /* in memory compression */
@@ -543,7 +570,8 @@ extern int quiet;          /* be quiet (-q) */
 extern int level;          /* compression level */
 extern int test;           /* check .z file integrity */
 extern int to_stdout;      /* output to stdout (-c) */
-extern int save_orig_name; /* set if original name must be saved */
+extern int force;          /* overwrite existing files (-f) */
+extern TLS int save_orig_name; /* set if original name must be saved */
 
 #define get_byte()  (inptr < insize ? inbuf[inptr++] : fill_inbuf(0))
 #define try_byte()  (inptr < insize ? inbuf[inptr++] : fill_inbuf(1))
@@ -608,6 +636,89 @@ extern int save_orig_name; /* set if original name must be saved */
 extern int zip        OF((int in, int out));
 extern int file_read  OF((char *buf,  unsigned size));
 
+	/* in gzctx.c: one stream per call and per thread, see LIMITATIONS */
+typedef struct gz_buf {
+    uch *data;      /* the bytes */
+    ulg len;        /* number of bytes in data */
+    ulg size;       /* allocated size of data, for output buffers */
+} gz_buf;
+
+typedef struct gz_ctx {
+    int   level;    /* compression level, 1 to 9 */
+    int   rsync;    /* deflate into rsyncable chunks (--rsyncable) */
+    int   greedy;   /* greedy matching for levels 1 and 2 (--fast-greedy) */
+    int   raw;      /* raw deflate data, without gzip header and trailer */
+    int   last;     /* raw: end with the last block, else on a byte boundary */
+    uch  *dict;     /* raw: preset dictionary, or NULL */
+    unsigned dictlen; /* raw: length of dict, at most WSIZE */
+    char *name;     /* original file name for the gzip header, or NULL */
+    ulg   time;     /* time stamp of the gzip header, 0 if none */
+    ulg   crc;      /* crc of the last uncompressed data */
+    char *msg;      /* reason of the last ERROR, or NULL */
+} gz_ctx;
+
+extern TLS jmp_buf *gz_abort; /* where error() returns to, or NULL */
+extern void gz_init        OF((void));
+extern void gz_ctx_init    OF((gz_ctx *ctx, int level));
+extern int  gz_ctx_compress OF((gz_ctx *ctx, gz_buf *in, gz_buf *out));
+extern int  gz_ctx_uncompress OF((gz_ctx *ctx, gz_buf *in, gz_buf *out));
+extern void gz_fail        OF((char *msg));
+
+	/* in pzip.c: */
+extern off_t pdeflate OF((void));
+
+	/* in punzip.c: */
+extern int punzip     OF((int in, int out));
+
+	/* in zindex.c: */
+#ifndef INDEX_SPAN
+#  define INDEX_SPAN 1    /* default distance between access points, MiB */
+#endif
+extern TLS int  index_fd;     /* index being written, or -1 */
+extern TLS off_t index_next;  /* output offset of the next access point */
+extern TLS int range_done;  /* set when the end of the range is written */
+extern void index_open    OF((void));
+extern void index_close   OF((int ok));
+extern void index_point   OF((void));
+extern int  range_parse   OF((char *arg));
+extern void range_write   OF((uch *buf, unsigned cnt));
+extern int  range_inflate OF((void));
+
+	/* in bench.c: */
+extern int bench;         /* --bench: measure speed instead of writing files */
+extern void bench_file    OF((char *name));
+
+/* Cycle counts of the main phases of compression, for --bench. BENCH(p, s)
+ * runs the statement s and adds its cycles to phase p; BENCH_START and
+ * BENCH_STOP do the same around a block, with a counter declared by
+ * BENCH_VAR. Only the time stamp counter of x86 is supported.
+ */
+#define BP_MATCH 0        /* longest_match, bt_insert */
+#define BP_TALLY 1        /* ct_tally */
+#define BP_TREES 2        /* build the Huffman trees */
+#define BP_SEND  3        /* send_bits of the trees and of the block data */
+#define BP_CRC   4        /* updcrc, crc32_buf */
+#define BP_COUNT 5
+#if !defined(NO_BENCH) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#  include <x86intrin.h>
+#  define BENCH_PHASES
+   typedef unsigned long long bench_t;
+   extern int bench_phases;  /* set while the phases are counted */
+   extern bench_t bench_cycles[BP_COUNT];
+#  define bench_clock() ((bench_t)__rdtsc())
+#  define BENCH_VAR(t) bench_t t;
+#  define BENCH_START(t) ((t) = bench_phases ? bench_clock() : 0)
+#  define BENCH_STOP(p, t) \
+     {if (bench_phases) bench_cycles[p] += bench_clock() - (t);}
+#  define BENCH(p, s) {bench_t t_; BENCH_START(t_); s; BENCH_STOP(p, t_);}
+#else
+#  define BENCH_VAR(t)
+#  define BENCH_START(t)
+#  define BENCH_STOP(p, t)
+#  define BENCH(p, s) {s;}
+#endif
+
 	/* in unzip.c */
 extern int unzip      OF((int in, int out));
 extern int check_zipfile OF((int in));
@@ -623,29 +734,53 @@ RETSIGTYPE abort_gzip_signal OF((void));
 
         /* in deflate.c */
 void lm_init OF((int pack_level, ush *flags));
+void lm_init_dict OF((int pack_level, ush *flags, uch *dict, unsigned len));
 off_t deflate OF((void));
+extern TLS int final_block;
+extern TLS int compr_level;  /* level of the current stream */
+extern TLS int compr_rsync;  /* rsyncable chunks in the current stream */
+extern TLS int compr_greedy; /* greedy matching in the current stream */
 
         /* in trees.c */
 void ct_init     OF((ush *attr, int *method));
 int  ct_tally    OF((int dist, int lc));
 off_t flush_block OF((char *buf, ulg stored_len, int pad, int eof));
+extern TLS ulg block_carry;
 
         /* in bits.c */
 void     bi_init    OF((file_t zipfile));
-void     send_bits  OF((int value, int length));
+void     send_bits  OF((ulg value, int length));
 unsigned bi_reverse OF((unsigned value, int length));
 void     bi_windup  OF((void));
 void     copy_block OF((char *buf, unsigned len, int header));
-extern   int (*read_buf) OF((char *buf, unsigned size));
+extern   TLS int (*read_buf) OF((char *buf, unsigned size));
 
 	/* in util.c: */
 extern int copy           OF((int in, int out));
 extern ulg  updcrc        OF((uch *s, unsigned n));
+extern void crc_init      OF((void));
+extern ulg  crc32_buf     OF((ulg crc, uch *s, unsigned n));
+extern ulg  crc32_combine OF((ulg crc1, ulg crc2, off_t len2));
 extern void clear_bufs    OF((void));
 extern int  fill_inbuf    OF((int eof_ok));
 extern void flush_outbuf  OF((void));
 extern void flush_window  OF((void));
 extern void write_buf     OF((int fd, voidp buf, unsigned cnt));
+extern int  read_input    OF((int fd, char *buf, unsigned size));
+extern void seek_input    OF((int fd, off_t pos));
+extern void map_input     OF((int fd));
+extern int  map_file      OF((int fd));
+extern void unmap_input   OF((void));
+extern void flush_bulk    OF((void));
+extern int  mem_read      OF((char *buf, unsigned size));
+extern void mem_input     OF((uch *buf, off_t size));
+extern TLS uch *mem_inbuf;   /* in-memory input, see util.c */
+extern TLS ulg  mem_insize;
+extern TLS unsigned mem_pad; /* zeros read after the end of mem_input */
+extern TLS uch *mem_outbuf;  /* in-memory output, see util.c */
+extern TLS ulg  mem_outcnt;
+extern TLS off_t stream_pos; /* uncompressed offset of window[0], see util.c */
+extern TLS ulg  mem_outsize;
 extern char *strlwr       OF((char *s));
 extern char *base_name    OF((char *fname));
 extern int xunlink        OF((char *fname));
@@ -658,6 +793,9 @@ extern void write_error   OF((void));
 extern void display_ratio OF((off_t num, off_t den, FILE *file));
 extern void fprint_off    OF((FILE *, off_t, int));
 extern voidp xmalloc      OF((unsigned int size));
+#ifndef NO_THREADS
+extern void block_signals OF((sigset_t *oset));
+#endif
 
 	/* in inflate.c */
 extern int inflate OF((void));
@@ -688,28 +826,54 @@ static char rcsid[] = "$Id: bits.c,v 0.9 1993/06/11 10:16:58 jloup Exp $";
  * Local data used by the "bit string" routines.
  */
 
-local file_t zfile; /* output gzip file */
+local TLS file_t zfile; /* output gzip file */
 
-local unsigned short bi_buf;
+local TLS ulg bi_buf;
 /* Output buffer. bits are inserted starting at the bottom (least significant
  * bits).
  */
 
-#define Buf_size (8 * 2*sizeof(char))
-/* Number of bits used within bi_buf. (bi_buf might be implemented on
- * more than 16 bits on some systems.)
+#define Buf_size (8 * (int)sizeof(ulg))
+/* Number of bits used within bi_buf. */
+
+local TLS int bi_valid;
+/* Number of valid bits in bi_buf, less than Buf_size.  All bits above the
+ * last valid bit are always zero.
+ */
+
+/* Write the full bi_buf, least significant byte first. outbuf has
+ * OUTBUF_EXTRA bytes after OUTBUFSIZ, so there is always room for it.
  */
+#define put_bi_buf() \
+{ uch *p_ = outbuf + outcnt; int k_; \
+  for (k_ = 0; k_ < Buf_size; k_ += 8) *p_++ = (uch)(bi_buf >> k_); \
+  outcnt += Buf_size/8; \
+  if (outcnt >= OUTBUFSIZ) flush_outbuf(); \
+}
 
-local int bi_valid;
-/* Number of valid bits in bi_buf.  All bits above the last valid bit
- * are always zero.
+/* Send value on length bits, 0 < length < Buf_size. The bits of value that
+ * do not fit in bi_buf are shifted out to the left, and are then taken
+ * again from value.
  */
+#ifndef DEBUG
+#  define SEND_BITS(value, length) \
+{ ulg v_ = (ulg)(value); int l_ = (length); \
+  bi_buf |= v_ << bi_valid; \
+  if ((bi_valid += l_) >= Buf_size) { \
+      put_bi_buf(); \
+      bi_valid -= Buf_size; \
+      bi_buf = bi_valid ? v_ >> (l_ - bi_valid) : 0; \
+  } \
+}
+#else
+#  define SEND_BITS(value, length) send_bits((ulg)(value), (length))
+#endif
 
-int (*read_buf) OF((char *buf, unsigned size));
+TLS int (*read_buf) OF((char *buf, unsigned size));
 /* Current input function. Set to mem_read for in-memory compression */
 
 #ifdef DEBUG
-  off_t bits_sent;   /* bit length of the compressed data */
+  TLS off_t bits_sent;   /* bit length of the compressed data */
 #endif
 
 /* ===========================================================================
@@ -735,29 +899,25 @@ void bi_init (zipfile)
 
 /* ===========================================================================
  * Send a value on a given number of bits.
- * IN assertion: length <= 16 and value fits in length bits.
+ * IN assertion: 0 < length < Buf_size and value fits in length bits.
  */
 void send_bits(value, length)
-    int value;  /* value to send */
+    ulg value;  /* value to send */
     int length; /* number of bits */
 {
 #ifdef DEBUG
-    Tracev((stderr," l %2d v %4x ", length, value));
-    Assert(length > 0 && length <= 15, "invalid length");
+    Tracev((stderr," l %2d v %4lx ", length, value));
+    Assert(length > 0 && length < Buf_size, "invalid length");
     bits_sent += (off_t)length;
 #endif
-    /* If not enough room in bi_buf, use (valid) bits from bi_buf and
-     * (16 - bi_valid) bits from value, leaving (width - (16-bi_valid))
-     * unused bits in value.
+    /* If not enough room in bi_buf, fill it with the low bits of value,
+     * write it, and keep the bits of value that did not fit.
      */
-    if (bi_valid > (int)Buf_size - length) {
-        bi_buf |= (value << bi_valid);
-        put_short(bi_buf);
-        bi_buf = (ush)value >> (Buf_size - bi_valid);
-        bi_valid += length - Buf_size;
-    } else {
-        bi_buf |= value << bi_valid;
-        bi_valid += length;
+    bi_buf |= value << bi_valid;
+    if ((bi_valid += length) >= Buf_size) {
+        put_bi_buf();
+        bi_valid -= Buf_size;
+        bi_buf = bi_valid ? value >> (length - bi_valid) : 0;
     }
 }
 
@@ -783,10 +943,10 @@ unsigned bi_reverse(code, len)
  */
 void bi_windup()
 {
-    if (bi_valid > 8) {
-        put_short(bi_buf);
-    } else if (bi_valid > 0) {
+    while (bi_valid > 0) {
         put_byte(bi_buf);
+        bi_buf >>= 8;
+        bi_valid -= 8;
     }
     bi_buf = 0;
     bi_valid = 0;
@@ -996,6 +1156,21 @@ static char rcsid[] = "$Id: deflate.c,v 0.15 1993/06/24 10:53:53 jloup Exp $";
 #define RSYNC_SUM_MATCH(sum) ((sum) % RSYNC_WIN == 0)
 /* Whether window sum matches magic value */
 
+#if defined(MAXSEG_64K) || defined(SMALL_MEM) || defined(ASMV)
+#  ifndef NO_BTREE
+#    define NO_BTREE /* the tree needs 2*WSIZE more Pos entries */
+#  endif
+#endif
+
+/* Match finders, selected by compression level: */
+#define MF_HASH3 0  /* hash chains of 3-byte strings */
+#define MF_HASH4 1  /* hash chains of 4-byte strings, shorter chains */
+#define MF_BTREE 2  /* binary trees of strings sharing a 3-byte hash */
+
+#if defined(__SSE2__) && !defined(NO_SSE2)
+#  include <emmintrin.h>
+#endif
+
 /* ===========================================================================
  * Local data used by the "longest match" routines.
  */
@@ -1031,12 +1206,27 @@ ulg window_size = (ulg)2*WSIZE;
  * input file length plus MIN_LOOKAHEAD.
  */
 
-long block_start;
+TLS long block_start;
 /* window position at the beginning of the current output block. Gets
  * negative when the window is moved backwards.
  */
 
-local unsigned ins_h;  /* hash index of string to be inserted */
+local TLS unsigned ins_h;  /* hash index of string to be inserted */
+
+local TLS int match_finder; /* MF_HASH3, MF_HASH4 or MF_BTREE */
+
+#ifndef NO_BTREE
+local TLS Pos bt_tree[2*WSIZE];
+/* Binary trees of the strings with same hash index (MF_BTREE). The tree
+ * root is in head[]; the smaller and greater children of the string at
+ * window index s are at bt_tree[2*(s & WMASK)] and bt_tree[2*(s & WMASK)+1].
+ */
+
+local TLS unsigned bt_len;   /* length of the best match found by bt_insert */
+local TLS IPos bt_match;     /* start of that match */
+local TLS unsigned bt_depth; /* maximum number of tree nodes visited */
+local TLS unsigned in_end;   /* end of the input read in the window */
+#endif
 
 #define H_SHIFT  ((HASH_BITS+MIN_MATCH-1)/MIN_MATCH)
 /* Number of bits by which ins_h and del_h must be shifted at each
@@ -1045,22 +1235,22 @@ local unsigned ins_h;  /* hash index of string to be inserted */
  *   H_SHIFT * MIN_MATCH >= HASH_BITS
  */
 
-unsigned int near prev_length;
+TLS unsigned int near prev_length;
 /* Length of the best match at previous step. Matches not greater than this
  * are discarded. This is used in the lazy match evaluation.
  */
 
-      unsigned near strstart;      /* start of string to insert */
-      unsigned near match_start;   /* start of matching string */
-local int           eofile;        /* flag set at end of input file */
-local unsigned      lookahead;     /* number of valid bytes ahead in window */
+      TLS unsigned near strstart;      /* start of string to insert */
+      TLS unsigned near match_start;   /* start of matching string */
+local TLS int           eofile;        /* flag set at end of input file */
+local TLS unsigned      lookahead;     /* number of valid bytes ahead in window */
 
-unsigned near max_chain_length;
+TLS unsigned near max_chain_length;
 /* To speed up deflation, hash chains are never searched beyond this length.
  * A higher limit improves compression ratio but degrades the speed.
  */
 
-local unsigned int max_lazy_match;
+local TLS unsigned int max_lazy_match;
 /* Attempt to find a better match only when the current match is strictly
  * smaller than this value. This mechanism is used only for compression
  * levels >= 4.
@@ -1071,14 +1261,28 @@ local unsigned int max_lazy_match;
  * max_insert_length is used only for compression levels <= 3.
  */
 
-local int compr_level;
+TLS int compr_level;
 /* compression level (1..9) */
 
-unsigned near good_match;
+TLS int compr_rsync;
+/* Deflate into rsyncable chunks (--rsyncable). Set before lm_init. */
+
+TLS int compr_greedy;
+/* Single-probe greedy matching for levels 1 and 2 (--fast-greedy). Set
+ * before lm_init.
+ */
+
+TLS unsigned near good_match;
 /* Use a faster search when the previous match is longer than this */
 
-local ulg rsync_sum;  /* rolling sum of rsync window */
-local ulg rsync_chunk_end; /* next rsync sequence point */
+local TLS ulg rsync_sum;  /* rolling sum of rsync window */
+local TLS ulg rsync_chunk_end; /* next rsync sequence point */
+
+TLS int final_block = 1;
+/* Set the last-block bit at end of input. Cleared for all but the last chunk
+ * of a parallel compression (see pzip.c): such a chunk is instead padded to
+ * a byte boundary so that the next compressed chunk can be appended to it.
+ */
 
 /* Values for max_lazy_match, good_match and max_chain_length, depending on
  * the desired pack level (0..9). The values given below have been tuned to
@@ -1091,32 +1295,52 @@ typedef struct config {
    ush max_lazy;    /* do not perform lazy search above this match length */
    ush nice_length; /* quit search above this match length */
    ush max_chain;
+   ush finder;      /* match finder, MF_HASH3 .. MF_BTREE */
 } config;
 
 #ifdef  FULL_SEARCH
 # define nice_match MAX_MATCH
 #else
-  int near nice_match; /* Stop searching when current match exceeds this */
+  TLS int near nice_match; /* Stop searching when current match exceeds this */
 #endif
 
 local config configuration_table[10] = {
-/*      good lazy nice chain */
-/* 0 */ {0,    0,  0,    0},  /* store only */
-/* 1 */ {4,    4,  8,    4},  /* maximum speed, no lazy matches */
-/* 2 */ {4,    5, 16,    8},
-/* 3 */ {4,    6, 32,   32},
-
-/* 4 */ {4,    4, 16,   16},  /* lazy matches */
-/* 5 */ {8,   16, 32,   32},
-/* 6 */ {8,   16, 128, 128},
-/* 7 */ {8,   32, 128, 256},
-/* 8 */ {32, 128, 258, 1024},
-/* 9 */ {32, 258, 258, 4096}}; /* maximum compression */
+/*      good lazy nice chain finder */
+/* 0 */ {0,    0,  0,    0, MF_HASH3},  /* store only */
+/* 1 */ {4,    4,  8,    4, MF_HASH3},  /* maximum speed, no lazy matches */
+/* 2 */ {4,    5, 16,    8, MF_HASH3},
+/* 3 */ {4,    6, 32,   32, MF_HASH3},
+
+/* 4 */ {4,    4, 16,   16, MF_HASH4},  /* lazy matches */
+/* 5 */ {8,   16, 32,   32, MF_HASH4},
+/* 6 */ {8,   16, 128, 128, MF_HASH4},
+/* 7 */ {8,   32, 128, 256, MF_HASH4},
+/* 8 */ {32, 128, 258, 1024, MF_BTREE},
+/* 9 */ {32, 258, 258, 4096, MF_BTREE}}; /* maximum compression */
 
 /* Note: the deflate() code requires max_lazy >= MIN_MATCH and max_chain >= 4
  * For deflate_fast() (levels <= 3) good is ignored and lazy has a different
- * meaning.
+ * meaning. For MF_BTREE, max_chain/BT_DEPTH_DIV bounds the tree depth.
+ */
+
+#ifndef BT_DEPTH_DIV
+#  define BT_DEPTH_DIV 16
+#endif
+
+/* The strings inside a match repeat strings of the trees: in a match of at
+ * least BT_SKIP_LEN bytes, only those in its last BT_KEEP bytes are inserted,
+ * and they are compared on BT_INSERT_LEN bytes at most. Otherwise each string
+ * of a highly repetitive input would cost a compare of nice_match bytes.
  */
+#ifndef BT_SKIP_LEN
+#  define BT_SKIP_LEN 64
+#endif
+#ifndef BT_KEEP
+#  define BT_KEEP 16
+#endif
+#ifndef BT_INSERT_LEN
+#  define BT_INSERT_LEN 64
+#endif
 
 #define EQUAL 0
 /* result of memcmp for equal strings */
@@ -1126,8 +1350,13 @@ local config configuration_table[10] = {
  */
 local void fill_window   OF((void));
 local off_t deflate_fast OF((void));
+local off_t deflate_greedy OF((void));
 
       int  longest_match OF((IPos cur_match));
+local unsigned compare_len OF((uch *scan, uch *match, unsigned max));
+#ifndef NO_BTREE
+local IPos bt_insert     OF((IPos s, unsigned max));
+#endif
 #ifdef ASMV
       void match_init OF((void)); /* asm code initialization */
 #endif
@@ -1144,6 +1373,16 @@ local  void check_match OF((IPos start, IPos match, int length));
  */
 #define UPDATE_HASH(h,c) (h = (((h)<<H_SHIFT) ^ (c)) & HASH_MASK)
 
+/* ===========================================================================
+ * Hash index of the 4 bytes at window index s, for MF_HASH4. Unlike
+ * UPDATE_HASH, this is not a rolling hash: equal hash indexes do not
+ * imply equal bytes.
+ */
+#define HASH4(s) \
+   (unsigned)((((ulg)window[s] | (ulg)window[(s)+1] << 8 | \
+               (ulg)window[(s)+2] << 16 | (ulg)window[(s)+3] << 24) * \
+              0x9e3779b1L & 0xffffffffL) >> (32-HASH_BITS))
+
 /* ===========================================================================
  * Insert string s in the dictionary and set match_head to the previous head
  * of the hash chain (the most recent string with same hash key). Return
@@ -1152,10 +1391,24 @@ local  void check_match OF((IPos start, IPos match, int length));
  *    input characters and the first MIN_MATCH bytes of s are valid
  *    (except for the last MIN_MATCH-1 bytes of the input file).
  */
+#ifdef NO_BTREE
 #define INSERT_STRING(s, match_head) \
-   (UPDATE_HASH(ins_h, window[(s) + MIN_MATCH-1]), \
+   (match_finder == MF_HASH4 ? (ins_h = HASH4(s)) \
+                             : UPDATE_HASH(ins_h, window[(s) + MIN_MATCH-1]), \
     prev[(s) & WMASK] = match_head = head[ins_h], \
     head[ins_h] = (s))
+#else
+/* With MF_BTREE, the string is inserted in its tree, which also yields
+ * the best match for it (see bt_insert).
+ */
+#define INSERT_STRING(s, match_head) \
+   (match_finder == MF_HASH4 ? (ins_h = HASH4(s)) \
+                             : UPDATE_HASH(ins_h, window[(s) + MIN_MATCH-1]), \
+    match_finder == MF_BTREE ? \
+     (match_head = bt_insert(s, (unsigned)nice_match)) : \
+    (prev[(s) & WMASK] = match_head = head[ins_h], \
+     head[ins_h] = (s)))
+#endif
 
 /* ===========================================================================
  * Initialize the "longest match" routines for a new file
@@ -1163,8 +1416,22 @@ local  void check_match OF((IPos start, IPos match, int length));
 void lm_init (pack_level, flags)
     int pack_level; /* 0: store, 1: best speed, 9: best compression */
     ush *flags;     /* general purpose bit flag */
+{
+    lm_init_dict(pack_level, flags, (uch*)NULL, 0);
+}
+
+/* ===========================================================================
+ * Same as lm_init, but preload the window with a dictionary of len bytes
+ * (at most WSIZE) that matches can refer to but which is not compressed.
+ */
+void lm_init_dict (pack_level, flags, dict, len)
+    int pack_level; /* 0: store, 1: best speed, 9: best compression */
+    ush *flags;     /* general purpose bit flag */
+    uch *dict;      /* preset dictionary, or NULL */
+    unsigned len;   /* length of dict */
 {
     register unsigned j;
+    IPos hash_head;
 
     if (pack_level < 1 || pack_level > 9) error("bad pack level");
     compr_level = pack_level;
@@ -1189,6 +1456,15 @@ void lm_init (pack_level, flags)
     nice_match       = configuration_table[pack_level].nice_length;
 #endif
     max_chain_length = configuration_table[pack_level].max_chain;
+    match_finder     = configuration_table[pack_level].finder;
+#ifdef NO_BTREE
+    if (match_finder == MF_BTREE) match_finder = MF_HASH4;
+#else
+    bt_depth = max_chain_length / BT_DEPTH_DIV;
+#endif
+#ifdef ASMV
+    match_finder = MF_HASH3; /* the asm code assumes 3-byte hashing */
+#endif
     if (pack_level == 1) {
        *flags |= FAST;
     } else if (pack_level == 9) {
@@ -1202,21 +1478,37 @@ void lm_init (pack_level, flags)
     match_init(); /* initialize the asm code */
 #endif
 
-    lookahead = read_buf((char*)window,
-			 sizeof(int) <= 2 ? (unsigned)WSIZE : 2*WSIZE);
+    if (len != 0) {
+        Assert(len <= WSIZE, "dictionary too large");
+        memcpy((char*)window, (char*)dict, len);
+#ifndef NO_BTREE
+        in_end = len;
+#endif
+        ins_h = 0;
+        for (j=0; j<MIN_MATCH-1; j++) UPDATE_HASH(ins_h, window[j]);
+        for (j=0; j+MIN_MATCH <= len; j++) INSERT_STRING(j, hash_head);
+        strstart = len;
+        block_start = (long)len;
+    }
+
+    lookahead = read_buf((char*)window+strstart,
+			 sizeof(int) <= 2 ? (unsigned)WSIZE : 2*WSIZE-strstart);
 
     if (lookahead == 0 || lookahead == (unsigned)EOF) {
        eofile = 1, lookahead = 0;
        return;
     }
     eofile = 0;
+#ifndef NO_BTREE
+    in_end = strstart + lookahead;
+#endif
     /* Make sure that we always have enough lookahead. This is important
      * if input comes from a device such as a tty.
      */
     while (lookahead < MIN_LOOKAHEAD && !eofile) fill_window();
 
     ins_h = 0;
-    for (j=0; j<MIN_MATCH-1; j++) UPDATE_HASH(ins_h, window[j]);
+    for (j=0; j<MIN_MATCH-1; j++) UPDATE_HASH(ins_h, window[strstart+j]);
     /* If lookahead < MIN_MATCH, ins_h is garbage, but this is
      * not important since only literal bytes will be emitted.
      */
@@ -1248,6 +1540,23 @@ int longest_match(cur_match)
      * we prevent matches with the string of window index 0.
      */
 
+#ifndef NO_BTREE
+    if (match_finder == MF_BTREE) {
+        /* The search was done by bt_insert. Check the match length: the
+         * tree order is only guaranteed up to the length of the shortest
+         * insertion, and longer matches may have been assumed.
+         */
+        if (bt_len > (unsigned)best_len) {
+            len = (int)compare_len(scan, window + bt_match, bt_len);
+            if (len > best_len) {
+                match_start = bt_match;
+                best_len = len;
+            }
+        }
+        return best_len;
+    }
+#endif
+
 /* The code is optimized for HASH_BITS >= 8 and MAX_MATCH-2 multiple of 16.
  * It is easy to get rid of this optimization if necessary.
  */
@@ -1263,7 +1572,6 @@ int longest_match(cur_match)
     register ush scan_start = *(ush*)scan;
     register ush scan_end   = *(ush*)(scan+best_len-1);
 #else
-    register uch *strend = window + strstart + MAX_MATCH;
     register uch scan_end1  = scan[best_len-1];
     register uch scan_end   = scan[best_len];
 #endif
@@ -1322,24 +1630,10 @@ int longest_match(cur_match)
 
         /* The check at best_len-1 can be removed because it will be made
          * again later. (This heuristic is not always a win.)
-         * It is not necessary to compare scan[2] and match[2] since they
-         * are always equal when the other bytes match, given that
-         * the hash keys are equal and that HASH_BITS >= 8.
-         */
-        scan += 2, match++;
-
-        /* We check for insufficient lookahead only every 8th comparison;
-         * the 256th check will be made at strstart+258.
+         * scan[2] and match[2] are compared again since they need not be
+         * equal with MF_HASH4.
          */
-        do {
-        } while (*++scan == *++match && *++scan == *++match &&
-                 *++scan == *++match && *++scan == *++match &&
-                 *++scan == *++match && *++scan == *++match &&
-                 *++scan == *++match && *++scan == *++match &&
-                 scan < strend);
-
-        len = MAX_MATCH - (int)(strend - scan);
-        scan = strend - MAX_MATCH;
+        len = 2 + (int)compare_len(scan+2, match+1, MAX_MATCH-2);
 
 #endif /* UNALIGNED_OK */
 
@@ -1361,6 +1655,122 @@ int longest_match(cur_match)
 }
 #endif /* ASMV */
 
+/* ===========================================================================
+ * Return the number of equal leading bytes of scan and match, at most max.
+ * Compares 16 bytes at a time with SSE2, or a word at a time using the
+ * position of the first differing bit. Does not read beyond scan[max-1].
+ */
+local unsigned compare_len(scan, match, max)
+    register uch *scan;
+    register uch *match;
+    unsigned max;
+{
+    register unsigned len = 0;
+
+#if defined(__SSE2__) && !defined(NO_SSE2)
+    unsigned mask;
+
+    for (; len + 16 <= max; len += 16) {
+        mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                   _mm_loadu_si128((__m128i*)(scan+len)),
+                   _mm_loadu_si128((__m128i*)(match+len))));
+        if (mask != 0xffff) {
+            return len + (unsigned)__builtin_ctz(~mask);
+        }
+    }
+#else
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && ULONG_MAX > 0xffffffffUL
+    ulg a, b;
+
+    for (; len + sizeof(a) <= max; len += sizeof(a)) {
+        memcpy(&a, scan+len, sizeof(a));
+        memcpy(&b, match+len, sizeof(b));
+        if (a != b) {
+            return len + (unsigned)__builtin_ctzl(a ^ b) / 8;
+        }
+    }
+#endif
+#endif
+    while (len < max && scan[len] == match[len]) len++;
+    return len;
+}
+
+#ifndef NO_BTREE
+/* ===========================================================================
+ * Insert the string at window index s in the binary tree of its hash
+ * index ins_h, and set bt_len and bt_match to the longest match found on
+ * the way down. The new string becomes the root: the tree is split into
+ * the strings smaller and greater than it, ordered by their first bytes
+ * (up to max). Return the previous root, or NIL.
+ * IN assertion: ins_h is the hash index of the string at s.
+ */
+local IPos bt_insert(s, max)
+    IPos s;
+    unsigned max;   /* longest match of interest */
+{
+    IPos cur_match = head[ins_h];       /* current tree node */
+    IPos root = cur_match;              /* previous root */
+    Pos *smaller = bt_tree + 2*(s & WMASK);   /* where to link next smaller */
+    Pos *greater = smaller + 1;               /* where to link next greater */
+    unsigned len_smaller = 0;   /* match length with the last smaller node */
+    unsigned len_greater = 0;   /* match length with the last greater node */
+    unsigned depth = bt_depth;
+    register unsigned len;
+    register uch *scan = window + s;
+    register uch *match;
+    unsigned nice = in_end - s;         /* longest possible match */
+    IPos limit = s > (IPos)MAX_DIST ? s - (IPos)MAX_DIST : NIL;
+    BENCH_VAR(t0)
+
+    if (nice > max) nice = max;
+    bt_len = 0;
+    if (nice < MIN_MATCH) return root; /* too close to the end, skip it */
+    BENCH_START(t0);
+    head[ins_h] = (Pos)s;
+
+    for (;;) {
+        if (cur_match <= limit || depth-- == 0) {
+            *smaller = *greater = NIL;
+            break;
+        }
+        match = window + cur_match;
+
+        /* All the strings below this node share at least the shorter of
+         * len_smaller and len_greater bytes with the current string.
+         */
+        len = len_smaller < len_greater ? len_smaller : len_greater;
+        if (match[len] == scan[len]) {
+            len++;
+            len += compare_len(scan+len, match+len, nice-len);
+            if (len > bt_len) {
+                bt_len = len;
+                bt_match = cur_match;
+            }
+            if (len >= nice) {
+                /* Equal as far as we care: replace the node by s */
+                *smaller = bt_tree[2*(cur_match & WMASK)];
+                *greater = bt_tree[2*(cur_match & WMASK)+1];
+                break;
+            }
+        }
+        if (match[len] < scan[len]) {
+            *smaller = (Pos)cur_match;
+            smaller = bt_tree + 2*(cur_match & WMASK) + 1;
+            cur_match = *smaller;
+            len_smaller = len;
+        } else {
+            *greater = (Pos)cur_match;
+            greater = bt_tree + 2*(cur_match & WMASK);
+            cur_match = *greater;
+            len_greater = len;
+        }
+    }
+    BENCH_STOP(BP_MATCH, t0);
+    return root;
+}
+#endif /* NO_BTREE */
+
 #ifdef DEBUG
 /* ===========================================================================
  * Check that the match at match_start is indeed a match.
@@ -1433,6 +1843,14 @@ local void fill_window()
              * its value will never be used.
              */
         }
+#ifndef NO_BTREE
+        if (match_finder == MF_BTREE) {
+            for (n = 0; n < 2*WSIZE; n++) {
+                m = bt_tree[n];
+                bt_tree[n] = (Pos)(m >= WSIZE ? m-WSIZE : NIL);
+            }
+        }
+#endif
         more += WSIZE;
     }
     /* At this point, more >= 2 */
@@ -1440,10 +1858,17 @@ local void fill_window()
         n = read_buf((char*)window+strstart+lookahead, more);
         if (n == 0 || n == (unsigned)EOF) {
             eofile = 1;
+            /* Don't let stale data of a previous input be used in a match */
+            m = strstart + lookahead;
+            memzero((char*)window+m, (unsigned)(window_size - m) < MAX_MATCH ?
+                    (unsigned)(window_size - m) : MAX_MATCH);
         } else {
             lookahead += n;
         }
     }
+#ifndef NO_BTREE
+    in_end = strstart + lookahead;
+#endif
 }
 
 local void rsync_roll(start, num)
@@ -1477,7 +1902,7 @@ local void rsync_roll(start, num)
  * Set rsync_chunk_end if window sum matches magic value.
  */
 #define RSYNC_ROLL(s, n) \
-   do { if (rsync) rsync_roll((s), (n)); } while(0)
+   do { if (compr_rsync) rsync_roll((s), (n)); } while(0)
 
 /* ===========================================================================
  * Flush the current block, with given end-of-file flag.
@@ -1487,6 +1912,11 @@ local void rsync_roll(start, num)
    flush_block(block_start >= 0L ? (char*)&window[(unsigned)block_start] : \
                 (char*)NULL, (long)strstart - block_start, flush-1, (eof))
 
+/* Start the next block after FLUSH_BLOCK(0). flush_block may have kept the
+ * last block_carry bytes for it.
+ */
+#define NEXT_BLOCK() (block_start = (long)strstart - (long)block_carry)
+
 /* ===========================================================================
  * Processes a new input file and return its compressed length. This
  * function does not perform lazy evaluationof matches and inserts
@@ -1515,14 +1945,15 @@ local off_t deflate_fast()
              * of window index 0 (in particular we have to avoid a match
              * of the string with itself at the start of the input file).
              */
-            match_length = longest_match (hash_head);
+            BENCH(BP_MATCH, match_length = longest_match (hash_head));
             /* longest_match() sets match_start */
             if (match_length > lookahead) match_length = lookahead;
         }
         if (match_length >= MIN_MATCH) {
             check_match(strstart, match_start, match_length);
 
-            flush = ct_tally(strstart-match_start, match_length - MIN_MATCH);
+            BENCH(BP_TALLY, flush = ct_tally(strstart-match_start,
+                                             match_length - MIN_MATCH));
 
             lookahead -= match_length;
 
@@ -1554,16 +1985,16 @@ local off_t deflate_fast()
         } else {
             /* No match, output a literal byte */
             Tracevv((stderr,"%c",window[strstart]));
-            flush = ct_tally (0, window[strstart]);
+            BENCH(BP_TALLY, flush = ct_tally (0, window[strstart]));
 	    RSYNC_ROLL(strstart, 1);
             lookahead--;
 	    strstart++; 
         }
-	if (rsync && strstart > rsync_chunk_end) {
+	if (compr_rsync && strstart > rsync_chunk_end) {
 	    rsync_chunk_end = 0xFFFFFFFFUL;
 	    flush = 2;
 	} 
-        if (flush) FLUSH_BLOCK(0), block_start = strstart;
+        if (flush) FLUSH_BLOCK(0), NEXT_BLOCK();
 
         /* Make sure that we always have enough lookahead, except
          * at the end of the input file. We need MAX_MATCH bytes
@@ -1576,6 +2007,92 @@ local off_t deflate_fast()
     return FLUSH_BLOCK(1); /* eof */
 }
 
+/* ===========================================================================
+ * Same as deflate_fast, but even faster (--fast-greedy option). head[] is
+ * a single-probe table of 4-byte strings: only the most recent string with
+ * the same hash is tried, and prev[] is not used. Only the strings at the
+ * end of long matches are inserted. After each GREEDY_SKIP positions without
+ * a match, the search step grows by one, so that incompressible data is
+ * skipped quickly (the skipped bytes are emitted as literals).
+ */
+#ifndef GREEDY_SKIP
+#  define GREEDY_SKIP 32
+#endif
+
+local off_t deflate_greedy()
+{
+    IPos hash_head;  /* previous string with the same hash */
+    unsigned h;      /* hash index of the current string */
+    int flush = 0;   /* set if current block must be flushed */
+    unsigned match_length; /* length of the current match */
+    unsigned misses = 0;   /* positions searched since the last match */
+    unsigned step;   /* number of literals to emit on a miss */
+
+    while (lookahead != 0) {
+        match_length = 0;
+        if (lookahead >= MIN_MATCH+1 &&
+            strstart <= window_size - MIN_LOOKAHEAD) {
+            h = HASH4(strstart);
+            hash_head = head[h];
+            head[h] = (Pos)strstart;
+            if (hash_head != NIL && strstart - hash_head <= MAX_DIST &&
+                window[hash_head] == window[strstart] &&
+                window[hash_head+1] == window[strstart+1] &&
+                window[hash_head+2] == window[strstart+2]) {
+                BENCH(BP_MATCH,
+                      match_length = compare_len(window+strstart,
+                                                 window+hash_head,
+                                                 lookahead < MAX_MATCH ?
+                                                 lookahead : MAX_MATCH));
+                match_start = hash_head;
+            }
+        }
+        if (match_length >= MIN_MATCH) {
+            check_match(strstart, match_start, match_length);
+
+            BENCH(BP_TALLY, flush = ct_tally(strstart-match_start,
+                                             match_length - MIN_MATCH));
+            lookahead -= match_length;
+
+            /* Insert the strings inside short matches, and only the last
+             * two strings of longer ones.
+             */
+            if (match_length <= max_insert_length) {
+                while (--match_length != 0) {
+                    strstart++;
+                    head[HASH4(strstart)] = (Pos)strstart;
+                }
+                strstart++;
+            } else {
+                strstart += match_length - 2;
+                head[HASH4(strstart)] = (Pos)strstart;
+                strstart++;
+                head[HASH4(strstart)] = (Pos)strstart;
+                strstart++;
+            }
+            misses = 0;
+            if (flush) FLUSH_BLOCK(0), NEXT_BLOCK();
+        } else {
+            /* No match, output one or more literal bytes */
+            step = 1 + misses++ / GREEDY_SKIP;
+            if (step > lookahead) step = lookahead;
+            do {
+                Tracevv((stderr,"%c",window[strstart]));
+                BENCH(BP_TALLY, flush = ct_tally (0, window[strstart]));
+                lookahead--;
+                strstart++;
+                if (flush) FLUSH_BLOCK(0), NEXT_BLOCK();
+            } while (--step != 0);
+        }
+
+        /* Make sure that we always have enough lookahead, except
+         * at the end of the input file.
+         */
+        while (lookahead < MIN_LOOKAHEAD && !eofile) fill_window();
+    }
+    return FLUSH_BLOCK(1); /* eof */
+}
+
 /* ===========================================================================
  * Same as above, but achieves better compression. We use a lazy
  * evaluation for matches: a match is finally adopted only if there is
@@ -1588,7 +2105,13 @@ off_t deflate()
     int flush;               /* set if current block must be flushed */
     int match_available = 0; /* set if previous match exists */
     register unsigned match_length = MIN_MATCH-1; /* length of best match */
+#ifndef NO_BTREE
+    unsigned keep;           /* MF_BTREE: strings of a match to insert */
+#endif
 
+    if (compr_greedy && compr_level <= 2 && !compr_rsync) {
+        return deflate_greedy();
+    }
     if (compr_level <= 3) return deflate_fast(); /* optimized for speed */
 
     /* Process the input block. */
@@ -1610,7 +2133,7 @@ off_t deflate()
              * of window index 0 (in particular we have to avoid a match
              * of the string with itself at the start of the input file).
              */
-            match_length = longest_match (hash_head);
+            BENCH(BP_MATCH, match_length = longest_match (hash_head));
             /* longest_match() sets match_start */
             if (match_length > lookahead) match_length = lookahead;
 
@@ -1629,16 +2152,29 @@ off_t deflate()
 
             check_match(strstart-1, prev_match, prev_length);
 
-            flush = ct_tally(strstart-1-prev_match, prev_length - MIN_MATCH);
+            BENCH(BP_TALLY, flush = ct_tally(strstart-1-prev_match,
+                                             prev_length - MIN_MATCH));
 
             /* Insert in hash table all strings up to the end of the match.
-             * strstart-1 and strstart are already inserted.
+             * strstart-1 and strstart are already inserted. With MF_BTREE,
+             * only the last ones of a long match, see BT_SKIP_LEN.
              */
             lookahead -= prev_length-1;
+#ifndef NO_BTREE
+            keep = prev_length >= BT_SKIP_LEN ? BT_KEEP : MAX_MATCH;
+#endif
             prev_length -= 2;
 	    RSYNC_ROLL(strstart, prev_length+1);
             do {
                 strstart++;
+#ifndef NO_BTREE
+                if (match_finder == MF_BTREE) {
+                    UPDATE_HASH(ins_h, window[strstart + MIN_MATCH-1]);
+                    if (prev_length <= keep) {
+                        (void)bt_insert(strstart, BT_INSERT_LEN);
+                    }
+                } else
+#endif
                 INSERT_STRING(strstart, hash_head);
                 /* strstart never exceeds WSIZE-MAX_MATCH, so there are
                  * always MIN_MATCH bytes ahead. If lookahead < MIN_MATCH
@@ -1650,23 +2186,23 @@ off_t deflate()
             match_length = MIN_MATCH-1;
             strstart++;
 
-	    if (rsync && strstart > rsync_chunk_end) {
+	    if (compr_rsync && strstart > rsync_chunk_end) {
 		rsync_chunk_end = 0xFFFFFFFFUL;
 		flush = 2;
 	    }
-            if (flush) FLUSH_BLOCK(0), block_start = strstart;
+            if (flush) FLUSH_BLOCK(0), NEXT_BLOCK();
         } else if (match_available) {
             /* If there was no match at the previous position, output a
              * single literal. If there was a match but the current match
              * is longer, truncate the previous match to a single literal.
              */
             Tracevv((stderr,"%c",window[strstart-1]));
-	    flush = ct_tally (0, window[strstart-1]);
-	    if (rsync && strstart > rsync_chunk_end) {
+	    BENCH(BP_TALLY, flush = ct_tally (0, window[strstart-1]));
+	    if (compr_rsync && strstart > rsync_chunk_end) {
 		rsync_chunk_end = 0xFFFFFFFFUL;
 		flush = 2;
 	    }
-            if (flush) FLUSH_BLOCK(0), block_start = strstart;
+            if (flush) FLUSH_BLOCK(0), NEXT_BLOCK();
 	    RSYNC_ROLL(strstart, 1);
             strstart++;
             lookahead--;
@@ -1674,11 +2210,11 @@ off_t deflate()
             /* There is no previous match to compare with, wait for
              * the next step to decide.
              */
-	    if (rsync && strstart > rsync_chunk_end) {
+	    if (compr_rsync && strstart > rsync_chunk_end) {
 		/* Reset huffman tree */
 		rsync_chunk_end = 0xFFFFFFFFUL;
 		flush = 2;
-		FLUSH_BLOCK(0), block_start = strstart;
+		FLUSH_BLOCK(0), NEXT_BLOCK();
 	    }
             match_available = 1;
 	    RSYNC_ROLL(strstart, 1);
@@ -2952,11 +3488,12 @@ typedef RETSIGTYPE (*sig_type) OF((int));
 #endif
 
 #ifndef OFF_T_MIN
-#define OFF_T_MIN (~ (off_t) 0 << (sizeof (off_t) * CHAR_BIT - 1))
+#define OFF_T_MIN (- OFF_T_MAX - 1)
 #endif
 
 #ifndef OFF_T_MAX
-#define OFF_T_MAX (~ (off_t) 0 - OFF_T_MIN)
+#define OFF_T_MAX (((off_t) 1 << (sizeof (off_t) * CHAR_BIT - 2)) - 1 + \
+		   ((off_t) 1 << (sizeof (off_t) * CHAR_BIT - 2)))
 #endif
 
 /* Separator for file name parts (see shorten_name()) */
@@ -2996,33 +3533,39 @@ int test = 0;         /* test .gz file integrity */
 int foreground;       /* set if program run in foreground */
 char *progname;       /* program name */
 int maxbits = BITS;   /* max bits per code for LZW */
-int method = DEFLATED;/* compression method */
+TLS int method = DEFLATED;/* compression method */
 int level = 6;        /* compression level */
 int exit_code = OK;   /* program exit code */
-int save_orig_name;   /* set if original name must be saved */
-int last_member;      /* set for .zip and .Z files */
-int part_nb;          /* number of parts in .gz file */
-time_t time_stamp;      /* original time stamp (modification time) */
-off_t ifile_size;      /* input file size, -1 for devices (debug only) */
+TLS int save_orig_name; /* set if original name must be saved */
+TLS int last_member;  /* set for .zip and .Z files */
+TLS int part_nb;      /* number of parts in .gz file */
+TLS time_t time_stamp; /* original time stamp (modification time) */
+TLS off_t ifile_size; /* input file size, -1 for devices (debug only) */
 char *env;            /* contents of GZIP env variable */
 char **args = NULL;   /* argv pointer if GZIP env variable defined */
 char *z_suffix;       /* default suffix (can be set with --suffix) */
 size_t z_len;         /* strlen(z_suffix) */
 
-off_t bytes_in;             /* number of input bytes */
-off_t bytes_out;            /* number of output bytes */
+TLS off_t bytes_in;         /* number of input bytes */
+TLS off_t bytes_out;        /* number of output bytes */
 off_t total_in;		    /* input bytes for all files */
 off_t total_out;	    /* output bytes for all files */
-char ifname[MAX_PATH_LEN]; /* input file name */
-char ofname[MAX_PATH_LEN]; /* output file name */
-int  remove_ofname = 0;	   /* remove output file on error */
-struct stat istat;         /* status for input file */
-int  ifd;                  /* input file descriptor */
-int  ofd;                  /* output file descriptor */
-unsigned insize;           /* valid bytes in inbuf */
-unsigned inptr;            /* index of next byte to be processed in inbuf */
-unsigned outcnt;           /* bytes in output buffer */
+TLS char ifname[MAX_PATH_LEN]; /* input file name */
+TLS char ofname[MAX_PATH_LEN]; /* output file name */
+TLS int  remove_ofname = 0;   /* remove output file on error */
+TLS struct stat istat;        /* status for input file */
+TLS int  ifd;              /* input file descriptor */
+TLS int  ofd;              /* output file descriptor */
+TLS unsigned insize;       /* valid bytes in inbuf */
+TLS unsigned inptr;        /* index of next byte to be processed in inbuf */
+TLS unsigned outcnt;       /* bytes in output buffer */
 int rsync = 0;             /* make ryncable chunks */
+int processes = 1;         /* number of compression threads (-p) */
+int mmap_io = 0;           /* map input files, batch output writes */
+int fast_greedy = 0;       /* single-probe greedy matching for -1, -2 */
+off_t index_span = 0;      /* distance between access points (--index) */
+off_t range_start = -1;    /* first byte to extract (--range), or -1 */
+off_t range_end = -1;      /* end of the range, or -1 for end of file */
 
 struct option longopts[] =
 {
@@ -3053,6 +3596,12 @@ struct option longopts[] =
     {"lzw",        0, 0, 'Z'}, /* make output compatible with old compress */
     {"bits",       1, 0, 'b'}, /* max number of bits per code (implies -Z) */
     {"rsyncable",  0, 0, 'R'}, /* make rsync-friendly archive */
+    {"processes",  1, 0, 'p'}, /* number of compression threads */
+    {"mmap",       0, 0, 'Y'}, /* map input files, batch output writes */
+    {"fast-greedy",0, 0, 'G'}, /* faster -1 and -2, less compression */
+    {"index",      2, 0, 'I'}, /* write an access point index */
+    {"range",      1, 0, 'X'}, /* extract part of the decompressed data */
+    {"bench",      0, 0, 'B'}, /* measure speed in memory, write no file */
     { 0, 0, 0, 0 }
 };
 
@@ -3087,13 +3636,23 @@ local void treat_dir    OF((char *dir));
 #ifdef HAVE_UTIME
 local void reset_times  OF((char *name, struct stat *statb));
 #endif
+#if !defined(NO_THREADS) && ! NO_DIR
+local void rp_start     OF((void));
+local void rp_add       OF((char *name));
+local void rp_defer     OF((char *dir, struct stat *sbuf));
+local void *rp_main     OF((void *arg));
+local void rp_finish    OF((void));
+#endif
+
+local int rp_threads = 0;    /* threads of the -r -p pool, 0 if not used */
+local TLS int rp_worker = 0; /* set in the threads of the pool */
 
 #define strequ(s1, s2) (strcmp((s1),(s2)) == 0)
 
 /* ======================================================================== */
 local void usage()
 {
-    printf ("usage: %s [-%scdfhlLnN%stvV19] [-S suffix] [file ...]\n",
+    printf ("usage: %s [-%scdfhlLnN%stvV19] [-S suffix] [-p n] [file ...]\n",
 	    progname,
 	    O_BINARY ? "a" : "", NO_DIR ? "" : "r");
 }
@@ -3134,6 +3693,16 @@ local void help()
  " -b --bits maxbits   max number of bits per code (implies -Z)",
 #endif
  "    --rsyncable   Make rsync-friendly archive",
+ "    --fast-greedy faster -1 and -2 with less compression",
+#ifndef NO_THREADS
+ " -p --processes n  compress or decompress using n threads",
+#endif
+#ifndef NO_MMAP
+ "    --mmap        map input files in memory and write output in large blocks",
+#endif
+ "    --index[=n]   test, and write file.idx with an access point every n MiB",
+ "    --range off:len  write len bytes from offset off of the decompressed data",
+ "    --bench       measure the speed of each level in memory, write no file",
  " file...          files to (de)compress. If none given, use standard input.",
  "Report bugs to <bug-gzip@gnu.org>.",
   0};
@@ -3191,6 +3760,12 @@ local void version()
 #ifdef DYN_ALLOC
     printf ("DYN_ALLOC ");
 #endif
+#ifdef NO_THREADS
+    printf ("NO_THREADS ");
+#endif
+#ifdef NO_MMAP
+    printf ("NO_MMAP ");
+#endif
 #ifdef MAXSEG_64K
     printf ("MAXSEG_64K");
 #endif
@@ -3222,6 +3797,8 @@ int main (argc, argv)
     progname = base_name (argv[0]);
     proglen = strlen(progname);
 
+    gz_init();
+
     /* Suppress .exe for MSDOS, OS/2 and VMS: */
     if (proglen > 4 && strequ(progname+proglen-4, ".exe")) {
         progname[proglen-4] = '\0';
@@ -3266,7 +3843,7 @@ int main (argc, argv)
     z_suffix = Z_SUFFIX;
     z_len = strlen(z_suffix);
 
-    while ((optc = getopt_long (argc, argv, "ab:cdfhH?lLmMnNqrS:tvVZ123456789",
+    while ((optc = getopt_long (argc, argv, "ab:cdfhH?lLmMnNp:qrS:tvVZ123456789",
 				longopts, (int *)0)) != -1) {
 	switch (optc) {
         case 'a':
@@ -3302,6 +3879,25 @@ int main (argc, argv)
 	    no_name = no_time = 1; break;
 	case 'N':
 	    no_name = no_time = 0; break;
+	case 'p':
+	    processes = atoi(optarg);
+	    for (; *optarg; optarg++)
+	      if (! ('0' <= *optarg && *optarg <= '9'))
+		{
+		  fprintf (stderr, "%s: -p operand is not an integer\n",
+			   progname);
+		  usage ();
+		  do_exit (ERROR);
+		}
+	    if (processes < 1) processes = 1;
+#ifdef NO_THREADS
+	    if (processes > 1 && !quiet) {
+		fprintf(stderr, "%s: option -p ignored, no thread support\n",
+			progname);
+	    }
+	    processes = 1;
+#endif
+	    break;
 	case 'q':
 	    quiet = 1; verbose = 0; break;
 	case 'r':
@@ -3314,6 +3910,28 @@ int main (argc, argv)
 #endif
 	case 'R':
 	    rsync = 1; break;
+	case 'Y':
+	    mmap_io = 1; break;
+	case 'G':
+	    fast_greedy = 1; break;
+	case 'I':
+	    index_span = (off_t)(optarg ? atoi(optarg) : INDEX_SPAN) << 20;
+	    if (index_span <= 0) {
+		fprintf(stderr, "%s: invalid --index span %s\n",
+			progname, optarg);
+		usage();
+		do_exit(ERROR);
+	    }
+	    decompress = test = to_stdout = 1; break;
+	case 'X':
+	    if (range_parse(optarg) != OK) {
+		fprintf(stderr, "%s: invalid --range %s\n", progname, optarg);
+		usage();
+		do_exit(ERROR);
+	    }
+	    decompress = to_stdout = 1; break;
+	case 'B':
+	    bench = 1; break;
 
 	case 'S':
 #ifdef NO_MULTIPLE_DOTS
@@ -3389,6 +4007,19 @@ int main (argc, argv)
     ALLOC(ush, tab_prefix1, 1L<<(BITS-1));
 #endif
 
+    if (bench) {
+	if (file_count == 0) bench_file("-");
+	while (optind < argc) bench_file(argv[optind++]);
+	do_exit(exit_code);
+    }
+
+#if !defined(NO_THREADS) && ! NO_DIR
+    /* With -r, compress several files at a time */
+    if (recursive && processes > 1 && !decompress && !to_stdout && !list) {
+	rp_start();
+    }
+#endif
+
     /* And get to work */
     if (file_count != 0) {
 	if (to_stdout && !test && !list && (!decompress || !ascii)) {
@@ -3400,6 +4031,9 @@ int main (argc, argv)
     } else {  /* Standard input */
 	treat_stdin();
     }
+#if !defined(NO_THREADS) && ! NO_DIR
+    if (rp_threads) rp_finish();
+#endif
     if (list && !quiet && file_count > 1) {
 	do_list(-1, -1); /* print totals */
     }
@@ -3496,16 +4130,23 @@ local void treat_stdin()
 
     /* Actually do the compression/decompression. Loop over zipped members.
      */
+    map_input(ifd);
     for (;;) {
-	if ((*work)(fileno(stdin), fileno(stdout)) != OK) return;
+	if ((*work)(fileno(stdin), fileno(stdout)) != OK) {
+	    method = -1;
+	    break;
+	}
 
 	if (input_eof ())
 	  break;
 
 	method = get_method(ifd);
-	if (method < 0) return; /* error message already emitted */
+	if (method < 0) break;    /* error message already emitted */
 	bytes_out = 0;            /* required for length check */
     }
+    unmap_input();
+    flush_bulk();
+    if (method < 0) return;
 
     if (verbose) {
 	if (test) {
@@ -3549,6 +4190,11 @@ local void treat_file(iname)
 	    treat_dir(iname);
 	    /* Warning: ifname is now garbage */
 #  ifndef NO_UTIME
+#    ifndef NO_THREADS
+	    if (rp_threads) {
+		rp_defer(iname, &st); /* the files may not be done yet */
+	    } else
+#    endif
 	    reset_times (iname, &st);
 #  endif
 	} else
@@ -3562,6 +4208,12 @@ local void treat_file(iname)
 	      progname, ifname));
 	return;
     }
+#if !defined(NO_THREADS) && ! NO_DIR
+    if (rp_threads && !rp_worker) {
+	rp_add(iname); /* compressed by a thread of the pool */
+	return;
+    }
+#endif
     if (istat.st_nlink > 1 && !to_stdout && !force) {
 	WARN((stderr, "%s: %s has %lu other link%c -- unchanged\n",
 	      progname, ifname, (unsigned long) istat.st_nlink - 1,
@@ -3626,12 +4278,14 @@ local void treat_file(iname)
     /* Keep the name even if not truncated except with --no-name: */
     if (!save_orig_name) save_orig_name = !no_name;
 
-    if (verbose) {
+    if (verbose && !rp_worker) {
 	fprintf(stderr, "%s:\t", ifname);
     }
 
     /* Actually do the compression/decompression. Loop over zipped members.
      */
+    map_input(ifd);
+    if (index_span) index_open();
     for (;;) {
 	if ((*work)(ifd, ofd) != OK) {
 	    method = -1; /* force cleanup */
@@ -3645,6 +4299,9 @@ local void treat_file(iname)
 	if (method < 0) break;    /* error message already emitted */
 	bytes_out = 0;            /* required for length check */
     }
+    unmap_input();
+    flush_bulk();
+    if (index_span) index_close(method != -1);
 
     close(ifd);
     if (!to_stdout) {
@@ -3659,6 +4316,12 @@ local void treat_file(iname)
     }
     /* Display statistics */
     if(verbose) {
+#ifndef NO_THREADS
+	if (rp_worker) {
+	    flockfile(stderr); /* keep the line together */
+	    fprintf(stderr, "%s:\t", ifname);
+	}
+#endif
 	if (test) {
 	    fprintf(stderr, " OK");
 	} else if (decompress) {
@@ -3670,6 +4333,9 @@ local void treat_file(iname)
 	    fprintf(stderr, " -- replaced with %s", ofname);
 	}
 	fprintf(stderr, "\n");
+#ifndef NO_THREADS
+	if (rp_worker) funlockfile(stderr);
+#endif
     }
 }
 
@@ -3767,7 +4433,7 @@ local char *get_suffix(name)
 {
     int nlen, slen;
     char suffix[MAX_SUFFIX+3]; /* last chars of name, forced to lower case */
-    static char *known_suffixes[] =
+    static TLS char *known_suffixes[] =
        {NULL, ".gz", ".z", ".taz", ".tgz", "-gz", "-z", "_z",
 #ifdef MAX_EXT_CHARS
           "z",
@@ -3818,7 +4484,7 @@ local int get_istat(iname, sbuf)
 {
     int ilen;  /* strlen(ifname) */
     int z_suffix_errno = 0;
-    static char *suffixes[] = {NULL, ".gz", ".z", "-z", ".Z", NULL};
+    static TLS char *suffixes[] = {NULL, ".gz", ".z", "-z", ".Z", NULL};
     char **suf = suffixes;
     char *s;
 #ifdef NO_MULTIPLE_DOTS
@@ -4591,6 +5257,162 @@ local void treat_dir(dir)
 }
 #endif /* ! NO_DIR */
 
+#if !defined(NO_THREADS) && ! NO_DIR
+/* ========================================================================
+ * Pool of threads for -r -p n. The main thread walks the directories and
+ * queues the regular files, which are compressed by rp_threads threads at
+ * a time. The compression state and the buffers are thread local, so
+ * each thread simply runs treat_file(). Directories get their time stamps
+ * back once all the files are done.
+ */
+typedef struct rp_name {
+    struct rp_name *next;
+    struct stat st;           /* time stamps of a directory */
+    char name[1];             /* allocated to the length of the name */
+} rp_name;
+
+local rp_name *rp_head = NULL;     /* files to compress, in order */
+local rp_name **rp_tail = &rp_head;
+local rp_name *rp_dirs = NULL;     /* directories to reset, last first */
+local int rp_quit;                 /* set when all files are queued */
+local pthread_t *rp_tid;           /* the threads */
+local char **rp_ofname;            /* ofname of each thread, for do_remove */
+local int **rp_remove;             /* remove_ofname of each thread */
+local pthread_mutex_t rp_lock = PTHREAD_MUTEX_INITIALIZER;
+local pthread_cond_t rp_work = PTHREAD_COND_INITIALIZER; /* file queued */
+
+local rp_name *rp_alloc OF((char *name));
+
+/* ========================================================================
+ * Allocate a queue entry for the given name.
+ */
+local rp_name *rp_alloc(name)
+    char *name;
+{
+    rp_name *p = (rp_name*)xmalloc(sizeof(rp_name) + strlen(name));
+
+    strcpy(p->name, name);
+    p->next = NULL;
+    return p;
+}
+
+/* ========================================================================
+ * Start the threads. From now on processes is 1: each file is compressed
+ * by a single thread.
+ */
+local void rp_start()
+{
+    sigset_t oset;          /* signals are handled by the main thread */
+    int i;
+
+    rp_threads = processes;
+    processes = 1;
+    rp_quit = 0;
+    rp_tid = (pthread_t*)xmalloc(rp_threads*sizeof(pthread_t));
+    rp_ofname = (char**)xmalloc(rp_threads*sizeof(char*));
+    rp_remove = (int**)xmalloc(rp_threads*sizeof(int*));
+    for (i = 0; i < rp_threads; i++) {
+	rp_ofname[i] = NULL;
+    }
+    block_signals(&oset);
+    for (i = 0; i < rp_threads; i++) {
+	if (pthread_create(&rp_tid[i], NULL, rp_main, (void*)(long)i) != 0) {
+	    error("cannot create thread");
+	}
+    }
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+}
+
+/* ========================================================================
+ * Queue a file to compress.
+ */
+local void rp_add(name)
+    char *name;
+{
+    rp_name *p = rp_alloc(name);
+
+    pthread_mutex_lock(&rp_lock);
+    *rp_tail = p;
+    rp_tail = &p->next;
+    pthread_cond_signal(&rp_work);
+    pthread_mutex_unlock(&rp_lock);
+}
+
+/* ========================================================================
+ * Remember to reset the time stamps of dir when the pool is done.
+ */
+local void rp_defer(dir, sbuf)
+    char *dir;
+    struct stat *sbuf;
+{
+    rp_name *p = rp_alloc(dir);
+
+    p->st = *sbuf;
+    p->next = rp_dirs;
+    rp_dirs = p;
+}
+
+/* ========================================================================
+ * Thread of the pool: compress the queued files until told to quit.
+ */
+local void *rp_main(arg)
+    void *arg;
+{
+    rp_name *p;
+    int i = (int)(long)arg;
+
+    rp_worker = 1;
+    rp_remove[i] = &remove_ofname;
+    rp_ofname[i] = ofname;
+
+    for (;;) {
+	pthread_mutex_lock(&rp_lock);
+	while (rp_head == NULL && !rp_quit) {
+	    pthread_cond_wait(&rp_work, &rp_lock);
+	}
+	p = rp_head;
+	if (p != NULL && (rp_head = p->next) == NULL) rp_tail = &rp_head;
+	pthread_mutex_unlock(&rp_lock);
+	if (p == NULL) break;
+
+	treat_file(p->name);
+	free((char*)p);
+    }
+    return arg;
+}
+
+/* ========================================================================
+ * Wait until all the queued files are compressed, then reset the time
+ * stamps of the directories, innermost first.
+ */
+local void rp_finish()
+{
+    rp_name *p;
+    int i;
+
+    pthread_mutex_lock(&rp_lock);
+    rp_quit = 1;
+    pthread_cond_broadcast(&rp_work);
+    pthread_mutex_unlock(&rp_lock);
+    for (i = 0; i < rp_threads; i++) {
+	pthread_join(rp_tid[i], NULL);
+    }
+    processes = rp_threads;
+    rp_threads = 0;
+    free((char*)rp_tid);
+    free((char*)rp_ofname);
+    free((char*)rp_remove);
+
+    while ((p = rp_dirs) != NULL) {
+	rp_dirs = p->next;
+#ifndef NO_UTIME
+	reset_times(p->name, &p->st);
+#endif
+	free((char*)p);
+    }
+}
+#endif /* !NO_THREADS && !NO_DIR */
+
 /* ========================================================================
  * Free all dynamically allocated variables and exit with the given code.
  */
@@ -4601,6 +5423,7 @@ local void do_exit(exitcode)
 
     if (in_exit) exit(exitcode);
     in_exit = 1;
+    flush_bulk(); /* output gathered with --mmap */
     if (env != NULL)  free(env),  env  = NULL;
     if (args != NULL) free((char*)args), args = NULL;
     FREE(inbuf);
@@ -4625,6 +5448,14 @@ local void do_remove() {
        close(ofd);
        xunlink (ofname);
    }
+#if !defined(NO_THREADS) && ! NO_DIR
+   if (rp_threads) {
+       int i;
+       for (i = 0; i < rp_threads; i++) {
+	   if (rp_ofname[i] != NULL && *rp_remove[i]) xunlink(rp_ofname[i]);
+       }
+   }
+#endif
 }
 
 /* ========================================================================
@@ -4632,6 +5463,7 @@ local void do_remove() {
  */
 RETSIGTYPE abort_gzip()
 {
+	flush_bulk(); /* before do_remove closes the output */
 	do_remove();
 	do_exit(ERROR);
 }
@@ -4789,12 +5621,47 @@ struct huft {
 int huft_build OF((unsigned *, unsigned, unsigned, ush *, ush *,
                    struct huft **, int *));
 int huft_free OF((struct huft *));
+void huft_free_live OF((void));
 int inflate_codes OF((struct huft *, struct huft *, int, int));
 int inflate_stored OF((void));
 int inflate_fixed OF((void));
 int inflate_dynamic OF((void));
 int inflate_block OF((int *));
 int inflate OF((void));
+int inflate_more OF((void));
+
+/* The fast decoder needs a 64-bit bit buffer (see inflate_fast) */
+#if ULONG_MAX <= 0xffffffffUL || defined(CRYPT)
+#  ifndef NO_FAST_INFLATE
+#    define NO_FAST_INFLATE
+#  endif
+#endif
+
+#ifndef NO_FAST_INFLATE
+/* Flat decoding table entry, see fast_build. The first level table is
+   indexed by FAST_LBITS or FAST_DBITS bits; the longer codes go through a
+   single second level table. */
+typedef struct fcode {
+  uch op;               /* operation, see below */
+  uch bits;             /* bits used by this entry */
+  ush val;              /* literal, base value, or offset of sub-table */
+} fcode;
+
+#define FC_LIT  0x00    /* literal byte */
+#define FC_BASE 0x10    /* length or distance base, low 4 bits: extra bits */
+#define FC_EOB  0x20    /* end of block */
+#define FC_LINK 0x40    /* sub-table, low 4 bits: bits to index it */
+#define FC_BAD  0x80    /* invalid code */
+
+#define FAST_LBITS 10   /* bits in first level literal/length table */
+#define FAST_DBITS 8    /* bits in first level distance table */
+#define FAST_LSIZE 3072 /* room for the literal/length tables */
+#define FAST_DSIZE 1024 /* room for the distance tables */
+
+int fast_build OF((unsigned *, unsigned, unsigned, ush *, ush *,
+                   fcode *, int, unsigned));
+int inflate_fast OF((fcode *, fcode *));
+#endif /* NO_FAST_INFLATE */
 
 
 /* The inflate algorithm uses a sliding 32K byte window on the uncompressed
@@ -4861,8 +5728,8 @@ static ush cpdext[] = {         /* Extra bits for distance codes */
    the stream.
  */
 
-ulg bb;                         /* bit buffer */
-unsigned bk;                    /* bits in bit buffer */
+TLS ulg bb;                     /* bit buffer */
+TLS unsigned bk;                /* bits in bit buffer */
 
 ush mask_bits[] = {
     0x0000,
@@ -4925,7 +5792,13 @@ int dbits = 6;          /* bits in base distance lookup table */
 #define N_MAX 288       /* maximum number of codes in any set */
 
 
-unsigned hufts;         /* track memory usage */
+TLS unsigned hufts;     /* track memory usage */
+
+/* The tables built by huft_build and not freed yet, so that they can be
+   freed when a block is abandoned (see gz_ctx_uncompress). There are at
+   most three at a time. */
+#define HUFT_LIVE 4
+TLS struct huft *huft_live[HUFT_LIVE];
 
 
 int huft_build(b, n, s, d, e, t, m)
@@ -4961,6 +5834,7 @@ int *m;                 /* maximum lookup bits, returns actual */
   unsigned *xp;                 /* pointer into x */
   int y;                        /* number of dummy codes added */
   unsigned z;                   /* number of entries in current table */
+  struct huft **root = t;       /* result, t is then used for the links */
 
 
   /* Generate counts for each bit length */
@@ -5122,8 +5996,17 @@ int *m;                 /* maximum lookup bits, returns actual */
   }
 
 
-  /* Return true (1) if we were given an incomplete table */
-  return y != 0 && g != 1;
+  /* Remember the tables until huft_free() */
+  for (j = 0; j < HUFT_LIVE; j++)
+    if (huft_live[j] == (struct huft *)NULL)
+    {
+      huft_live[j] = *root;
+      break;
+    }
+
+
+  /* Return true (1) if we were given an incomplete table */
+  return y != 0 && g != 1;
 }
 
 
@@ -5135,7 +6018,12 @@ struct huft *t;         /* table to free */
    each table. */
 {
   register struct huft *p, *q;
+  int i;
+
 
+  for (i = 0; i < HUFT_LIVE; i++)
+    if (huft_live[i] == t)
+      huft_live[i] = (struct huft *)NULL;
 
   /* Go through linked list, freeing from the malloced (t[-1]) address. */
   p = t;
@@ -5149,6 +6037,125 @@ struct huft *t;         /* table to free */
 }
 
 
+
+void huft_free_live()
+/* Free the tables of an abandoned block. */
+{
+  int i;
+
+  for (i = 0; i < HUFT_LIVE; i++)
+    if (huft_live[i] != (struct huft *)NULL)
+      huft_free(huft_live[i]);
+}
+
+
+#ifndef NO_FAST_INFLATE
+TLS fcode fast_ltab[FAST_LSIZE];  /* flat literal/length table */
+TLS fcode fast_dtab[FAST_DSIZE];  /* flat distance table */
+
+int fast_build(b, n, s, d, e, t, root, size)
+unsigned *b;            /* code lengths in bits (all assumed <= BMAX) */
+unsigned n;             /* number of codes (assumed <= N_MAX) */
+unsigned s;             /* number of simple-valued codes (0..s-1) */
+ush *d;                 /* list of base values for non-simple codes */
+ush *e;                 /* list of extra bits for non-simple codes */
+fcode *t;               /* result: first level table, then sub-tables */
+int root;               /* bits in first level table */
+unsigned size;          /* number of entries available in t */
+/* Build a flat decoding table for a set of codes already checked by
+   huft_build. Codes of up to root bits are decoded with a single lookup,
+   longer codes with one more lookup in a sub-table sized for the longest
+   code sharing the same first root bits. Entries not covered by any code
+   (incomplete code sets) are marked invalid. Return zero on success, one
+   if the tables do not fit in size entries. */
+{
+  unsigned c[BMAX+1];           /* bit length count table */
+  unsigned next[BMAX+1];        /* next code of each length */
+  uch sub[1 << FAST_LBITS];     /* bits in sub-table of each root entry */
+  unsigned code;                /* current code, bit reversed */
+  unsigned used;                /* entries used in t */
+  unsigned i, j, k, len;
+  fcode r;                      /* table entry for structure assignment */
+  fcode *q;                     /* sub-table */
+
+  /* Generate the first code of each length, as in deflate */
+  memzero(c, sizeof(c));
+  for (i = 0; i < n; i++)
+    c[b[i]]++;
+  c[0] = 0;
+  code = 0;
+  for (len = 1; len <= BMAX; len++)
+    next[len] = code = (code + c[len-1]) << 1;
+
+  /* Size the sub-tables */
+  memzero(sub, 1 << root);
+  for (i = 0; i < n; i++)
+    if ((len = b[i]) > (unsigned)root)
+    {
+      code = bi_reverse(next[len]++, len) & ((1 << root) - 1);
+      if (len - root > sub[code])
+        sub[code] = (uch)(len - root);
+    }
+  used = 1 << root;
+  r.op = FC_BAD;
+  r.bits = 1;
+  r.val = 0;
+  for (i = 0; i < used; i++)
+    t[i] = r;
+  for (i = 0; i < (1U << root); i++)
+    if (sub[i])
+    {
+      k = 1 << sub[i];
+      if (used + k > size)
+        return 1;
+      t[i].op = (uch)(FC_LINK | sub[i]);
+      t[i].bits = (uch)root;
+      t[i].val = (ush)used;
+      r.op = FC_BAD;
+      r.bits = 1;
+      while (k--)
+        t[used++] = r;
+    }
+
+  /* Fill in the entries of each code */
+  code = 0;
+  for (len = 1; len <= BMAX; len++)
+    next[len] = code = (code + c[len-1]) << 1;
+  for (i = 0; i < n; i++)
+  {
+    if ((len = b[i]) == 0)
+      continue;
+    if (i < s)
+    {
+      r.op = (uch)(i < 256 ? FC_LIT : FC_EOB);
+      r.val = (ush)i;
+    }
+    else
+    {
+      r.op = (uch)(e[i - s] == 99 ? FC_BAD : FC_BASE | e[i - s]);
+      r.val = d[i - s];
+    }
+    code = bi_reverse(next[len]++, len);
+    if (len <= (unsigned)root)
+    {
+      r.bits = (uch)len;
+      for (j = code; j < (1U << root); j += 1 << len)
+        t[j] = r;
+    }
+    else
+    {
+      q = t + t[code & ((1 << root) - 1)].val;
+      k = sub[code & ((1 << root) - 1)];
+      r.bits = (uch)(len - root);
+      for (j = code >> root; j < (1U << k); j += 1 << (len - root))
+        q[j] = r;
+    }
+  }
+  return 0;
+}
+#endif /* NO_FAST_INFLATE */
+
+
 int inflate_codes(tl, td, bl, bd)
 struct huft *tl, *td;   /* literal/length and distance decoder tables */
 int bl, bd;             /* number of bits decoded by tl[] and td[] */
@@ -5258,6 +6265,208 @@ int bl, bd;             /* number of bits decoded by tl[] and td[] */
 
 
 
+#ifndef NO_FAST_INFLATE
+/* Refill the bit buffer to at least 56 bits without checking for the end
+   of the input. On little-endian machines, load eight bytes at once: the
+   bits above k are then the following input bits, which the next load
+   ors in again unchanged. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define FASTBITS() {ulg x; memcpy(&x, inbuf + inptr, 8); b |= x << k; \
+                      inptr += (63 - k) >> 3; k |= 56;}
+#else
+#  define FASTBITS() {while(k<56){b|=((ulg)inbuf[inptr++])<<k;k+=8;}}
+#endif
+
+int inflate_fast(lt, dt)
+fcode *lt, *dt;         /* flat literal/length and distance tables */
+/* Same as inflate_codes, with the tables built by fast_build. While at
+   least eight bytes of input and MAX_MATCH bytes of window are left, the
+   bit buffer is refilled once per length/distance pair and matches are
+   copied eight bytes at a time. Near the end of either buffer, codes are
+   decoded one at a time with NEEDBITS as in inflate_codes. */
+{
+  register unsigned e;  /* table entry flag/number of extra bits */
+  unsigned n, d;        /* length and index for copy */
+  unsigned w;           /* current window position */
+  fcode *t;             /* pointer to table entry */
+  uch *p, *q;           /* copy destination and source */
+  register ulg b;       /* bit buffer */
+  register unsigned k;  /* number of bits in bit buffer */
+
+
+  /* make local copies of globals */
+  b = bb;                       /* initialize bit buffer */
+  k = bk;
+  w = wp;                       /* initialize window position */
+
+  for (;;)                      /* do until end of block */
+  {
+    if (w <= WSIZE - MAX_MATCH && inptr + 8 <= insize)
+    {
+      do {
+        /* 48 bits at most are needed for a length/distance pair */
+        FASTBITS()
+        t = lt + ((unsigned)b & ((1 << FAST_LBITS) - 1));
+        if (t->op & FC_LINK)
+        {
+          e = t->op & 15;
+          DUMPBITS(t->bits)
+          t = lt + t->val + ((unsigned)b & mask_bits[e]);
+        }
+        DUMPBITS(t->bits)
+        if ((e = t->op) == FC_LIT)
+        {
+          slide[w++] = (uch)t->val;
+          continue;
+        }
+        if (e & (FC_EOB | FC_BAD))
+          goto done;
+        e &= 15;
+        n = t->val + ((unsigned)b & mask_bits[e]);
+        DUMPBITS(e)
+
+        t = dt + ((unsigned)b & ((1 << FAST_DBITS) - 1));
+        if (t->op & FC_LINK)
+        {
+          e = t->op & 15;
+          DUMPBITS(t->bits)
+          t = dt + t->val + ((unsigned)b & mask_bits[e]);
+        }
+        DUMPBITS(t->bits)
+        if ((e = t->op) & FC_BAD)
+          return 1;
+        e &= 15;
+        d = t->val + ((unsigned)b & mask_bits[e]);
+        DUMPBITS(e)
+        Tracevv((stderr,"\\[%d,%d]", d, n));
+
+        /* do the copy, the window has room for n bytes */
+        p = slide + w;
+        q = slide + ((w - d) & (WSIZE-1));
+        w += n;
+        if (q < p || q + n <= slide + WSIZE)
+        {
+          if (d == 1)
+            memset(p, *q, n);
+          else
+          {
+            if (d >= 8 || q >= p)
+              for (; n >= 8; n -= 8, p += 8, q += 8)
+                memcpy(p, q, 8);  /* no overlap within 8 bytes */
+            while (n--)
+              *p++ = *q++;
+          }
+        }
+        else                    /* source wraps around the window */
+          do {
+            *p++ = *q++;
+            if (q == slide + WSIZE)
+              q = slide;
+          } while (--n);
+      } while (w <= WSIZE - MAX_MATCH && inptr + 8 <= insize);
+
+      /* give back the unused bytes so that NEEDBITS can be used */
+      while (k >= 8) {
+        k -= 8;
+        inptr--;
+      }
+      b &= mask_bits[k];
+      if (w == WSIZE)           /* the last copy may have filled it */
+      {
+        flush_output(w);
+        w = 0;
+        continue;
+      }
+    }
+
+    /* near the end of the input or window: decode one code at a time */
+    NEEDBITS(FAST_LBITS)
+    t = lt + ((unsigned)b & ((1 << FAST_LBITS) - 1));
+    if (t->op & FC_LINK)
+    {
+      e = t->op & 15;
+      DUMPBITS(t->bits)
+      NEEDBITS(e)
+      t = lt + t->val + ((unsigned)b & mask_bits[e]);
+    }
+    DUMPBITS(t->bits)
+    if ((e = t->op) == FC_LIT)
+    {
+      slide[w++] = (uch)t->val;
+      Tracevv((stderr, "%c", slide[w-1]));
+      if (w == WSIZE)
+      {
+        flush_output(w);
+        w = 0;
+      }
+      continue;
+    }
+    if (e & FC_BAD)
+      return 1;
+    if (e & FC_EOB)
+      break;
+
+    /* get length of block to copy */
+    e &= 15;
+    NEEDBITS(e)
+    n = t->val + ((unsigned)b & mask_bits[e]);
+    DUMPBITS(e)
+
+    /* decode distance of block to copy */
+    NEEDBITS(FAST_DBITS)
+    t = dt + ((unsigned)b & ((1 << FAST_DBITS) - 1));
+    if (t->op & FC_LINK)
+    {
+      e = t->op & 15;
+      DUMPBITS(t->bits)
+      NEEDBITS(e)
+      t = dt + t->val + ((unsigned)b & mask_bits[e]);
+    }
+    DUMPBITS(t->bits)
+    if ((e = t->op) & FC_BAD)
+      return 1;
+    e &= 15;
+    NEEDBITS(e)
+    d = w - t->val - ((unsigned)b & mask_bits[e]);
+    DUMPBITS(e)
+
+    /* do the copy, as in inflate_codes */
+    do {
+      n -= (e = (e = WSIZE - ((d &= WSIZE-1) > w ? d : w)) > n ? n : e);
+      do {
+        slide[w++] = slide[d++];
+      } while (--e);
+      if (w == WSIZE)
+      {
+        flush_output(w);
+        w = 0;
+      }
+    } while (n);
+  }
+  goto restore;
+
+done:
+  if (t->op & FC_BAD)
+    return 1;
+  while (k >= 8) {              /* give back the unused bytes */
+    k -= 8;
+    inptr--;
+  }
+  b &= mask_bits[k];
+
+restore:
+  /* restore the globals from the locals */
+  wp = w;                       /* restore global window pointer */
+  bb = b;                       /* restore global bit buffer */
+  bk = k;
+
+  /* done */
+  return 0;
+}
+#endif /* NO_FAST_INFLATE */
+
+
+
 int inflate_stored()
 /* "decompress" an inflated type 0 (stored) block. */
 {
@@ -5322,6 +6531,9 @@ int inflate_fixed()
   int bl;               /* lookup bits for tl */
   int bd;               /* lookup bits for td */
   unsigned l[288];      /* length list for huft_build */
+#ifndef NO_FAST_INFLATE
+  int fast;             /* set if the flat tables could be built */
+#endif
 
 
   /* set up literal table */
@@ -5336,6 +6548,10 @@ int inflate_fixed()
   bl = 7;
   if ((i = huft_build(l, 288, 257, cplens, cplext, &tl, &bl)) != 0)
     return i;
+#ifndef NO_FAST_INFLATE
+  fast = !fast_build(l, 288, 257, cplens, cplext, fast_ltab, FAST_LBITS,
+                     FAST_LSIZE);
+#endif
 
 
   /* set up distance table */
@@ -5347,9 +6563,21 @@ int inflate_fixed()
     huft_free(tl);
     return i;
   }
+#ifndef NO_FAST_INFLATE
+  fast = fast && !fast_build(l, 30, 0, cpdist, cpdext, fast_dtab, FAST_DBITS,
+                             FAST_DSIZE);
+#endif
 
 
   /* decompress until an end-of-block code */
+#ifndef NO_FAST_INFLATE
+  if (fast)
+  {
+    if (inflate_fast(fast_ltab, fast_dtab))
+      return 1;
+  }
+  else
+#endif
   if (inflate_codes(tl, td, bl, bd))
     return 1;
 
@@ -5378,6 +6606,9 @@ int inflate_dynamic()
   unsigned nb;          /* number of bit length codes */
   unsigned nl;          /* number of literal/length codes */
   unsigned nd;          /* number of distance codes */
+#ifndef NO_FAST_INFLATE
+  int fast;             /* set if the flat tables could be built */
+#endif
 #ifdef PKZIP_BUG_WORKAROUND
   unsigned ll[288+32];  /* literal/length and distance code lengths */
 #else
@@ -5517,7 +6748,24 @@ int inflate_dynamic()
   }
 
 
+#ifndef NO_FAST_INFLATE
+  fast = td != NULL &&
+         !fast_build(ll, nl, 257, cplens, cplext, fast_ltab, FAST_LBITS,
+                     FAST_LSIZE) &&
+         !fast_build(ll + nl, nd, 0, cpdist, cpdext, fast_dtab, FAST_DBITS,
+                     FAST_DSIZE);
+#endif
+
+
   /* decompress until an end-of-block code */
+#ifndef NO_FAST_INFLATE
+  if (fast)
+  {
+    if (inflate_fast(fast_ltab, fast_dtab))
+      return 1;
+  }
+  else
+#endif
   if (inflate_codes(tl, td, bl, bd))
     return 1;
 
@@ -5581,26 +6829,36 @@ int *e;                 /* last block flag */
 int inflate()
 /* decompress an inflated entry */
 {
-  int e;                /* last block flag */
-  int r;                /* result code */
-  unsigned h;           /* maximum struct huft's malloc'ed */
-
-
   /* initialize window, bit buffer */
   wp = 0;
   bk = 0;
   bb = 0;
 
+  return inflate_more();
+}
+
+
+
+int inflate_more()
+/* decompress the rest of an inflated entry, starting at a block boundary
+   with the window and bit buffer already set up (see range_inflate) */
+{
+  int e;                /* last block flag */
+  int r;                /* result code */
+  unsigned h;           /* maximum struct huft's malloc'ed */
 
-  /* decompress until the last block */
+
+  /* decompress until the last block, or the end of a --range */
   h = 0;
   do {
+    if (index_fd != -1 && stream_pos + wp >= index_next)
+      index_point();
     hufts = 0;
     if ((r = inflate_block(&e)) != 0)
       return r;
     if (hufts > h)
       h = hufts;
-  } while (!e);
+  } while (!e && !range_done);
 
   /* Undo too much lookahead. The next read will be byte aligned so we
    * can discard unused bits in the last meaningful byte.
@@ -5666,6 +6924,16 @@ int lzw(in, out)
  *      the UNZIP process, as described in the "application note"
  *      (APPNOTE.TXT) distributed as part of PKWARE's PKZIP program.
  *
+ *      A block normally ends when the match buffers are full. To follow
+ *      changes in the data, such as text and binary files in a tar file,
+ *      ct_tally also checks every SPLIT_SEG symbols whether the symbols
+ *      since the last check would be better coded in a block of their
+ *      own: if the entropy of the frequency counts of the block, taken as
+ *      a whole, exceeds the sum of the entropies of its two parts by more
+ *      than SPLIT_BITS bits, the block is split. flush_block then outputs
+ *      only the symbols before the last check and keeps the others for
+ *      the next block.
+ *
  *  REFERENCES
  *
  *      Lynch, Thomas J.
@@ -5759,6 +7027,14 @@ local int near extra_blbits[BL_CODES]/* extra bits for each bit length code */
 #ifndef DIST_BUFSIZE
 #  define DIST_BUFSIZE  LIT_BUFSIZE
 #endif
+#ifndef SPLIT_SEG
+#  define SPLIT_SEG  0x800
+#endif
+/* Symbols between two checks of the block splitter, a power of 2 >= 8 */
+#ifndef SPLIT_BITS
+#  define SPLIT_BITS  1024
+#endif
+/* Minimum estimated saving, in bits, for splitting a block */
 /* Sizes of match buffers for literals/lengths and distances.  There are
  * 4 reasons for limiting LIT_BUFSIZE to 64K:
  *   - frequencies can be kept in 16 bit counters
@@ -5816,8 +7092,8 @@ typedef struct ct_data {
 #define HEAP_SIZE (2*L_CODES+1)
 /* maximum heap size */
 
-local ct_data near dyn_ltree[HEAP_SIZE];   /* literal and length tree */
-local ct_data near dyn_dtree[2*D_CODES+1]; /* distance tree */
+local TLS ct_data near dyn_ltree[HEAP_SIZE];   /* literal and length tree */
+local TLS ct_data near dyn_dtree[2*D_CODES+1]; /* distance tree */
 
 local ct_data near static_ltree[L_CODES+2];
 /* The static literal tree. Since the bit lengths are imposed, there is no
@@ -5831,7 +7107,7 @@ local ct_data near static_dtree[D_CODES];
  * 5 bits.)
  */
 
-local ct_data near bl_tree[2*BL_CODES+1];
+local TLS ct_data near bl_tree[2*BL_CODES+1];
 /* Huffman tree for the bit lengths */
 
 typedef struct tree_desc {
@@ -5844,17 +7120,20 @@ typedef struct tree_desc {
     int     max_code;            /* largest code with non zero frequency */
 } tree_desc;
 
-local tree_desc near l_desc =
-{dyn_ltree, static_ltree, extra_lbits, LITERALS+1, L_CODES, MAX_BITS, 0};
+local TLS tree_desc near l_desc =
+{NULL, static_ltree, extra_lbits, LITERALS+1, L_CODES, MAX_BITS, 0};
 
-local tree_desc near d_desc =
-{dyn_dtree, static_dtree, extra_dbits, 0,          D_CODES, MAX_BITS, 0};
+local TLS tree_desc near d_desc =
+{NULL, static_dtree, extra_dbits, 0,          D_CODES, MAX_BITS, 0};
 
-local tree_desc near bl_desc =
-{bl_tree, (ct_data near *)0, extra_blbits, 0,      BL_CODES, MAX_BL_BITS, 0};
+local TLS tree_desc near bl_desc =
+{NULL, (ct_data near *)0, extra_blbits, 0,      BL_CODES, MAX_BL_BITS, 0};
+/* The dynamic trees are thread local, so their addresses are only known at
+ * run time: dyn_tree is set by ct_init.
+ */
 
 
-local ush near bl_count[MAX_BITS+1];
+local TLS ush near bl_count[MAX_BITS+1];
 /* number of codes at each bit length for an optimal tree */
 
 local uch near bl_order[BL_CODES]
@@ -5863,14 +7142,14 @@ local uch near bl_order[BL_CODES]
  * probability, to avoid transmitting the lengths for unused bit length codes.
  */
 
-local int near heap[2*L_CODES+1]; /* heap used to build the Huffman trees */
-local int heap_len;               /* number of elements in the heap */
-local int heap_max;               /* element of largest frequency */
+local TLS int near heap[2*L_CODES+1]; /* heap used to build the Huffman trees */
+local TLS int heap_len;               /* number of elements in the heap */
+local TLS int heap_max;               /* element of largest frequency */
 /* The sons of heap[n] are heap[2*n] and heap[2*n+1]. heap[0] is not used.
  * The same heap array is used to build all trees.
  */
 
-local uch near depth[2*L_CODES+1];
+local TLS uch near depth[2*L_CODES+1];
 /* Depth of each subtree used as tie breaker for trees of equal frequency */
 
 local uch length_code[MAX_MATCH-MIN_MATCH+1];
@@ -5893,38 +7172,51 @@ local int near base_dist[D_CODES];
 
 /* DECLARE(ush, d_buf, DIST_BUFSIZE); buffer for distances */
 
-local uch near flag_buf[(LIT_BUFSIZE/8)];
+local TLS uch near flag_buf[(LIT_BUFSIZE/8)];
 /* flag_buf is a bit array distinguishing literals from lengths in
  * l_buf, thus indicating the presence or absence of a distance.
  */
 
-local unsigned last_lit;    /* running index in l_buf */
-local unsigned last_dist;   /* running index in d_buf */
-local unsigned last_flags;  /* running index in flag_buf */
-local uch flags;            /* current flags not yet saved in flag_buf */
-local uch flag_bit;         /* current bit used in flags */
+local TLS unsigned last_lit;    /* running index in l_buf */
+local TLS unsigned last_dist;   /* running index in d_buf */
+local TLS unsigned last_flags;  /* running index in flag_buf */
+local TLS uch flags;            /* current flags not yet saved in flag_buf */
+local TLS uch flag_bit;         /* current bit used in flags */
 /* bits are filled in flags starting at bit 0 (least significant).
  * Note: these flags are overkill in the current code since we don't
  * take advantage of DIST_BUFSIZE == LIT_BUFSIZE.
  */
 
-local ulg opt_len;        /* bit length of current block with optimal trees */
-local ulg static_len;     /* bit length of current block with static trees */
+local TLS ulg opt_len;        /* bit length of current block with optimal trees */
+local TLS ulg static_len;     /* bit length of current block with static trees */
 
-local off_t compressed_len; /* total bit length of compressed file */
+local TLS off_t compressed_len; /* total bit length of compressed file */
 
-local off_t input_len;      /* total byte length of input file */
+local TLS off_t input_len;      /* total byte length of input file */
 /* input_len is for debugging only since we can get it by other means. */
 
-ush *file_type;        /* pointer to UNKNOWN, BINARY or ASCII */
-int *file_method;      /* pointer to DEFLATE or STORE */
+local TLS ush split_lfreq[L_CODES]; /* dyn_ltree frequencies at split_lit */
+local TLS ush split_dfreq[D_CODES]; /* dyn_dtree frequencies at split_lit */
+local TLS unsigned split_lit;   /* last_lit at the last check, 0 if none */
+local TLS unsigned split_dist;  /* last_dist at the last check */
+local TLS unsigned split_flags; /* last_flags at the last check */
+local TLS ulg split_len;        /* input bytes of the block at split_lit */
+local TLS ulg tally_len;        /* input bytes of the block */
+local TLS int split_now;        /* end the block at split_lit */
+TLS ulg block_carry;   /* input bytes kept for the next block by flush_block */
+
+local ush log2_tab[256];
+/* log2(1 + i/256) in units of 1/256 bit, for the block splitter */
+
+TLS ush *file_type;        /* pointer to UNKNOWN, BINARY or ASCII */
+TLS int *file_method;      /* pointer to DEFLATE or STORE */
 
 #ifdef DEBUG
-extern off_t bits_sent;  /* bit length of the compressed data */
+extern TLS off_t bits_sent;  /* bit length of the compressed data */
 #endif
 
-extern long block_start;       /* window offset of current block */
-extern unsigned near strstart; /* window offset of current string */
+extern TLS long block_start;       /* window offset of current block */
+extern TLS unsigned near strstart; /* window offset of current string */
 
 /* ===========================================================================
  * Local (static) routines in this file.
@@ -5941,10 +7233,13 @@ local int  build_bl_tree  OF((void));
 local void send_all_trees OF((int lcodes, int dcodes, int blcodes));
 local void compress_block OF((ct_data near *ltree, ct_data near *dtree));
 local void set_file_type  OF((void));
+local ulg  xlog2          OF((unsigned x));
+local long split_gain     OF((ct_data near *tree, ush *freq, int n));
+local void split_mark     OF((void));
 
 
 #ifndef DEBUG
-#  define send_code(c, tree) send_bits(tree[c].Code, tree[c].Len)
+#  define send_code(c, tree) SEND_BITS(tree[c].Code, tree[c].Len)
    /* Send a code of the given tree. c and tree must not have side effects */
 
 #else /* DEBUG */
@@ -5981,8 +7276,14 @@ void ct_init(attr, methodp)
     file_type = attr;
     file_method = methodp;
     compressed_len = input_len = 0L;
+    l_desc.dyn_tree = dyn_ltree;
+    d_desc.dyn_tree = dyn_dtree;
+    bl_desc.dyn_tree = bl_tree;
         
-    if (static_dtree[0].Len != 0) return; /* ct_init already called */
+    if (static_dtree[0].Len != 0) { /* ct_init already called */
+        init_block();
+        return;
+    }
 
     /* Initialize the mapping length (0..255) -> length code (0..28) */
     length = 0;
@@ -6017,6 +7318,17 @@ void ct_init(attr, methodp)
     }
     Assert (dist == 256, "ct_init: 256+dist != 512");
 
+    /* Compute log2_tab by repeated squaring of 1 + n/256 */
+    for (n = 0; n < 256; n++) {
+        ulg x = (ulg)(256 + n) << 6; /* 1 + n/256 with 14 fraction bits */
+        for (bits = 0, code = 0; bits < 8; bits++) {
+            x = (x * x) >> 14;
+            code <<= 1;
+            if (x >= 0x8000L) x >>= 1, code |= 1;
+        }
+        log2_tab[n] = (ush)code;
+    }
+
     /* Construct the codes of the static literal tree */
     for (bits = 0; bits <= MAX_BITS; bits++) bl_count[bits] = 0;
     n = 0;
@@ -6056,6 +7368,8 @@ local void init_block()
     opt_len = static_len = 0L;
     last_lit = last_dist = last_flags = 0;
     flags = 0; flag_bit = 1;
+    split_lit = 0; split_now = 0;
+    tally_len = 0L;
 }
 
 #define SMALLEST 1
@@ -6494,13 +7808,43 @@ off_t flush_block(buf, stored_len, pad, eof)
 {
     ulg opt_lenb, static_lenb; /* opt_len and static_len in bytes */
     int max_blindex;  /* index of last bit length code of non zero freq */
-
-    flag_buf[last_flags] = flags; /* Save the flags for the last 8 items */
+    int split = split_now && !eof; /* output only the symbols before split_lit */
+    unsigned n_lit = 0, n_dist = 0, n_flags = 0; /* symbols kept if split */
+    unsigned s_lit = split_lit, s_dist = split_dist, s_flags = split_flags;
+    int n;
+    BENCH_VAR(t0)
+
+    if (eof && !final_block) {
+        eof = 0, pad = 1; /* more compressed data will be appended */
+    }
+    block_carry = 0L;
+    if (split) {
+        /* Leave the frequencies of the second part in split_[ld]freq */
+        for (n = 0; n < L_CODES; n++) {
+            ush f = dyn_ltree[n].Freq;
+            dyn_ltree[n].Freq = split_lfreq[n];
+            split_lfreq[n] = f - split_lfreq[n];
+        }
+        for (n = 0; n < D_CODES; n++) {
+            ush f = dyn_dtree[n].Freq;
+            dyn_dtree[n].Freq = split_dfreq[n];
+            split_dfreq[n] = f - split_dfreq[n];
+        }
+        Assert (stored_len == tally_len, "bad block length");
+        block_carry = tally_len - split_len;
+        stored_len = split_len;
+        n_lit = last_lit - s_lit, last_lit = s_lit;
+        n_dist = last_dist - s_dist, last_dist = s_dist;
+        n_flags = last_flags - s_flags, last_flags = s_flags;
+    } else {
+        flag_buf[last_flags] = flags; /* Save the flags for the last 8 items */
+    }
 
      /* Check if the file is ascii or binary */
     if (*file_type == (ush)UNKNOWN) set_file_type();
 
     /* Construct the literal and distance trees */
+    BENCH_START(t0);
     build_tree_1((tree_desc near *)(&l_desc));
     Tracev((stderr, "\nlit data: dyn %lu, stat %lu", opt_len, static_len));
 
@@ -6514,6 +7858,8 @@ off_t flush_block(buf, stored_len, pad, eof)
      * in bl_order of the last bit length code to send.
      */
     max_blindex = build_bl_tree();
+    BENCH_STOP(BP_TREES, t0);
+    BENCH_START(t0);
 
     /* Determine the best encoding. Compute first the block length in bytes */
     opt_lenb = (opt_len+3+7)>>3;
@@ -6531,7 +7877,7 @@ off_t flush_block(buf, stored_len, pad, eof)
      * the whole file is transformed into a stored file:
      */
 #ifdef FORCE_METHOD
-    if (level == 1 && eof && compressed_len == 0L) { /* force stored file */
+    if (compr_level == 1 && eof && compressed_len == 0L) { /* force stored */
 #else
     if (stored_len <= opt_lenb && eof && compressed_len == 0L && seekable()) {
 #endif
@@ -6543,7 +7889,7 @@ off_t flush_block(buf, stored_len, pad, eof)
         *file_method = STORED;
 
 #ifdef FORCE_METHOD
-    } else if (level == 2 && buf != (char*)0) { /* force stored block */
+    } else if (compr_level == 2 && buf != (char*)0) { /* force stored block */
 #else
     } else if (stored_len+4 <= opt_lenb && buf != (char*)0) {
                        /* 4: two words for the lengths */
@@ -6561,7 +7907,7 @@ off_t flush_block(buf, stored_len, pad, eof)
         copy_block(buf, (unsigned)stored_len, 1); /* with header */
 
 #ifdef FORCE_METHOD
-    } else if (level == 3) { /* force static trees */
+    } else if (compr_level == 3) { /* force static trees */
 #else
     } else if (static_lenb == opt_lenb) {
 #endif
@@ -6574,9 +7920,24 @@ off_t flush_block(buf, stored_len, pad, eof)
         compress_block((ct_data near *)dyn_ltree, (ct_data near *)dyn_dtree);
         compressed_len += 3 + opt_len;
     }
+    BENCH_STOP(BP_SEND, t0);
     Assert (compressed_len == bits_sent, "bad compressed size");
     init_block();
 
+    if (split) {
+        /* Start the next block with the symbols after the split. The
+         * ranges overlap when the kept part is longer than the rest.
+         */
+        memmove((char*)l_buf, (char*)l_buf + s_lit, n_lit);
+        memmove((char*)d_buf, (char*)(d_buf + s_dist), n_dist*sizeof(ush));
+        memmove((char*)flag_buf, (char*)flag_buf + s_flags, n_flags);
+        last_lit = n_lit, last_dist = n_dist, last_flags = n_flags;
+        for (n = 0; n < L_CODES; n++) dyn_ltree[n].Freq += split_lfreq[n];
+        for (n = 0; n < D_CODES; n++) dyn_dtree[n].Freq += split_dfreq[n];
+        tally_len = block_carry;
+        split_mark();
+    }
+
     if (eof) {
         Assert (input_len == bytes_in, "bad input size");
         bi_windup();
@@ -6590,6 +7951,67 @@ off_t flush_block(buf, stored_len, pad, eof)
     return compressed_len >> 3;
 }
 
+/* ===========================================================================
+ * Return x*log2(x) in units of 1/256 bit, for 0 <= x < 64K.
+ */
+local ulg xlog2(x)
+    unsigned x;
+{
+    unsigned k = 0; /* position of the highest bit set in x */
+    unsigned m;     /* the next 8 bits of x */
+
+    if (x <= 1) return 0L;
+    if (x >= 0x100) k = 8;
+    if ((x >> k) >= 0x10) k += 4;
+    if ((x >> k) >= 0x4) k += 2;
+    if ((x >> k) >= 0x2) k += 1;
+    m = (k >= 8 ? x >> (k-8) : x << (8-k)) & 0xff;
+    return (ulg)x * ((k << 8) + log2_tab[m]);
+}
+
+/* ===========================================================================
+ * Return the number of bits, in units of 1/256 bit, saved by coding the
+ * symbols tallied in tree since the last check with a tree of their own
+ * instead of a tree common to the whole block. freq holds the frequencies
+ * at the last check. The cost of n symbols of frequencies f[i] with an
+ * optimal code is n*log2(n) - sum(f[i]*log2(f[i])).
+ */
+local long split_gain(tree, freq, n)
+    ct_data near *tree; /* frequencies of the whole block */
+    ush *freq;          /* frequencies of the first part */
+    int n;              /* number of codes */
+{
+    unsigned all = 0, first = 0; /* number of symbols */
+    long gain = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        unsigned f = tree[i].Freq;
+        if (f == 0) continue;
+        all += f;
+        first += freq[i];
+        gain += (long)xlog2(freq[i]) + (long)xlog2(f - freq[i])
+              - (long)xlog2(f);
+    }
+    return gain + (long)xlog2(all) - (long)xlog2(first)
+                - (long)xlog2(all - first);
+}
+
+/* ===========================================================================
+ * Remember the state of the block at a check of the block splitter.
+ */
+local void split_mark()
+{
+    int n;
+
+    for (n = 0; n < L_CODES; n++) split_lfreq[n] = dyn_ltree[n].Freq;
+    for (n = 0; n < D_CODES; n++) split_dfreq[n] = dyn_dtree[n].Freq;
+    split_lit = last_lit;
+    split_dist = last_dist;
+    split_flags = last_flags;
+    split_len = tally_len;
+}
+
 /* ===========================================================================
  * Save the match info and tally the frequency counts. Return true if
  * the current block must be flushed.
@@ -6598,6 +8020,7 @@ int ct_tally (dist, lc)
     int dist;  /* distance of matched string */
     int lc;    /* match length-MIN_MATCH or unmatched char (if dist==0) */
 {
+    tally_len += dist == 0 ? 1 : lc + MIN_MATCH;
     l_buf[last_lit++] = (uch)lc;
     if (dist == 0) {
         /* lc is the unmatched char */
@@ -6622,8 +8045,20 @@ int ct_tally (dist, lc)
         flag_buf[last_flags++] = flags;
         flags = 0, flag_bit = 1;
     }
+    /* Split the block if the data has changed since the last check. The
+     * splitter is off with --rsyncable, which sets its own block ends.
+     */
+    if ((last_lit & (SPLIT_SEG-1)) == 0 && !compr_rsync) {
+        if (split_lit != 0 &&
+            split_gain(dyn_ltree, split_lfreq, L_CODES) +
+            split_gain(dyn_dtree, split_dfreq, D_CODES) > SPLIT_BITS*256L) {
+            split_now = 1;
+            return 1;
+        }
+        split_mark();
+    }
     /* Try to guess if it is profitable to stop the current block here */
-    if (level > 2 && (last_lit & 0xfff) == 0) {
+    if (compr_level > 2 && (last_lit & 0xfff) == 0) {
         /* Compute an upper bound for the compressed length */
         ulg out_length = (ulg)last_lit*8L;
         ulg in_length = (ulg)strstart-block_start;
@@ -6645,7 +8080,10 @@ int ct_tally (dist, lc)
 }
 
 /* ===========================================================================
- * Send the block data compressed using the given Huffman trees
+ * Send the block data compressed using the given Huffman trees. The codes
+ * are gathered in val and sent together: the literals of a run while they
+ * fit in bi_buf, and the length and distance of a match with their extra
+ * bits (at most 48 bits) if bi_buf is large enough.
  */
 local void compress_block(ltree, dtree)
     ct_data near *ltree; /* literal tree */
@@ -6659,9 +8097,29 @@ local void compress_block(ltree, dtree)
     uch flag = 0;       /* current flags */
     unsigned code;      /* the code to send */
     int extra;          /* number of extra bits to send */
+    ulg val;            /* codes to send */
+    int len;            /* number of bits in val */
+    unsigned n;         /* number of literals in a run */
 
     if (last_lit != 0) do {
-        if ((lx & 7) == 0) flag = flag_buf[fx++];
+        if ((lx & 7) == 0) {
+            flag = flag_buf[fx++];
+            if (flag == 0) {
+                /* A run of up to 8 literals */
+                n = last_lit - lx < 8 ? last_lit - lx : 8;
+                do {
+                    val = 0, len = 0;
+                    do {
+                        lc = l_buf[lx++];
+                        val |= (ulg)ltree[lc].Code << len;
+                        len += ltree[lc].Len;
+                        Tracecv(isgraph(lc), (stderr," '%c' ", lc));
+                    } while (--n != 0 && len <= Buf_size-1 - MAX_BITS);
+                    SEND_BITS(val, len);
+                } while (n != 0);
+                continue;
+            }
+        }
         lc = l_buf[lx++];
         if ((flag & 1) == 0) {
             send_code(lc, ltree); /* send a literal byte */
@@ -6669,23 +8127,32 @@ local void compress_block(ltree, dtree)
         } else {
             /* Here, lc is the match length - MIN_MATCH */
             code = length_code[lc];
-            send_code(code+LITERALS+1, ltree); /* send the length code */
+            val = ltree[code+LITERALS+1].Code;  /* the length code */
+            len = ltree[code+LITERALS+1].Len;
             extra = extra_lbits[code];
             if (extra != 0) {
                 lc -= base_length[code];
-                send_bits(lc, extra);        /* send the extra length bits */
+                val |= (ulg)lc << len;          /* the extra length bits */
+                len += extra;
             }
             dist = d_buf[dx++];
             /* Here, dist is the match distance - 1 */
             code = d_code(dist);
             Assert (code < D_CODES, "bad d_code");
 
-            send_code(code, dtree);       /* send the distance code */
+            if (Buf_size <= 48) {
+                SEND_BITS(val, len);
+                val = 0, len = 0;
+            }
+            val |= (ulg)dtree[code].Code << len; /* the distance code */
+            len += dtree[code].Len;
             extra = extra_dbits[code];
             if (extra != 0) {
                 dist -= base_dist[code];
-                send_bits(dist, extra);   /* send the extra distance bits */
+                val |= (ulg)dist << len;        /* the extra distance bits */
+                len += extra;
             }
+            SEND_BITS(val, len);
         } /* literal or match pair ? */
         flag >>= 1;
     } while (lx < last_lit);
@@ -7353,7 +8820,7 @@ int unlzw(in, out)
 	posbits = 0;
 	
 	if (insize < INBUF_EXTRA) {
-	    if ((rsize = read(in, (char*)inbuf+insize, INBUFSIZ)) == -1) {
+	    if ((rsize = read_input(in, (char*)inbuf+insize, INBUFSIZ)) == -1) {
 		read_error();
 	    }
 	    insize += rsize;
@@ -7811,6 +9278,14 @@ int unzip(in, out)
     ifd = in;
     ofd = out;
 
+#if !defined(NO_THREADS) && !defined(NO_FAST_INFLATE)
+    if (processes > 1 && method == DEFLATED && !pkzip &&
+	index_span == 0 && range_start < 0) {
+	int res = punzip(in, out); /* -1 if it must be done here */
+	if (res >= 0) return res;
+    }
+#endif
+
     updcrc(NULL, 0);           /* initialize crc */
 
     if (pkzip && !ext_header) {  /* crc and length at the end otherwise */
@@ -7821,13 +9296,14 @@ int unzip(in, out)
     /* Decompress */
     if (method == DEFLATED)  {
 
-	int res = inflate();
+	int res = range_start < 0 ? inflate() : range_inflate();
 
 	if (res == 3) {
 	    error("out of memory");
 	} else if (res != 0) {
 	    error("invalid compressed data--format violated");
 	}
+	if (range_done) return OK; /* the rest is not needed */
 
     } else if (pkzip && method == STORED) {
 
@@ -7871,7 +9347,11 @@ int unzip(in, out)
 	orig_len = LG(buf+12);
     }
 
-    /* Validate decompression */
+    /* Validate decompression, unless the data was only partly inflated */
+    if (range_start >= 0) {
+	ext_header = pkzip = 0;
+	return OK;
+    }
     if (orig_crc != updcrc(outbuf, 0)) {
 	fprintf(stderr, "\n%s: %s: invalid compressed data--crc error\n",
 		progname, ifname);
@@ -7931,7 +9411,7 @@ int copy(in, out)
     while (insize != 0 && (int)insize != -1) {
 	write_buf(out, (char*)inbuf, insize);
 	bytes_out += insize;
-	insize = read(in, (char*)inbuf, INBUFSIZ);
+	insize = read_input(in, (char*)inbuf, INBUFSIZ);
     }
     if ((int)insize == -1) {
 	read_error();
@@ -7940,6 +9420,178 @@ int copy(in, out)
     return OK;
 }
 
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_PCLMUL)
+#  define CRC_PCLMUL /* carry-less multiply kernel, selected at run time */
+#  include <cpuid.h>
+#  include <immintrin.h>
+#endif
+
+local ulg crc_bytes  OF((ulg c, uch *s, unsigned n));
+local ulg crc_slice8 OF((ulg c, uch *s, unsigned n));
+#ifdef CRC_PCLMUL
+local ulg crc_fold   OF((ulg c, uch *s, unsigned n));
+#endif
+local ulg gf2_matrix_times  OF((ulg *mat, ulg vec));
+local void gf2_matrix_square OF((ulg *square, ulg *mat));
+
+local ulg crc_tab8[8][256]; /* slicing-by-8 tables, built by crc_init */
+
+/* Kernel updating the crc shift register, best one chosen by crc_init */
+local ulg (*crc_kernel) OF((ulg c, uch *s, unsigned n)) = crc_bytes;
+
+/* ===========================================================================
+ * Build the slicing-by-8 tables and select the fastest crc kernel for this
+ * processor. Must be called before starting any thread.
+ */
+void crc_init()
+{
+    int i, k;
+    ulg c;
+
+    for (i = 0; i < 256; i++) {
+	c = crc_tab8[0][i] = crc_32_tab[i];
+	for (k = 1; k < 8; k++) {
+	    c = crc_32_tab[(int)c & 0xff] ^ (c >> 8);
+	    crc_tab8[k][i] = c;
+	}
+    }
+    crc_kernel = crc_slice8;
+#ifdef CRC_PCLMUL
+    {
+	unsigned eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL)) {
+	    crc_kernel = crc_fold;
+	}
+    }
+#endif
+}
+
+/* ===========================================================================
+ * The crc kernels: run n bytes at s through the crc shift register c
+ * (not inverted) and return the new contents of the register.
+ * crc_bytes is the classic byte at a time loop, used until crc_init is
+ * called.
+ */
+local ulg crc_bytes(c, s, n)
+    register ulg c;
+    register uch *s;
+    register unsigned n;
+{
+    if (n) do {
+	c = crc_32_tab[((int)c ^ (*s++)) & 0xff] ^ (c >> 8);
+    } while (--n);
+    return c;
+}
+
+/* ===========================================================================
+ * Process eight bytes per step with one table per byte position.
+ */
+local ulg crc_slice8(c, s, n)
+    register ulg c;
+    register uch *s;
+    register unsigned n;
+{
+    while (n >= 8) {
+	c ^= (ulg)s[0] | (ulg)s[1] << 8 | (ulg)s[2] << 16 | (ulg)s[3] << 24;
+	c = crc_tab8[7][(int)c & 0xff] ^ crc_tab8[6][(int)(c >> 8) & 0xff] ^
+	    crc_tab8[5][(int)(c >> 16) & 0xff] ^ crc_tab8[4][(int)(c >> 24) & 0xff] ^
+	    crc_tab8[3][s[4]] ^ crc_tab8[2][s[5]] ^
+	    crc_tab8[1][s[6]] ^ crc_tab8[0][s[7]];
+	s += 8;
+	n -= 8;
+    }
+    return crc_bytes(c, s, n);
+}
+
+#ifdef CRC_PCLMUL
+/* ===========================================================================
+ * Fold 64 bytes per step with carry-less multiplications, then reduce the
+ * 128-bit remainder with a Barrett reduction. See "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction", Intel, 2009. The
+ * constants are x^(k) mod P(x), bit reflected, for the gzip polynomial.
+ */
+__attribute__((target("pclmul,sse2")))
+local ulg crc_fold(c, s, n)
+    ulg c;
+    uch *s;
+    unsigned n;
+{
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    __m128i mask;
+
+    if (n < 64) return crc_slice8(c, s, n);
+
+    x1 = _mm_loadu_si128((__m128i*)(s + 0x00));
+    x2 = _mm_loadu_si128((__m128i*)(s + 0x10));
+    x3 = _mm_loadu_si128((__m128i*)(s + 0x20));
+    x4 = _mm_loadu_si128((__m128i*)(s + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    x0 = _mm_set_epi64x(0x1c6e41596LL, 0x154442bd4LL); /* fold by 4 */
+    s += 64;
+    n -= 64;
+
+    while (n >= 64) {
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+	x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+	x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+	x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+			   _mm_loadu_si128((__m128i*)(s + 0x00)));
+	x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+			   _mm_loadu_si128((__m128i*)(s + 0x10)));
+	x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+			   _mm_loadu_si128((__m128i*)(s + 0x20)));
+	x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+			   _mm_loadu_si128((__m128i*)(s + 0x30)));
+	s += 64;
+	n -= 64;
+    }
+
+    /* Fold the four lanes into one, then the remaining 16-byte blocks */
+    x0 = _mm_set_epi64x(0x0ccaa009eLL, 0x1751997d0LL); /* fold by 1 */
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (n >= 16) {
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((__m128i*)s)), x5);
+	s += 16;
+	n -= 16;
+    }
+
+    /* 128 to 64 bits */
+    mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_set_epi64x(0LL, 0x163cd6124LL);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_set_epi64x(0x1f7011641LL, 0x1db710641LL);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), x0, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    c = (ulg)(unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+
+    return crc_slice8(c, s, n);
+}
+#endif /* CRC_PCLMUL */
+
 /* ===========================================================================
  * Run a set of bytes through the crc shift register.  If s is a NULL
  * pointer, then initialize the crc shift register contents instead.
@@ -7951,52 +9603,135 @@ ulg updcrc(s, n)
 {
     register ulg c;         /* temporary variable */
 
-    static ulg crc = (ulg)0xffffffffL; /* shift register contents */
+    static TLS ulg crc = (ulg)0xffffffffL; /* shift register contents */
 
     if (s == NULL) {
 	c = 0xffffffffL;
     } else {
-	c = crc;
-        if (n) do {
-            c = crc_32_tab[((int)c ^ (*s++)) & 0xff] ^ (c >> 8);
-        } while (--n);
+	BENCH(BP_CRC, c = (*crc_kernel)(crc, s, n));
     }
     crc = c;
     return c ^ 0xffffffffL;       /* (instead of ~c for 64-bit machines) */
 }
 
 /* ===========================================================================
- * Clear input and output buffers
+ * Update a crc with n bytes at s and return it. Unlike updcrc, this keeps
+ * no state: start with crc == 0 and pass the result of the previous call.
  */
-void clear_bufs()
+ulg crc32_buf(crc, s, n)
+    ulg crc;
+    uch *s;
+    unsigned n;
 {
-    outcnt = 0;
-    insize = inptr = 0;
-    bytes_in = bytes_out = 0L;
+    BENCH(BP_CRC, crc = (*crc_kernel)(crc ^ 0xffffffffL, s, n));
+    return crc ^ 0xffffffffL;
 }
 
 /* ===========================================================================
- * Fill the input buffer. This is called only when the buffer is empty.
+ * Return the crc of the concatenation of two blocks, given the crc of each
+ * block and the length of the second one (algorithm from zlib): append len2
+ * zero bytes to the first crc by repeated squaring of the matrix of the
+ * one-zero-bit operator, then add the crc of the second block.
  */
-int fill_inbuf(eof_ok)
-    int eof_ok;          /* set if EOF acceptable as a result */
+#define GF2_DIM 32      /* dimension of GF(2) vectors (length of CRC) */
+
+local ulg gf2_matrix_times(mat, vec)
+    ulg *mat;
+    ulg vec;
 {
-    int len;
+    ulg sum = 0;
 
-    /* Read as much as possible */
-    insize = 0;
-    do {
-	len = read(ifd, (char*)inbuf+insize, INBUFSIZ-insize);
-	if (len == 0) break;
-	if (len == -1) {
-	  read_error();
-	  break;
-	}
-	insize += len;
-    } while (insize < INBUFSIZ);
+    while (vec) {
+	if (vec & 1) sum ^= *mat;
+	vec >>= 1;
+	mat++;
+    }
+    return sum;
+}
 
-    if (insize == 0) {
-	if (eof_ok) return EOF;
+local void gf2_matrix_square(square, mat)
+    ulg *square;
+    ulg *mat;
+{
+    int n;
+
+    for (n = 0; n < GF2_DIM; n++) {
+	square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+ulg crc32_combine(crc1, crc2, len2)
+    ulg crc1;
+    ulg crc2;
+    off_t len2;
+{
+    int n;
+    ulg row;
+    ulg even[GF2_DIM];  /* even-power-of-two zeros operator */
+    ulg odd[GF2_DIM];   /* odd-power-of-two zeros operator */
+
+    if (len2 <= 0) return crc1;
+
+    odd[0] = 0xedb88320L;  /* the crc polynomial, operator for one zero bit */
+    row = 1;
+    for (n = 1; n < GF2_DIM; n++) {
+	odd[n] = row;
+	row <<= 1;
+    }
+    gf2_matrix_square(even, odd); /* two zero bits */
+    gf2_matrix_square(odd, even); /* four zero bits */
+
+    /* apply len2 zeros to crc1 (first square will put the operator for one
+     * zero byte, eight zero bits, in even)
+     */
+    do {
+	gf2_matrix_square(even, odd);
+	if (len2 & 1) crc1 = gf2_matrix_times(even, crc1);
+	len2 >>= 1;
+	if (len2 == 0) break;
+
+	gf2_matrix_square(odd, even);
+	if (len2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+	len2 >>= 1;
+    } while (len2 != 0);
+
+    return crc1 ^ crc2;
+}
+
+/* ===========================================================================
+ * Clear input and output buffers
+ */
+void clear_bufs()
+{
+    outcnt = 0;
+    insize = inptr = 0;
+    bytes_in = bytes_out = 0L;
+    stream_pos = 0L;
+    range_done = 0;
+}
+
+/* ===========================================================================
+ * Fill the input buffer. This is called only when the buffer is empty.
+ */
+int fill_inbuf(eof_ok)
+    int eof_ok;          /* set if EOF acceptable as a result */
+{
+    int len;
+
+    /* Read as much as possible */
+    insize = 0;
+    do {
+	len = read_input(ifd, (char*)inbuf+insize, INBUFSIZ-insize);
+	if (len == 0) break;
+	if (len == -1) {
+	  read_error();
+	  break;
+	}
+	insize += len;
+    } while (insize < INBUFSIZ);
+
+    if (insize == 0) {
+	if (eof_ok) return EOF;
 	flush_window();
 	errno = 0;
 	read_error();
@@ -8021,23 +9756,200 @@ void flush_outbuf()
 
 /* ===========================================================================
  * Write the output window window[0..outcnt-1] and update crc and bytes_out.
- * (Used for the decompressed data only.)
+ * (Used for the decompressed data only.) stream_pos counts the data of all
+ * the members of the file, for --index and --range.
  */
+TLS off_t stream_pos;
+
 void flush_window()
 {
     if (outcnt == 0) return;
     updcrc(window, outcnt);
 
-    if (!test) {
+    if (ofd == NO_FILE) {
+	write_buf(ofd, (char *)window, outcnt); /* see gz_ctx_uncompress */
+    } else if (range_start >= 0) {
+	range_write(window, outcnt);
+    } else if (!test) {
 	write_buf(ofd, (char *)window, outcnt);
     }
     bytes_out += (off_t)outcnt;
+    stream_pos += (off_t)outcnt;
     outcnt = 0;
 }
 
+/* ===========================================================================
+ * In-memory input and output, used by the worker threads of pzip.c.
+ * mem_read() serves as read_buf, and data written to NO_FILE is appended
+ * to mem_outbuf, which is enlarged as needed.
+ */
+TLS uch *mem_inbuf;  /* next byte of in-memory input */
+TLS ulg  mem_insize; /* bytes left in mem_inbuf */
+TLS unsigned mem_pad; /* zeros read after the end of mem_input */
+TLS uch *mem_outbuf; /* in-memory output */
+TLS ulg  mem_outcnt; /* bytes in mem_outbuf */
+TLS ulg  mem_outsize;/* allocated size of mem_outbuf */
+
+int mem_read(buf, size)
+    char *buf;
+    unsigned size;
+{
+    if ((ulg)size > mem_insize) size = (unsigned)mem_insize;
+    memcpy(buf, (char*)mem_inbuf, size);
+    mem_inbuf += size;
+    mem_insize -= size;
+    return (int)size;
+}
+
+/* ===========================================================================
+ * Memory mapped input and batched output (--mmap option). A regular input
+ * file is mapped once and read_input() copies from the mapping instead of
+ * calling read(). The deflate window is indexed by 16 bit positions, so
+ * the data must still be copied into it: the gain is in the system calls
+ * saved and in the readahead hint. Output is gathered in a page aligned
+ * buffer of BULK_SIZE bytes and written in full blocks.
+ */
+#ifndef BULK_SIZE
+#  define BULK_SIZE 0x100000L
+#endif
+
+local TLS uch  *map_buf = NULL;  /* mapping of the input file */
+local TLS off_t map_size;        /* size of the mapping */
+local TLS off_t map_pos;         /* offset of the next byte to read */
+local TLS int   map_fd = -1;     /* mapped file descriptor, or -1 */
+local TLS char *bulk_buf = NULL; /* pending output */
+local TLS unsigned bulk_cnt = 0; /* bytes in bulk_buf */
+local TLS int   bulk_fd;         /* file descriptor of the pending output */
+
+local void write_all OF((int fd, voidp buf, unsigned cnt));
+
+/* ===========================================================================
+ * Map the input file fd if --mmap was given and it is a regular file.
+ * Reading continues from the current file offset. On failure, the file
+ * is silently read as usual.
+ */
+void map_input(fd)
+    int fd;
+{
+    if (mmap_io) (void)map_file(fd);
+}
+
+/* ===========================================================================
+ * Map the input file fd if it is a regular file with data left to read.
+ * Return nonzero if fd is mapped.
+ */
+int map_file(fd)
+    int fd;
+{
+#ifndef NO_MMAP
+    struct stat st;
+    voidp p;
+
+    if (fd == map_fd) return map_buf != NULL;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+    map_pos = lseek(fd, (off_t)0, SEEK_CUR);
+    if (map_pos == (off_t)-1 || st.st_size <= map_pos) return 0;
+    if ((off_t)(size_t)st.st_size != st.st_size) return 0;
+
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, (off_t)0);
+    if (p == MAP_FAILED) return 0;
+#ifdef MADV_SEQUENTIAL
+    (void)madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    map_buf = (uch*)p;
+    map_size = st.st_size;
+    map_fd = fd;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* ===========================================================================
+ * Read the input NO_FILE from buf[0..size-1]. It is handled as a mapped
+ * file which is never unmapped. mem_pad, which the caller may set after
+ * this call, is the number of zeros that can be read after the end.
+ */
+void mem_input(buf, size)
+    uch *buf;
+    off_t size;
+{
+    mem_pad = 0;
+    map_buf = buf;
+    map_size = size;
+    map_pos = 0;
+    map_fd = NO_FILE;
+}
+
+/* ===========================================================================
+ * Release the mapping of the input file, if any.
+ */
+void unmap_input()
+{
+#ifndef NO_MMAP
+    if (map_fd == -1) return;
+    (void)munmap((voidp)map_buf, (size_t)map_size);
+    map_buf = NULL;
+    map_fd = -1;
+#endif
+}
+
+/* ===========================================================================
+ * Same as read(), but take the data from the mapping if fd is mapped.
+ */
+int read_input(fd, buf, size)
+    int fd;
+    char *buf;
+    unsigned size;
+{
+    if (fd == map_fd) {
+	unsigned n = size;
+	if ((off_t)n > map_size - map_pos) {
+	    n = (unsigned)(map_size - map_pos);
+	}
+	memcpy(buf, (char*)map_buf + map_pos, n);
+	map_pos += (off_t)n;
+	if (n == 0 && mem_pad != 0) {
+	    n = size < mem_pad ? size : mem_pad;
+	    memzero(buf, n);
+	    mem_pad -= n;
+	}
+	return (int)n;
+    }
+    return read(fd, buf, size);
+}
+
+/* ===========================================================================
+ * Continue reading fd at offset pos. The input buffer is emptied.
+ */
+void seek_input(fd, pos)
+    int fd;
+    off_t pos;
+{
+    if (fd == map_fd) {
+	map_pos = pos < map_size ? pos : map_size;
+    } else if (lseek(fd, pos, SEEK_SET) == (off_t)-1) {
+	read_error();
+    }
+    insize = inptr = 0;
+    bytes_in = pos;
+}
+
+/* ===========================================================================
+ * Write the output gathered in bulk_buf.
+ */
+void flush_bulk()
+{
+    unsigned cnt = bulk_cnt;
+
+    if (cnt == 0) return;
+    bulk_cnt = 0; /* write_error calls abort_gzip, which flushes again */
+    write_all(bulk_fd, bulk_buf, cnt);
+}
+
 /* ===========================================================================
  * Does the same as write(), but also handles partial pipe writes and checks
- * for error return.
+ * for error return. With --mmap, the data is first gathered in bulk_buf.
  */
 void write_buf(fd, buf, cnt)
     int       fd;
@@ -8046,6 +9958,52 @@ void write_buf(fd, buf, cnt)
 {
     unsigned  n;
 
+    if (mmap_io && fd != NO_FILE) {
+	if (bulk_buf == NULL) {
+	    voidp p;
+	    if (posix_memalign(&p, 4096, BULK_SIZE) != 0) {
+		error("out of memory");
+	    }
+	    bulk_buf = (char*)p;
+	}
+	if (bulk_cnt != 0 && fd != bulk_fd) flush_bulk();
+	bulk_fd = fd;
+	while (cnt != 0) {
+	    n = BULK_SIZE - bulk_cnt;
+	    if (n > cnt) n = cnt;
+	    memcpy(bulk_buf + bulk_cnt, (char*)buf, n);
+	    bulk_cnt += n;
+	    buf = (voidp)((char*)buf+n);
+	    cnt -= n;
+	    if (bulk_cnt == BULK_SIZE) flush_bulk();
+	}
+	return;
+    }
+    if (fd == NO_FILE) {
+	if (mem_outcnt + cnt > mem_outsize) {
+	    ulg size = mem_outcnt + cnt;
+	    uch *p;
+	    if (size < 2*mem_outcnt) size = 2*mem_outcnt;
+	    /* keep mem_outbuf on failure, gz_ctx_compress returns it */
+	    p = (uch*)realloc((char*)mem_outbuf, size);
+	    if (p == NULL) error("out of memory");
+	    mem_outbuf = p;
+	    mem_outsize = size;
+	}
+	memcpy((char*)mem_outbuf+mem_outcnt, (char*)buf, cnt);
+	mem_outcnt += cnt;
+	return;
+    }
+    write_all(fd, buf, cnt);
+}
+
+local void write_all(fd, buf, cnt)
+    int       fd;
+    voidp     buf;
+    unsigned  cnt;
+{
+    unsigned  n;
+
     while ((n = write(fd, buf, cnt)) != cnt) {
 	if (n == (unsigned)(-1)) {
 	    write_error();
@@ -8255,6 +10213,7 @@ char *add_envopt(argcp, argvp, env)
 void error(m)
     char *m;
 {
+    if (gz_abort != NULL) gz_fail(m); /* in gz_ctx_compress and co. */
     fprintf(stderr, "\n%s: %s: %s\n", progname, ifname, m);
     abort_gzip();
 }
@@ -8268,6 +10227,7 @@ void warning (m)
 void read_error()
 {
     int e = errno;
+    if (gz_abort != NULL) gz_fail("unexpected end of file");
     fprintf(stderr, "\n%s: ", progname);
     if (e != 0) {
 	errno = e;
@@ -8343,6 +10303,27 @@ voidp xmalloc (size)
     return cp;
 }
 
+#ifndef NO_THREADS
+/* ========================================================================
+ * Block the signals caught by abort_gzip_signal and save the old mask in
+ * oset, so that the threads created next leave them to the main thread.
+ * SIGSEGV, SIGBUS and SIGFPE are not blocked.
+ */
+void block_signals(oset)
+    sigset_t *oset;
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+#ifdef SIGHUP
+    sigaddset(&set, SIGHUP);
+#endif
+    pthread_sigmask(SIG_BLOCK, &set, oset);
+}
+#endif
+
 /* ========================================================================
  * Table of CRC-32's of all single-byte values (made by makecrc.c)
  */
@@ -8452,8 +10433,8 @@ yesno ()
 static char rcsid[] = "$Id: zip.c,v 0.17 1993/06/10 13:29:25 jloup Exp $";
 #endif
 
-local ulg crc;       /* crc on uncompressed file data */
-off_t header_bytes;   /* number of bytes in gzip header */
+local TLS ulg crc;   /* crc on uncompressed file data */
+TLS off_t header_bytes; /* number of bytes in gzip header */
 
 /* ===========================================================================
  * Deflate in to out.
@@ -8490,6 +10471,14 @@ int zip(in, out)
 
     bi_init(out);
     ct_init(&attr, &method);
+    compr_rsync  = rsync;
+    compr_greedy = fast_greedy;
+#ifndef NO_THREADS
+    if (processes > 1 && !rsync) {
+	/* pdeflate() reads the input itself, just set the flags: */
+	deflate_flags |= level == 1 ? FAST : level == 9 ? SLOW : 0;
+    } else
+#endif
     lm_init(level, &deflate_flags);
 
     put_byte((uch)deflate_flags); /* extra flags */
@@ -8503,6 +10492,11 @@ int zip(in, out)
     }
     header_bytes = (off_t)outcnt;
 
+#ifndef NO_THREADS
+    if (processes > 1 && !rsync) {
+	(void)pdeflate();
+    } else
+#endif
     (void)deflate();
 
 #if !defined(NO_SIZE_CHECK) && !defined(RECORD_IO)
@@ -8538,7 +10532,7 @@ int file_read(buf, size)
 
     Assert(insize == 0, "inbuf not empty");
 
-    len = read(ifd, buf, size);
+    len = read_input(ifd, buf, size);
     if (len == 0) return (int)len;
     if (len == (unsigned)-1) {
 	read_error();
@@ -8550,56 +10544,1924 @@ int file_read(buf, size)
     return (int)len;
 }
 
-/* Determine whether string value is affirmation or negative response
-   according to current locale's data.
-   Copyright (C) 1996, 1998, 2000 Free Software Foundation, Inc.
+/* gzctx.c -- reentrant in-memory compression and decompression
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License, see the file COPYING.
+ */
 
-   This program is free software; you can redistribute it and/or modify
-   it under the terms of the GNU General Public License as published by
-   the Free Software Foundation; either version 2, or (at your option)
-   any later version.
+/*
+ *  PURPOSE
+ *
+ *      Compress and decompress buffers in memory, independently in any
+ *      number of threads, without going through files and the command
+ *      line options.
+ *
+ *  DISCUSSION
+ *
+ *      The state of deflate and inflate (window, hash chains, trees, bit
+ *      buffers, crc, input and output buffers) is thread local, see TLS
+ *      in gzip.h. A stream compressed or decompressed from start to end
+ *      by one call therefore needs no other context than its parameters
+ *      and results, which are kept in a gz_ctx: each thread can run
+ *      gz_ctx_compress and gz_ctx_uncompress on its own streams, and a
+ *      thread can run any number of streams one after the other. The
+ *      options that the command line gives to zip() (level, --rsyncable,
+ *      --fast-greedy) are taken from the gz_ctx instead. Only the crc
+ *      tables and the static Huffman trees are shared; they are built
+ *      once by gz_init.
+ *
+ *      Errors do not exit: while a call runs, gz_abort is set and error()
+ *      and read_error() call gz_fail, which returns from the call with
+ *      ERROR and the message in ctx->msg. The output buffer is still
+ *      handed back so that the caller can free it.
+ *
+ *      These calls must not be made by a thread which is compressing or
+ *      decompressing a file with zip() or unzip(), since they use the same
+ *      state. The -p option uses gz_ctx_compress in its worker threads to
+ *      deflate the chunks of a file.
+ *
+ *  LIMITATIONS
+ *
+ *      A gz_ctx only holds the parameters and results of a call, not the
+ *      state of a stream, which stays in the thread local variables of
+ *      deflate and inflate. Therefore:
+ *
+ *      - A stream is compressed or decompressed by a single call, from a
+ *        buffer in memory. There is no streaming interface, and a thread
+ *        cannot work on two streams at the same time.
+ *
+ *      - Each thread of the process has its own copy of that state, about
+ *        460K on 64-bit systems (window, prev, head, bt_tree, the block
+ *        and I/O buffers), whether it uses these calls or not.
+ *
+ *      Lifting both limits needs the state to be allocated with each
+ *      gz_ctx and passed through deflate, trees and inflate.
+ *
+ *  INTERFACE
+ *
+ *      void gz_init (void)
+ *          Build the tables shared by all threads. Must be called once
+ *          before starting any thread.
+ *
+ *      void gz_ctx_init (gz_ctx *ctx, int level)
+ *          Set the defaults: a gzip member compressed at the given level,
+ *          with no name and no time stamp.
+ *
+ *      int gz_ctx_compress (gz_ctx *ctx, gz_buf *in, gz_buf *out)
+ *          Compress in->data and append the result to out->data, which is
+ *          enlarged with realloc as needed. Return OK, or ERROR if the
+ *          parameters are invalid or memory runs out.
+ *
+ *      int gz_ctx_uncompress (gz_ctx *ctx, gz_buf *in, gz_buf *out)
+ *          Decompress the gzip members in in->data, or raw deflate data
+ *          ending with the last block, preceded by ctx->dict if any, and
+ *          append the result to out->data. ctx->time is set from the header
+ *          of the last member and ctx->crc to the crc of all the output.
+ *          Return OK, or ERROR if the data is invalid or memory runs out.
+ *
+ *      void gz_fail (char *msg)
+ *          Return ERROR from the running gz_ctx call.
+ */
 
-   This program is distributed in the hope that it will be useful,
-   but WITHOUT ANY WARRANTY; without even the implied warranty of
-   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-   GNU General Public License for more details.
+TLS jmp_buf *gz_abort = NULL; /* where gz_fail returns to, or NULL */
+local TLS char *gz_msg;       /* message of gz_fail */
 
-   You should have received a copy of the GNU General Public License
-   along with this program; if not, write to the Free Software Foundation,
-   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.  */
+local int  gz_read   OF((char *buf, unsigned size));
+local void gz_header OF((gz_ctx *ctx));
 
-int
-rpmatch (const char *response)
+/* ===========================================================================
+ * Build the crc tables and the static Huffman trees.
+ */
+void gz_init()
 {
-  /* Test against "^[yY]" and "^[nN]", hardcoded to avoid requiring regex */
-  return (*response == 'y' || *response == 'Y' ? 1
-	  : *response == 'n' || *response == 'N' ? 0 : -1);
+    ush attr = 0;           /* ignored */
+    int meth = DEFLATED;    /* ignored */
+
+    crc_init();
+    ct_init(&attr, &meth);
 }
 
+/* ===========================================================================
+ * Initialize ctx for a gzip member compressed at the given level.
+ */
+void gz_ctx_init(ctx, level)
+    gz_ctx *ctx;
+    int level;
+{
+    memzero((char*)ctx, sizeof(gz_ctx));
+    ctx->level = level;
+    ctx->last = 1;
+}
 
-int
-getopt_long (argc, argv, options, long_options, opt_index)
-     int argc;
-     char *const *argv;
-     const char *options;
-     const struct option *long_options;
-     int *opt_index;
+/* ===========================================================================
+ * Abandon the running gz_ctx call, which returns ERROR.
+ */
+void gz_fail(msg)
+    char *msg;
 {
-  return _getopt_internal (argc, argv, options, long_options, opt_index, 0);
+    gz_msg = msg;
+    longjmp(*gz_abort, 1);
 }
 
-/* Like getopt_long, but '-' as well as '--' can indicate a long option.
-   If an option that starts with '-' (not '--') doesn't match a long option,
-   but does match a short option, it is parsed as a short option
-   instead.  */
+/* ===========================================================================
+ * Same as file_read, for in-memory input.
+ */
+local int gz_read(buf, size)
+    char *buf;
+    unsigned size;
+{
+    int len = mem_read(buf, size);
 
-int
-getopt_long_only (argc, argv, options, long_options, opt_index)
-     int argc;
-     char *const *argv;
-     const char *options;
-     const struct option *long_options;
-     int *opt_index;
+    crc = updcrc((uch*)buf, (unsigned)len);
+    bytes_in += (off_t)len;
+    return len;
+}
+
+/* ===========================================================================
+ * Compress in to the end of out. The crc of the input is left in ctx->crc.
+ */
+int gz_ctx_compress(ctx, in, out)
+    gz_ctx *ctx;
+    gz_buf *in, *out;
 {
-  return _getopt_internal (argc, argv, options, long_options, opt_index, 1);
+    uch  flags = 0;         /* general purpose bit flags */
+    ush  attr = 0;          /* ascii/binary flag */
+    ush  deflate_flags = 0; /* pkzip -es, -en or -ex equivalent */
+    int  meth = DEFLATED;   /* ignored, always deflated */
+    jmp_buf env;            /* for gz_fail */
+
+    ctx->msg = NULL;
+    if (ctx->level < 1 || ctx->level > 9 || ctx->dictlen > WSIZE) {
+	ctx->msg = "invalid parameters";
+	return ERROR;
+    }
+    if (ctx->name != NULL) flags |= ORIG_NAME;
+    mem_inbuf  = in->data;
+    mem_insize = in->len;
+    mem_outbuf  = out->data;
+    mem_outsize = out->size;
+    mem_outcnt  = out->len;
+
+    if (setjmp(env)) {
+	gz_abort = NULL;
+	ctx->msg = gz_msg;
+	out->data = mem_outbuf;
+	out->size = mem_outsize;
+	out->len  = mem_outcnt;
+	return ERROR;
+    }
+    gz_abort = &env;
+
+    ofd = NO_FILE;
+    outcnt = 0;
+    insize = inptr = 0;
+    bytes_in = bytes_out = 0L;
+
+    if (!ctx->raw) {
+	put_byte(GZIP_MAGIC[0]); /* magic header */
+	put_byte(GZIP_MAGIC[1]);
+	put_byte(DEFLATED);      /* compression method */
+	put_byte(flags);         /* general flags */
+	put_long(ctx->time);
+    }
+    crc = updcrc(0, 0);
+
+    bi_init(NO_FILE);
+    read_buf = gz_read;
+    ct_init(&attr, &meth);
+    final_block = ctx->raw ? ctx->last : 1;
+    compr_rsync  = ctx->rsync;
+    compr_greedy = ctx->greedy;
+    if (ctx->raw) {
+	lm_init_dict(ctx->level, &deflate_flags, ctx->dict, ctx->dictlen);
+    } else {
+	lm_init(ctx->level, &deflate_flags);
+
+	put_byte((uch)deflate_flags); /* extra flags */
+	put_byte(OS_CODE);            /* OS identifier */
+	if (ctx->name != NULL) {
+	    char *p = ctx->name;
+	    do {
+		put_char(*p);
+	    } while (*p++);
+	}
+    }
+
+    (void)deflate();
+    bi_windup();   /* a raw stream without the last block may have bits left */
+    final_block = 1;
+
+    if (!ctx->raw) {
+	put_long(crc);
+	put_long((ulg)bytes_in);
+    }
+    flush_outbuf();
+    gz_abort = NULL;
+
+    ctx->crc = crc;
+    out->data = mem_outbuf;
+    out->size = mem_outsize;
+    out->len  = mem_outcnt;
+    return OK;
+}
+
+/* ===========================================================================
+ * Read the header of a gzip member, as get_method does. The time stamp
+ * is left in ctx->time.
+ */
+local void gz_header(ctx)
+    gz_ctx *ctx;
+{
+    uch hdr[10];   /* magic, method, flags, time, extra flags, OS */
+    unsigned len;
+    int i;
+
+    for (i = 0; i < 10; i++) hdr[i] = (uch)get_byte();
+    if (memcmp((char*)hdr, GZIP_MAGIC, 2) != 0) error("not in gzip format");
+    if (hdr[2] != DEFLATED) error("unknown method");
+    if ((hdr[3] & (ENCRYPTED|CONTINUATION|RESERVED)) != 0) {
+	error("unsupported flags");
+    }
+    ctx->time = LG(hdr + 4);
+
+    if ((hdr[3] & EXTRA_FIELD) != 0) {
+	len  = (unsigned)get_byte();
+	len |= ((unsigned)get_byte())<<8;
+	while (len--) (void)get_byte();
+    }
+    if ((hdr[3] & ORIG_NAME) != 0) {
+	while (get_byte() != 0) ;
+    }
+    if ((hdr[3] & COMMENT) != 0) {
+	while (get_byte() != 0) ;
+    }
+}
+
+/* ===========================================================================
+ * Decompress in to the end of out. The crc of the output is left in
+ * ctx->crc.
+ */
+int gz_ctx_uncompress(ctx, in, out)
+    gz_ctx *ctx;
+    gz_buf *in, *out;
+{
+    uch trl[8];    /* crc and length of a member */
+    ulg c;         /* crc of the current member */
+    ulg total;     /* crc of the previous members */
+    int i;
+    jmp_buf env;   /* for gz_fail */
+
+    ctx->msg = NULL;
+    if (ctx->dictlen > WSIZE) {
+	ctx->msg = "invalid parameters";
+	return ERROR;
+    }
+    mem_input(in->data, (off_t)in->len);
+    if (ctx->raw) mem_pad = sizeof(ulg); /* for the lookahead of inflate */
+    mem_outbuf  = out->data;
+    mem_outsize = out->size;
+    mem_outcnt  = out->len;
+
+    if (setjmp(env)) {
+	gz_abort = NULL;
+	huft_free_live();
+	ctx->msg = gz_msg;
+	out->data = mem_outbuf;
+	out->size = mem_outsize;
+	out->len  = mem_outcnt;
+	return ERROR;
+    }
+    gz_abort = &env;
+
+    ifd = ofd = NO_FILE;
+    clear_bufs();
+    total = 0;
+    for (;;) {
+	if (!ctx->raw) gz_header(ctx);
+	updcrc(NULL, 0);
+	bytes_out = 0;
+
+	/* The window holds the dictionary before the output, see
+	 * range_inflate for the layout.
+	 */
+	memzero((char*)window, WSIZE);
+	if (ctx->raw && ctx->dictlen != 0) {
+	    memcpy((char*)window + WSIZE - ctx->dictlen, (char*)ctx->dict,
+		   ctx->dictlen);
+	}
+	wp = 0;
+	bk = 0;
+	bb = 0;
+	if (inflate_more() != 0) error("invalid compressed data");
+
+	c = updcrc(window, 0);
+	total = crc32_combine(total, c, bytes_out);
+	if (ctx->raw) {
+	    /* The data must end before the zeros that were added */
+	    if (bytes_in - (off_t)(insize - inptr) > (off_t)in->len) {
+		error("unexpected end of file");
+	    }
+	    break;
+	}
+
+	for (i = 0; i < 8; i++) trl[i] = (uch)get_byte();
+	if (LG(trl) != c) error("invalid compressed data--crc error");
+	if (LG(trl + 4) != (ulg)bytes_out) {
+	    error("invalid compressed data--length error");
+	}
+	/* Continue with the next member, if any */
+	if (inptr == insize) {
+	    if (fill_inbuf(1) == EOF) break;
+	    inptr = 0;
+	}
+    }
+    gz_abort = NULL;
+
+    ctx->crc = total;
+    out->data = mem_outbuf;
+    out->size = mem_outsize;
+    out->len  = mem_outcnt;
+    return OK;
+}
+
+/* pzip.c -- deflate with several threads (-p option)
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License, see the file COPYING.
+ */
+
+/*
+ *  PURPOSE
+ *
+ *      Compress a single gzip member using several processors.
+ *
+ *  DISCUSSION
+ *
+ *      The input is cut into chunks of PZ_CHUNK bytes which are deflated
+ *      independently by a pool of worker threads. The last WSIZE bytes of
+ *      the previous chunk are loaded as a preset dictionary (lm_init_dict),
+ *      so matches can still cross chunk boundaries and little compression
+ *      is lost. All chunks but the last one are compressed with final_block
+ *      cleared: they end on a byte boundary without the last-block bit, so
+ *      the compressed chunks concatenate into one ordinary deflate stream.
+ *
+ *      Each worker compresses its chunks from memory to memory with
+ *      gz_ctx_compress (see gzctx.c), which also computes their crcs. The
+ *      main thread reads the input and writes the compressed chunks in
+ *      input order, combining their crcs.
+ *
+ *  INTERFACE
+ *
+ *      off_t pdeflate (void)
+ *          Same as deflate(), using the given number of threads.
+ */
+
+#ifndef NO_THREADS
+
+#ifndef PZ_CHUNK
+#  define PZ_CHUNK 0x20000 /* input bytes per chunk, must be >= WSIZE */
+#endif
+
+typedef struct pz_job {
+    uch      *in;      /* dictionary, followed by the data to compress */
+    unsigned dict;     /* length of the dictionary */
+    unsigned len;      /* length of the data to compress */
+    int      last;     /* set for the last chunk of the input */
+    ulg      crc;      /* crc of the data to compress */
+    int      done;     /* set when out is ready to be written */
+    uch      *out;     /* compressed data */
+    ulg      outlen;   /* length of the compressed data */
+    ulg      outsize;  /* allocated size of out */
+} pz_job;
+
+local pz_job *pz_jobs;      /* ring of jobs, in input order */
+local unsigned pz_njobs;    /* size of the ring */
+local ulg pz_avail;         /* number of jobs handed to the workers */
+local ulg pz_next;          /* next job to compress */
+local int pz_quit;          /* set to stop the workers */
+local pthread_mutex_t pz_lock = PTHREAD_MUTEX_INITIALIZER;
+local pthread_cond_t pz_work = PTHREAD_COND_INITIALIZER; /* job available */
+local pthread_cond_t pz_done = PTHREAD_COND_INITIALIZER; /* job compressed */
+
+local void  pz_compress OF((pz_job *job));
+local void *pz_worker   OF((void *arg));
+local void  pz_write    OF((pz_job *job));
+local unsigned pz_read  OF((char *buf, unsigned size));
+
+/* ===========================================================================
+ * Compress one chunk into job->out. Runs in a worker thread.
+ */
+local void pz_compress(job)
+    pz_job *job;
+{
+    gz_ctx ctx;
+    gz_buf in, out;
+
+    gz_ctx_init(&ctx, level);
+    ctx.greedy = fast_greedy; /* no -p with --rsyncable */
+    ctx.raw  = 1;
+    ctx.last = job->last;
+    ctx.dict = job->in;
+    ctx.dictlen = job->dict;
+
+    in.data = job->in + job->dict;
+    in.len  = job->len;
+    in.size = 0;
+    out.data = job->out;
+    out.len  = 0;
+    out.size = job->outsize;
+
+    if (gz_ctx_compress(&ctx, &in, &out) != OK) error(ctx.msg);
+
+    job->crc = ctx.crc;
+    job->out = out.data;
+    job->outsize = out.size;
+    job->outlen = out.len;
+}
+
+/* ===========================================================================
+ * Worker thread: compress the jobs in order until told to quit.
+ */
+local void *pz_worker(arg)
+    void *arg;
+{
+    pz_job *job;
+
+    for (;;) {
+	pthread_mutex_lock(&pz_lock);
+	while (pz_next == pz_avail && !pz_quit) {
+	    pthread_cond_wait(&pz_work, &pz_lock);
+	}
+	if (pz_next == pz_avail) {
+	    pthread_mutex_unlock(&pz_lock);
+	    break;
+	}
+	job = &pz_jobs[pz_next++ % pz_njobs];
+	pthread_mutex_unlock(&pz_lock);
+
+	pz_compress(job);
+
+	pthread_mutex_lock(&pz_lock);
+	job->done = 1;
+	pthread_cond_broadcast(&pz_done);
+	pthread_mutex_unlock(&pz_lock);
+    }
+    return arg;
+}
+
+/* ===========================================================================
+ * Wait until the given job is compressed and write it out.
+ */
+local void pz_write(job)
+    pz_job *job;
+{
+    pthread_mutex_lock(&pz_lock);
+    while (!job->done) {
+	pthread_cond_wait(&pz_done, &pz_lock);
+    }
+    job->done = 0;
+    pthread_mutex_unlock(&pz_lock);
+
+    flush_outbuf(); /* gzip header */
+    write_buf(ofd, (char*)job->out, (unsigned)job->outlen);
+    bytes_out += (off_t)job->outlen;
+    crc = crc32_combine(crc, job->crc, (off_t)job->len);
+}
+
+/* ===========================================================================
+ * Read a new buffer from the current input file. Same as file_read but
+ * leave the crc computation to the workers.
+ */
+local unsigned pz_read(buf, size)
+    char *buf;
+    unsigned size;
+{
+    unsigned len;
+
+    len = read_input(ifd, buf, size);
+    if (len == (unsigned)-1) {
+	read_error();
+	return 0;
+    }
+    bytes_in += (off_t)len;
+    return len;
+}
+
+/* ===========================================================================
+ * Compress ifd to ofd with several threads. Returns the total compressed
+ * length. Updates crc and bytes_in.
+ */
+off_t pdeflate()
+{
+    pthread_t *tid;         /* worker threads */
+    sigset_t oset;          /* signals are handled by the main thread */
+    pz_job *job, *prev;     /* current and previous job */
+    ulg seq;                /* number of the current job */
+    unsigned total;         /* bytes in the previous job */
+    unsigned n;             /* bytes read */
+    off_t start = bytes_out;
+    int i;
+
+    pz_njobs = 2*processes;
+    pz_jobs = (pz_job*)xmalloc(pz_njobs*sizeof(pz_job));
+    for (i = 0; i < (int)pz_njobs; i++) {
+	pz_jobs[i].in = (uch*)xmalloc(WSIZE+PZ_CHUNK);
+	pz_jobs[i].out = NULL;
+	pz_jobs[i].outsize = 0;
+	pz_jobs[i].done = 0;
+    }
+    pz_avail = pz_next = 0;
+    pz_quit = 0;
+
+    tid = (pthread_t*)xmalloc(processes*sizeof(pthread_t));
+    block_signals(&oset);
+    for (i = 0; i < processes; i++) {
+	if (pthread_create(&tid[i], NULL, pz_worker, NULL) != 0) {
+	    error("cannot create thread");
+	}
+    }
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+    for (seq = 0; ; seq++) {
+	job = &pz_jobs[seq % pz_njobs];
+	if (seq >= pz_njobs) pz_write(job); /* free the slot */
+
+	/* Use the end of the previous chunk as dictionary */
+	job->dict = 0;
+	if (seq != 0) {
+	    prev = &pz_jobs[(seq-1) % pz_njobs];
+	    total = prev->dict + prev->len;
+	    job->dict = total < WSIZE ? total : WSIZE;
+	    memcpy((char*)job->in, (char*)prev->in + total - job->dict,
+		   job->dict);
+	}
+	job->len = 0;
+	while (job->len < PZ_CHUNK) {
+	    n = pz_read((char*)job->in + job->dict + job->len,
+			PZ_CHUNK - job->len);
+	    if (n == 0) break;
+	    job->len += n;
+	}
+	job->last = job->len < PZ_CHUNK;
+
+	pthread_mutex_lock(&pz_lock);
+	pz_avail = seq+1;
+	pthread_cond_signal(&pz_work);
+	pthread_mutex_unlock(&pz_lock);
+
+	if (job->last) break;
+    }
+    /* Write the jobs still in the ring */
+    for (seq = seq+1 > pz_njobs ? seq+1-pz_njobs : 0; seq < pz_avail; seq++) {
+	pz_write(&pz_jobs[seq % pz_njobs]);
+    }
+
+    pthread_mutex_lock(&pz_lock);
+    pz_quit = 1;
+    pthread_cond_broadcast(&pz_work);
+    pthread_mutex_unlock(&pz_lock);
+    for (i = 0; i < processes; i++) {
+	pthread_join(tid[i], NULL);
+    }
+    free((char*)tid);
+    for (i = 0; i < (int)pz_njobs; i++) {
+	free((char*)pz_jobs[i].in);
+	if (pz_jobs[i].out != NULL) free((char*)pz_jobs[i].out);
+    }
+    free((char*)pz_jobs);
+    return bytes_out - start;
+}
+
+#endif /* NO_THREADS */
+
+/* punzip.c -- inflate with several threads (-d -p option)
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License, see the file COPYING.
+ */
+
+/*
+ *  PURPOSE
+ *
+ *      Decompress a gzip file made of several members, or of deflate
+ *      blocks flushed to a byte boundary, using several processors.
+ *
+ *  DISCUSSION
+ *
+ *      The compressed file is mapped and cut into segments of at least
+ *      PU_SEGMENT bytes. A segment starts at the first candidate boundary
+ *      found after the cut: a gzip header (1f 8b 08), or the end of an
+ *      empty stored block (00 00 ff ff) as written by --rsyncable and by
+ *      gzip -p. The candidates are only guesses: a worker thread inflates
+ *      its segment from the candidate until it reaches, on a block or
+ *      member boundary, the start of a later segment. The main thread
+ *      takes the segments in order and keeps one only if it starts where
+ *      the previous one stopped, in the same state (inside a member or
+ *      between members). Any gap is inflated by the main thread itself.
+ *
+ *      Blocks after a flush still refer to the 32K bytes before them, so
+ *      a worker does not produce bytes but 16-bit symbols: 0..255 for a
+ *      byte, PU_PLACE+i for byte i of the unknown 32K window that precedes
+ *      the segment. The main thread replaces the placeholders with the
+ *      data it has just written, computes the crc of each member and
+ *      checks it against the trailer.
+ *
+ *      A file without any candidate (a single member written without
+ *      flushes) and input that is not a regular file are inflated as
+ *      usual by unzip().
+ *
+ *  INTERFACE
+ *
+ *      int punzip (int in, int out)
+ *          Same as unzip() for a gzip member whose header has been read,
+ *          decompressing the following members too. Returns -1 if unzip()
+ *          must do the work.
+ */
+
+#if !defined(NO_THREADS) && !defined(NO_FAST_INFLATE)
+
+#ifndef PU_SEGMENT
+#  define PU_SEGMENT 0x100000L /* compressed bytes per segment, at least */
+#endif
+#ifndef PU_MAXOUT
+#  define PU_MAXOUT 0x1000000L /* symbols a worker may buffer */
+#endif
+#define PU_CHUNK 0x40000L      /* bytes resolved and written at once */
+#define PU_PLACE 256           /* first placeholder symbol */
+
+/* Room for the decoding tables: a 10 (or 8) bit root table, plus a sub-table
+   of at most 2^(15-root) entries for each code longer than the root */
+#define PU_LSIZE ((1 << FAST_LBITS) + 286 * (1 << (BMAX - FAST_LBITS)))
+#define PU_DSIZE ((1 << FAST_DBITS) + 30 * (1 << (BMAX - FAST_DBITS)))
+
+typedef struct pu_mark {
+    ulg pos;           /* number of symbols before the end of the member */
+    ulg crc;           /* crc from the member trailer */
+    ulg len;           /* length from the member trailer */
+} pu_mark;
+
+typedef struct pu_job {
+    ulg      start;    /* offset of the segment in the input */
+    int      member;   /* start is a gzip header, else a deflate block */
+    ulg      stop;     /* stop at the first boundary at or after this */
+    int      direct;   /* run by the main thread: write out as it goes */
+    int      err;      /* PU_OK, PU_BAD or PU_BIG */
+    ulg      end;      /* offset where inflating stopped */
+    int      end_member; /* stopped between members */
+    int      last;     /* no member that punzip can read follows end */
+    int      done;     /* set when the results are ready */
+    ush      *out;     /* inflated symbols */
+    ulg      outlen;   /* number of symbols */
+    ulg      outsize;  /* allocated size of out */
+    pu_mark  *marks;   /* ends of the members in out */
+    unsigned nmarks;   /* number of marks */
+    unsigned marksize; /* allocated size of marks */
+} pu_job;
+
+#define PU_OK  0       /* the segment was inflated */
+#define PU_BAD 1       /* invalid deflate data */
+#define PU_BIG 2       /* too much output to keep in memory */
+
+local uch *pu_in;           /* the mapped input file */
+local ulg pu_size;          /* size of the input file */
+local int pu_out;           /* the output file */
+local ulg *pu_cand;         /* boundaries: offset*2, plus one for a member */
+local unsigned pu_ncand;    /* number of boundaries */
+local fcode pu_fixed_l[1 << FAST_LBITS]; /* tables for fixed blocks */
+local fcode pu_fixed_d[1 << FAST_DBITS];
+
+local pu_job *pu_jobs;      /* ring of jobs, in input order */
+local unsigned pu_njobs;    /* size of the ring */
+local ulg pu_avail;         /* number of jobs handed to the workers */
+local ulg pu_next;          /* next job to inflate */
+local int pu_quit;          /* set to stop the workers */
+local pthread_mutex_t pu_lock = PTHREAD_MUTEX_INITIALIZER;
+local pthread_cond_t pu_work = PTHREAD_COND_INITIALIZER; /* job available */
+local pthread_cond_t pu_done = PTHREAD_COND_INITIALIZER; /* job inflated */
+
+local uch *pu_hist;         /* last WSIZE bytes written */
+local uch *pu_ctx;          /* the WSIZE bytes before the current segment */
+local uch *pu_buf;          /* resolved bytes */
+local ulg pu_crc;           /* crc of the current member */
+local ulg pu_len;           /* length of the current member */
+local int pu_err;           /* crc or length error */
+
+local ulg  pu_scan     OF((ulg from));
+local int  pu_boundary OF((ulg pos, int member));
+local int  pu_header   OF((ulg *pos));
+local void pu_grow     OF((pu_job *job, ulg need));
+local void pu_inflate  OF((pu_job *job));
+local void *pu_worker  OF((void *arg));
+local void pu_begin    OF((void));
+local void pu_output   OF((pu_job *job, ulg upto));
+local void pu_direct   OF((ulg start, int member, ulg stop, pu_job *job));
+
+/* ===========================================================================
+ * Return the first candidate boundary at or after from, as offset*2 plus
+ * one for a gzip header, or zero if there is none.
+ */
+local ulg pu_scan(from)
+    ulg from;
+{
+    uch *p = pu_in + from;
+    uch *end = pu_in + pu_size - 4;
+
+    for (; p < end; p++) {
+	if (p[0] == 0 && p[1] == 0 && p[2] == 0xff && p[3] == 0xff) {
+	    return (ulg)(p + 4 - pu_in) << 1;
+	}
+	if (p[0] == GZIP_MAGIC[0] && p[1] == (uch)GZIP_MAGIC[1] &&
+	    p[2] == DEFLATED) {
+	    return ((ulg)(p - pu_in) << 1) + 1;
+	}
+    }
+    return 0;
+}
+
+/* ===========================================================================
+ * Return nonzero if pos is the start of a segment of the given kind.
+ */
+local int pu_boundary(pos, member)
+    ulg pos;
+    int member;
+{
+    ulg key = (pos << 1) + member;
+    unsigned lo = 0, hi = pu_ncand, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (pu_cand[mid] == key) return 1;
+	if (pu_cand[mid] < key) lo = mid + 1; else hi = mid;
+    }
+    return 0;
+}
+
+/* ===========================================================================
+ * Skip the gzip header at *pos. Return zero if there is no header there,
+ * or one that get_method() should look at (other method, flags, magic).
+ */
+local int pu_header(pos)
+    ulg *pos;
+{
+    uch *h = pu_in + *pos;
+    ulg left = pu_size - *pos;
+    ulg i = 10;
+
+    if (left <= i || h[0] != GZIP_MAGIC[0] || h[1] != (uch)GZIP_MAGIC[1] ||
+	h[2] != DEFLATED || (h[3] & (ENCRYPTED|CONTINUATION|RESERVED))) {
+	return 0;
+    }
+    if (h[3] & EXTRA_FIELD) {
+	if (left <= i + 2) return 0;
+	i += 2 + ((ulg)h[i] | ((ulg)h[i+1] << 8));
+    }
+    if (h[3] & ORIG_NAME) {
+	while (i < left && h[i] != 0) i++;
+	i++;
+    }
+    if (h[3] & COMMENT) {
+	while (i < left && h[i] != 0) i++;
+	i++;
+    }
+    if (i >= left) return 0;
+    *pos += i;
+    return 1;
+}
+
+/* ===========================================================================
+ * Make room for need symbols in job->out.
+ */
+local void pu_grow(job, need)
+    pu_job *job;
+    ulg need;
+{
+    if (need <= job->outsize) return;
+    job->outsize = job->outsize ? 2*job->outsize : 2*PU_SEGMENT;
+    if (job->outsize < need) job->outsize = need;
+    job->out = (ush*)realloc((char*)job->out, job->outsize*sizeof(ush));
+    if (job->out == NULL) error("out of memory");
+}
+
+/* Bit buffer macros, as in inflate_fast but reading from the mapped file.
+   Past the end of the file the buffer is filled with zeros, and a block
+   that reads more than eight of them is invalid. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define PU_LOAD() {ulg x; memcpy(&x, p, 8); b |= x << k; \
+                     p += (63 - k) >> 3; k |= 56;}
+#else
+#  define PU_LOAD() {while(k<56){b|=((ulg)*p++)<<k;k+=8;}}
+#endif
+#define PU_NEED(n) {if(k<(n)){if(p+8<=end)PU_LOAD() else { \
+    if(p>end+8)goto bad; \
+    while(k<56){b|=(ulg)(p<end?*p:0)<<k;p++;k+=8;}}}}
+#define PU_DUMP(n) {b>>=(n);k-=(n);}
+#define PU_POS ((ulg)(p - pu_in) - (k >> 3))
+
+/* ===========================================================================
+ * Inflate the segment of job, from job->start to the first boundary at
+ * or after job->stop, or to the end of the gzip members. Sets job->err.
+ */
+local void pu_inflate(job)
+    pu_job *job;
+{
+    uch *p;             /* next input byte */
+    uch *end = pu_in + pu_size;
+    ulg b = 0;          /* bit buffer */
+    unsigned k = 0;     /* number of bits in bit buffer */
+    ulg n = 0;          /* number of output symbols */
+    ulg pos;            /* input offset */
+    unsigned last;      /* last block flag */
+    unsigned type;      /* block type */
+    unsigned e, i, j, len, d;
+    unsigned nl, nd, nb;
+    fcode *t, *lt, *dt;
+    ush *o, *q;
+    struct huft *h;
+    int hb;
+    int member = job->member;
+    unsigned ll[286+30];
+    fcode ct[1 << 7];
+    fcode ltab[PU_LSIZE];
+    fcode dtab[PU_DSIZE];
+
+    job->err = PU_OK;
+    job->nmarks = 0;
+    job->last = 0;
+    p = pu_in + job->start;
+
+    for (;;) {
+	if (member) {
+	    pos = (ulg)(p - pu_in);
+	    if (!pu_header(&pos)) {
+		job->last = 1;
+		break;
+	    }
+	    p = pu_in + pos;
+	    member = 0;
+	} else if ((k & 7) == 0 && (pos = PU_POS) >= job->stop &&
+		   pu_boundary(pos, 0)) {
+	    break;
+	}
+	PU_NEED(3)
+	last = (unsigned)b & 1;
+	type = ((unsigned)b >> 1) & 3;
+	PU_DUMP(3)
+
+	if (type == 0) {
+	    /* stored block: read directly from the input */
+	    PU_DUMP(k & 7)
+	    pos = PU_POS;
+	    p = pu_in + pos;
+	    b = 0;
+	    k = 0;
+	    if (pos + 4 > pu_size) goto bad;
+	    len = (unsigned)p[0] | ((unsigned)p[1] << 8);
+	    if (len != (~((unsigned)p[2] | ((unsigned)p[3] << 8)) & 0xffff)) {
+		goto bad;
+	    }
+	    p += 4;
+	    if ((ulg)(end - p) < len) goto bad;
+	    pu_grow(job, n + len);
+	    for (o = job->out + n, n += len; len != 0; len--) *o++ = *p++;
+	} else {
+	    if (type == 1) {
+		lt = pu_fixed_l;
+		dt = pu_fixed_d;
+	    } else if (type == 2) {
+		/* dynamic block: same checks as inflate_dynamic */
+		PU_NEED(14)
+		nl = 257 + ((unsigned)b & 0x1f);
+		nd = 1 + (((unsigned)b >> 5) & 0x1f);
+		nb = 4 + (((unsigned)b >> 10) & 0xf);
+		PU_DUMP(14)
+		if (nl > 286 || nd > 30) goto bad;
+		for (j = 0; j < 19; j++) ll[j] = 0;
+		for (j = 0; j < nb; j++) {
+		    PU_NEED(3)
+		    ll[border[j]] = (unsigned)b & 7;
+		    PU_DUMP(3)
+		}
+		hb = 7;
+		i = huft_build(ll, 19, 19, NULL, NULL, &h, &hb);
+		if (i == 1) huft_free(h);
+		if (i != 0 || h == NULL) goto bad;
+		huft_free(h);
+		(void)fast_build(ll, 19, 19, NULL, NULL, ct, 7, 1 << 7);
+
+		for (i = 0, len = 0; i < nl + nd; ) {
+		    PU_NEED(14)
+		    t = ct + ((unsigned)b & 0x7f);
+		    if (t->op & FC_BAD) goto bad;
+		    PU_DUMP(t->bits)
+		    j = t->val;
+		    if (j < 16) {
+			ll[i++] = len = j;
+			continue;
+		    }
+		    if (j == 16) {
+			j = 3 + ((unsigned)b & 3);
+			PU_DUMP(2)
+		    } else if (j == 17) {
+			j = 3 + ((unsigned)b & 7);
+			PU_DUMP(3)
+			len = 0;
+		    } else {
+			j = 11 + ((unsigned)b & 0x7f);
+			PU_DUMP(7)
+			len = 0;
+		    }
+		    if (i + j > nl + nd) goto bad;
+		    while (j--) ll[i++] = len;
+		}
+
+		hb = lbits;
+		i = huft_build(ll, nl, 257, cplens, cplext, &h, &hb);
+		if (i == 1) huft_free(h);
+		if (i != 0) goto bad;
+		huft_free(h);
+		hb = dbits;
+		i = huft_build(ll + nl, nd, 0, cpdist, cpdext, &h, &hb);
+		if (i == 1) huft_free(h);
+		if (i != 0) goto bad;
+		huft_free(h);
+		(void)fast_build(ll, nl, 257, cplens, cplext, ltab, FAST_LBITS,
+				 PU_LSIZE);
+		(void)fast_build(ll + nl, nd, 0, cpdist, cpdext, dtab,
+				 FAST_DBITS, PU_DSIZE);
+		lt = ltab;
+		dt = dtab;
+	    } else {
+		goto bad;
+	    }
+
+	    for (;;) {
+		if (n + MAX_MATCH > job->outsize) {
+		    if (job->direct && n > PU_CHUNK + WSIZE) {
+			/* write out all but the window */
+			job->outlen = n;
+			pu_output(job, n - WSIZE);
+			n = job->outlen;
+		    } else if (!job->direct && n > PU_MAXOUT) {
+			job->err = PU_BIG;
+			return;
+		    }
+		    pu_grow(job, n + MAX_MATCH);
+		}
+		PU_NEED(48)
+		t = lt + ((unsigned)b & ((1 << FAST_LBITS) - 1));
+		if (t->op & FC_LINK) {
+		    e = t->op & 15;
+		    PU_DUMP(t->bits)
+		    t = lt + t->val + ((unsigned)b & mask_bits[e]);
+		}
+		PU_DUMP(t->bits)
+		if ((e = t->op) == FC_LIT) {
+		    job->out[n++] = t->val;
+		    continue;
+		}
+		if (e & FC_BAD) goto bad;
+		if (e & FC_EOB) break;
+		e &= 15;
+		len = t->val + ((unsigned)b & mask_bits[e]);
+		PU_DUMP(e)
+
+		t = dt + ((unsigned)b & ((1 << FAST_DBITS) - 1));
+		if (t->op & FC_LINK) {
+		    e = t->op & 15;
+		    PU_DUMP(t->bits)
+		    t = dt + t->val + ((unsigned)b & mask_bits[e]);
+		}
+		PU_DUMP(t->bits)
+		if ((e = t->op) & FC_BAD) goto bad;
+		e &= 15;
+		d = t->val + ((unsigned)b & mask_bits[e]);
+		PU_DUMP(e)
+
+		o = job->out + n;
+		if (d > n) {
+		    /* reaches before the segment: leave placeholders */
+		    for (; len != 0 && d > n; len--, n++) {
+			*o++ = (ush)(PU_PLACE + WSIZE - (d - n));
+		    }
+		}
+		q = o - d;
+		n += len;
+		if (d >= len) {
+		    memcpy((char*)o, (char*)q, len*sizeof(ush));
+		} else {
+		    while (len--) *o++ = *q++;
+		}
+	    }
+	}
+	if (PU_POS > pu_size) goto bad;
+
+	if (last) {
+	    /* end of member: get the trailer */
+	    PU_DUMP(k & 7)
+	    pos = PU_POS;
+	    if (pos + 8 > pu_size) goto bad;
+	    p = pu_in + pos;
+	    if (job->nmarks == job->marksize) {
+		job->marksize = job->marksize ? 2*job->marksize : 16;
+		job->marks = (pu_mark*)realloc((char*)job->marks,
+					       job->marksize*sizeof(pu_mark));
+		if (job->marks == NULL) error("out of memory");
+	    }
+	    job->marks[job->nmarks].pos = n;
+	    job->marks[job->nmarks].crc = LG(p);
+	    job->marks[job->nmarks].len = LG(p+4);
+	    job->nmarks++;
+	    p += 8;
+	    pos += 8;
+	    b = 0;
+	    k = 0;
+	    member = 1;
+	    if (pos >= job->stop && pu_boundary(pos, 1)) break;
+	}
+    }
+    job->outlen = n;
+    job->end = PU_POS;
+    job->end_member = member;
+    return;
+bad:
+    job->err = PU_BAD;
+}
+
+/* ===========================================================================
+ * Worker thread: inflate the jobs in order until told to quit.
+ */
+local void *pu_worker(arg)
+    void *arg;
+{
+    pu_job *job;
+
+    for (;;) {
+	pthread_mutex_lock(&pu_lock);
+	while (pu_next == pu_avail && !pu_quit) {
+	    pthread_cond_wait(&pu_work, &pu_lock);
+	}
+	if (pu_next == pu_avail) {
+	    pthread_mutex_unlock(&pu_lock);
+	    break;
+	}
+	job = &pu_jobs[pu_next++ % pu_njobs];
+	pthread_mutex_unlock(&pu_lock);
+
+	pu_inflate(job);
+
+	pthread_mutex_lock(&pu_lock);
+	job->done = 1;
+	pthread_cond_broadcast(&pu_done);
+	pthread_mutex_unlock(&pu_lock);
+    }
+    return arg;
+}
+
+/* ===========================================================================
+ * Start a new segment: save the window its placeholders refer to.
+ */
+local void pu_begin()
+{
+    memcpy((char*)pu_ctx, (char*)pu_hist, WSIZE);
+}
+
+/* ===========================================================================
+ * Resolve, check and write the first upto symbols of job->out, then move
+ * the rest to the front.
+ */
+local void pu_output(job, upto)
+    pu_job *job;
+    ulg upto;
+{
+    ulg i = 0, lim, c, j;
+    unsigned m = 0;
+    ush *s = job->out;
+
+    while (i < upto || (m < job->nmarks && job->marks[m].pos <= upto)) {
+	lim = upto;
+	if (m < job->nmarks && job->marks[m].pos < lim) {
+	    lim = job->marks[m].pos;
+	}
+	if (i == lim) {
+	    /* end of a member */
+	    if (job->marks[m].crc != pu_crc) {
+		fprintf(stderr, "\n%s: %s: invalid compressed data--crc error\n",
+			progname, ifname);
+		pu_err = ERROR;
+	    }
+	    if (job->marks[m].len != (pu_len & 0xffffffff)) {
+		fprintf(stderr,
+			"\n%s: %s: invalid compressed data--length error\n",
+			progname, ifname);
+		pu_err = ERROR;
+	    }
+	    if (pu_err != OK) {
+		exit_code = ERROR;
+		if (!test) abort_gzip();
+	    }
+	    pu_crc = 0;
+	    pu_len = 0;
+	    m++;
+	    continue;
+	}
+	c = lim - i;
+	if (c > PU_CHUNK) c = PU_CHUNK;
+	for (j = 0; j < c; j++) {
+	    pu_buf[j] = s[i+j] < PU_PLACE ? (uch)s[i+j]
+					  : pu_ctx[s[i+j] - PU_PLACE];
+	}
+	pu_crc = crc32_buf(pu_crc, pu_buf, (unsigned)c);
+	pu_len += c;
+	if (!test) write_buf(pu_out, (char*)pu_buf, (unsigned)c);
+	bytes_out += (off_t)c;
+	if (c >= WSIZE) {
+	    memcpy((char*)pu_hist, (char*)pu_buf + c - WSIZE, WSIZE);
+	} else {
+	    memmove((char*)pu_hist, (char*)pu_hist + c, WSIZE - (unsigned)c);
+	    memcpy((char*)pu_hist + WSIZE - c, (char*)pu_buf, (unsigned)c);
+	}
+	i += c;
+    }
+    memmove((char*)s, (char*)(s + upto), (job->outlen - upto)*sizeof(ush));
+    job->outlen -= upto;
+    for (j = 0; m < job->nmarks; m++, j++) {
+	job->marks[j] = job->marks[m];
+	job->marks[j].pos -= upto;
+    }
+    job->nmarks = (unsigned)j;
+}
+
+/* ===========================================================================
+ * Inflate from start in the main thread, writing out as it goes.
+ */
+local void pu_direct(start, member, stop, job)
+    ulg start;
+    int member;
+    ulg stop;
+    pu_job *job;
+{
+    job->start = start;
+    job->member = member;
+    job->stop = stop;
+    job->direct = 1;
+    pu_begin();
+    pu_inflate(job);
+    if (job->err != PU_OK) {
+	error("invalid compressed data--format violated");
+    }
+    pu_output(job, job->outlen);
+}
+
+/* ===========================================================================
+ * Inflate the rest of the input file with several threads, see above.
+ */
+int punzip(in, out)
+    int in, out;
+{
+    pthread_t *tid;         /* worker threads */
+    sigset_t oset;          /* signals are handled by the main thread */
+    pu_job *job;            /* current job */
+    pu_job self;            /* job run by the main thread */
+    ulg seq;                /* number of the current job */
+    ulg njob;               /* number of segments */
+    ulg cur;                /* input offset inflated so far */
+    int cur_member;         /* cur is between members */
+    int fin = 0;            /* no more members */
+    ulg at, key;
+    unsigned size;          /* allocated size of pu_cand */
+    unsigned l[288];
+    int i;
+
+    if (!map_file(in)) return -1;
+    pu_in = map_buf;
+    pu_size = (ulg)map_size;
+    pu_out = out;
+    cur = (ulg)map_pos - insize + inptr;
+    cur_member = 0;
+
+    /* Find the segments */
+    pu_ncand = size = 0;
+    pu_cand = NULL;
+    for (at = cur + PU_SEGMENT; at < pu_size; at = (key >> 1) + PU_SEGMENT) {
+	if ((key = pu_scan(at)) == 0) break;
+	if (pu_ncand == size) {
+	    size = size ? 2*size : 64;
+	    pu_cand = (ulg*)realloc((char*)pu_cand, size*sizeof(ulg));
+	    if (pu_cand == NULL) error("out of memory");
+	}
+	pu_cand[pu_ncand++] = key;
+    }
+    if (pu_ncand == 0) return -1;
+    njob = pu_ncand + 1;
+
+    for (i = 0; i < 144; i++) l[i] = 8;
+    for (; i < 256; i++) l[i] = 9;
+    for (; i < 280; i++) l[i] = 7;
+    for (; i < 288; i++) l[i] = 8;
+    (void)fast_build(l, 288, 257, cplens, cplext, pu_fixed_l, FAST_LBITS,
+		     1 << FAST_LBITS);
+    for (i = 0; i < 30; i++) l[i] = 5;
+    (void)fast_build(l, 30, 0, cpdist, cpdext, pu_fixed_d, FAST_DBITS,
+		     1 << FAST_DBITS);
+
+    pu_hist = (uch*)xmalloc(WSIZE);
+    pu_ctx = (uch*)xmalloc(WSIZE);
+    pu_buf = (uch*)xmalloc(PU_CHUNK);
+    memzero(pu_hist, WSIZE);
+    pu_crc = 0;
+    pu_len = 0;
+    pu_err = OK;
+    memzero(&self, sizeof(self));
+
+    pu_njobs = 2*processes;
+    if (pu_njobs > njob) pu_njobs = (unsigned)njob;
+    pu_jobs = (pu_job*)xmalloc(pu_njobs*sizeof(pu_job));
+    memzero(pu_jobs, pu_njobs*sizeof(pu_job));
+    for (seq = 0; seq < pu_njobs; seq++) {
+	job = &pu_jobs[seq];
+	job->start = seq == 0 ? cur : pu_cand[seq-1] >> 1;
+	job->member = seq == 0 ? 0 : (int)(pu_cand[seq-1] & 1);
+	job->stop = seq < pu_ncand ? pu_cand[seq] >> 1 : pu_size + 1;
+    }
+    pu_avail = pu_njobs;
+    pu_next = 0;
+    pu_quit = 0;
+
+    tid = (pthread_t*)xmalloc(processes*sizeof(pthread_t));
+    block_signals(&oset);
+    for (i = 0; i < processes; i++) {
+	if (pthread_create(&tid[i], NULL, pu_worker, NULL) != 0) {
+	    error("cannot create thread");
+	}
+    }
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+    for (seq = 0; seq < njob && !fin && pu_err == OK; seq++) {
+	job = &pu_jobs[seq % pu_njobs];
+	pthread_mutex_lock(&pu_lock);
+	while (!job->done) {
+	    pthread_cond_wait(&pu_done, &pu_lock);
+	}
+	job->done = 0;
+	pthread_mutex_unlock(&pu_lock);
+
+	/* Fill the gap up to the job, then use it if it follows on */
+	while (!fin && job->start >= cur) {
+	    if (job->start == cur && job->member == cur_member &&
+		job->err == PU_OK) {
+		pu_begin();
+		pu_output(job, job->outlen);
+		cur = job->end;
+		cur_member = job->end_member;
+		fin = job->last;
+		break;
+	    }
+	    pu_direct(cur, cur_member, job->start > cur ? job->start : cur + 1,
+		      &self);
+	    cur = self.end;
+	    cur_member = self.end_member;
+	    fin = self.last;
+	}
+
+	/* Hand out the next segment in the freed slot */
+	if (seq + pu_njobs < njob) {
+	    key = pu_cand[seq + pu_njobs - 1];
+	    job->start = key >> 1;
+	    job->member = (int)(key & 1);
+	    job->stop = seq + pu_njobs < pu_ncand ?
+			pu_cand[seq + pu_njobs] >> 1 : pu_size + 1;
+	    pthread_mutex_lock(&pu_lock);
+	    pu_avail++;
+	    pthread_cond_signal(&pu_work);
+	    pthread_mutex_unlock(&pu_lock);
+	}
+    }
+    while (!fin && pu_err == OK) {
+	pu_direct(cur, cur_member, pu_size + 1, &self);
+	cur = self.end;
+	cur_member = self.end_member;
+	fin = self.last;
+    }
+
+    pthread_mutex_lock(&pu_lock);
+    pu_quit = 1;
+    pu_avail = pu_next;  /* drop the jobs not started yet */
+    pthread_cond_broadcast(&pu_work);
+    pthread_mutex_unlock(&pu_lock);
+    for (i = 0; i < processes; i++) {
+	pthread_join(tid[i], NULL);
+    }
+    free((char*)tid);
+    for (seq = 0; seq < pu_njobs; seq++) {
+	free((char*)pu_jobs[seq].out);
+	free((char*)pu_jobs[seq].marks);
+    }
+    free((char*)pu_jobs);
+    free((char*)self.out);
+    free((char*)self.marks);
+    free((char*)pu_cand);
+    free((char*)pu_hist);
+    free((char*)pu_ctx);
+    free((char*)pu_buf);
+
+    /* Let get_method() look at what follows */
+    map_pos = (off_t)cur;
+    bytes_in = (off_t)cur;
+    insize = inptr = 0;
+    if (fill_inbuf(1) != EOF) inptr = 0;
+    return pu_err;
+}
+
+#endif /* !NO_THREADS && !NO_FAST_INFLATE */
+
+/* zindex.c -- random access to gzip files (--index and --range options)
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License, see the file COPYING.
+ */
+
+/*
+ *  PURPOSE
+ *
+ *      Extract part of the decompressed data of a large gzip file without
+ *      inflating it from the start.
+ *
+ *  DISCUSSION
+ *
+ *      gzip --index file.gz tests the file and writes file.gz.idx, with an
+ *      access point about every index_span bytes of decompressed data. An
+ *      access point is taken at the start of a deflate block: it records
+ *      the offset in the decompressed data, the position of the block in
+ *      the compressed file, in bits, and the 32K of decompressed data
+ *      before it, which is all inflate needs to continue from there.
+ *
+ *      gzip --range off:len file.gz writes bytes off to off+len-1 of the
+ *      decompressed data. If an up to date file.gz.idx exists, inflate
+ *      starts at the last access point at or before off, otherwise at the
+ *      start of the file. Inflating stops at the end of the range, so the
+ *      crc and length of the members are not checked.
+ *
+ *      The index file starts with IX_MAGIC, index_span and the size and
+ *      modification time of the gzip file, followed by the access points:
+ *      output offset, bit position and window. Numbers are 8 bytes, least
+ *      significant first. The index has the permissions of the gzip file,
+ *      and like the output files, an existing index is only replaced with -f.
+ *
+ *  INTERFACE
+ *
+ *      void index_open (void)
+ *      void index_close (int ok)
+ *          Create the index of the input file before it is decompressed,
+ *          and complete it, or remove it if ok is zero.
+ *
+ *      void index_point (void)
+ *          Called by inflate at the start of a block to add an access point.
+ *
+ *      int range_parse (char *arg)
+ *          Set range_start and range_end from "off:len", "off:" or "off".
+ *
+ *      void range_write (uch *buf, unsigned cnt)
+ *          Write the part of buf that is in the range. buf is at stream_pos
+ *          in the decompressed data.
+ *
+ *      int range_inflate (void)
+ *          Same as inflate() for --range, starting at an access point.
+ */
+
+#define IX_MAGIC "GZINDEX2"     /* 8 bytes, GZINDEX1 had no time */
+#define IX_HEAD  32             /* magic, span, size and time of the file */
+#define IX_POINT (16 + WSIZE)   /* offset, bit position, window */
+
+TLS int   index_fd = -1;        /* index being written, or -1 */
+TLS off_t index_next;           /* output offset of the next access point */
+TLS int range_done;               /* set when the end of the range is written */
+local char ix_name[MAX_PATH_LEN]; /* name of the index file */
+local uch  ix_window[WSIZE];    /* window of an access point */
+
+local void  ix_put  OF((uch *p, off_t n));
+local off_t ix_get  OF((uch *p));
+local int   ix_name_of OF((void));
+local int   range_num OF((char **pp, off_t *n));
+
+/* ===========================================================================
+ * Store n in the 8 bytes at p, least significant first.
+ */
+local void ix_put(p, n)
+    uch *p;
+    off_t n;
+{
+    int i;
+
+    for (i = 0; i < 8; i++, n >>= 8) p[i] = (uch)(n & 0xff);
+}
+
+/* ===========================================================================
+ * Get the 8 byte number at p.
+ */
+local off_t ix_get(p)
+    uch *p;
+{
+    off_t n = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) n = (n << 8) | p[i];
+    return n;
+}
+
+/* ===========================================================================
+ * Set ix_name to the name of the index of the input file. Return zero if
+ * there can be none.
+ */
+local int ix_name_of()
+{
+    if (strequ(ifname, "stdin") ||
+	strlen(ifname) + sizeof(".idx") > sizeof(ix_name)) {
+	return 0;
+    }
+    strcpy(ix_name, ifname);
+    strcat(ix_name, ".idx");
+    return 1;
+}
+
+/* ===========================================================================
+ * Create the index of the input file. Called before decompression.
+ */
+void index_open()
+{
+    uch hdr[IX_HEAD];
+
+    index_next = 0;
+    if (!ix_name_of()) {
+	WARN((stderr, "%s: %s: no index for standard input\n",
+	      progname, ifname));
+	return;
+    }
+    /* Like the output files, an existing index is replaced only with -f */
+    index_fd = OPEN(ix_name, O_WRONLY|O_CREAT|O_BINARY|
+		    (force ? O_TRUNC : O_EXCL), RW_USER);
+    if (index_fd == -1) {
+	if (errno == EEXIST) {
+	    WARN((stderr, "%s: %s already exists; not overwritten\n",
+		  progname, ix_name));
+	} else {
+	    progerror(ix_name);
+	}
+	return;
+    }
+    memcpy((char*)hdr, IX_MAGIC, 8);
+    ix_put(hdr + 8, index_span);
+    ix_put(hdr + 16, ifile_size);
+    ix_put(hdr + 24, (off_t)istat.st_mtime);
+    write_buf(index_fd, (char*)hdr, IX_HEAD);
+
+    /* Copy the protection modes of the input file, as for the output */
+    if (fchmod(index_fd, istat.st_mode & 07777)) {
+	int e = errno;
+	WARN((stderr, "%s: ", progname));
+	if (!quiet) {
+	    errno = e;
+	    perror(ix_name);
+	}
+    }
+}
+
+/* ===========================================================================
+ * Complete the index, or remove it if the input could not be decompressed.
+ */
+void index_close(ok)
+    int ok;
+{
+    if (index_fd == -1) return;
+    flush_bulk();
+    if (close(index_fd) != 0) {
+	progerror(ix_name);
+	ok = 0;
+    }
+    index_fd = -1;
+    if (!ok) xunlink(ix_name);
+}
+
+/* ===========================================================================
+ * Add an access point at the current block of inflate. The window is
+ * stored from the oldest byte on, so that range_inflate can load it with
+ * wp == 0.
+ */
+void index_point()
+{
+    uch hdr[16];
+    off_t out = stream_pos + outcnt;
+    off_t bits = ((bytes_in - insize + inptr) << 3) - bk;
+
+    ix_put(hdr, out);
+    ix_put(hdr + 8, bits);
+    write_buf(index_fd, (char*)hdr, 16);
+
+    /* the window is circular, slide[outcnt] is the oldest byte */
+    if (stream_pos == 0) {
+	memzero(ix_window, WSIZE - outcnt); /* before the start of the file */
+    } else {
+	memcpy((char*)ix_window, (char*)slide + outcnt, WSIZE - outcnt);
+    }
+    memcpy((char*)ix_window + WSIZE - outcnt, (char*)slide, outcnt);
+    write_buf(index_fd, (char*)ix_window, WSIZE);
+    index_next = out + index_span;
+}
+
+/* ===========================================================================
+ * Parse the argument of --range. Return OK or ERROR.
+ */
+int range_parse(arg)
+    char *arg;
+{
+    off_t start, len;
+    char *p = arg;
+
+    if (range_num(&p, &start) != OK) return ERROR;
+    if (*p == ':') p++;
+    if (*p == '\0') {
+	range_start = start;
+	range_end = -1;
+	return OK;
+    }
+    if (range_num(&p, &len) != OK || *p != '\0' ||
+	len > OFF_T_MAX - start) {
+	return ERROR;
+    }
+    range_start = start;
+    range_end = start + len;
+    return OK;
+}
+
+/* ===========================================================================
+ * Read the decimal number at *pp into *n and advance *pp past it. Return
+ * ERROR if there is no digit or if the number does not fit in an off_t.
+ */
+local int range_num(pp, n)
+    char **pp;
+    off_t *n;
+{
+    char *p = *pp;
+    int d;
+
+    if (*p < '0' || *p > '9') return ERROR;
+    *n = 0;
+    while (*p >= '0' && *p <= '9') {
+	d = *p++ - '0';
+	if (*n > (OFF_T_MAX - d) / 10) return ERROR;
+	*n = 10 * *n + d;
+    }
+    *pp = p;
+    return OK;
+}
+
+/* ===========================================================================
+ * Write the part of buf[0..cnt-1] in the range. Set range_done, and stop
+ * the decompression loop, when the end of the range is reached.
+ */
+void range_write(buf, cnt)
+    uch *buf;
+    unsigned cnt;
+{
+    off_t lo = stream_pos, hi = stream_pos + cnt;
+
+    if (lo < range_start) lo = range_start;
+    if (range_end >= 0 && hi > range_end) hi = range_end;
+    if (lo < hi && !test) {
+	write_buf(ofd, (char*)buf + (lo - stream_pos), (unsigned)(hi - lo));
+    }
+    if (range_end >= 0 && stream_pos + cnt >= range_end) {
+	range_done = 1;
+	last_member = 1;
+    }
+}
+
+/* ===========================================================================
+ * Inflate for --range: start at the last access point before range_start
+ * if the input file has an up to date index, else at the beginning.
+ * Return the result of inflate.
+ */
+int range_inflate()
+{
+    uch hdr[IX_HEAD];
+    off_t best = -1;     /* offset of the access point in the index */
+    off_t out = 0, bits = 0, pos;
+    int fd;
+    int n;
+
+    if (part_nb != 1 || range_start == 0 || !ix_name_of()) return inflate();
+    fd = OPEN(ix_name, O_RDONLY|O_BINARY, RW_USER);
+    if (fd == -1) return inflate();
+
+    if (read(fd, (char*)hdr, IX_HEAD) != IX_HEAD ||
+	memcmp((char*)hdr, IX_MAGIC, 8) != 0 ||
+	ix_get(hdr + 16) != ifile_size ||
+	ix_get(hdr + 24) != (off_t)istat.st_mtime) {
+	WARN((stderr, "%s: %s: invalid or out of date index %s ignored\n",
+	      progname, ifname, ix_name));
+	close(fd);
+	return inflate();
+    }
+    /* Find the last access point at or before range_start */
+    for (pos = IX_HEAD; ; pos += IX_POINT) {
+	if (lseek(fd, pos, SEEK_SET) != pos ||
+	    read(fd, (char*)hdr, 16) != 16) break;
+	if (ix_get(hdr) > range_start) break;
+	best = pos;
+	out = ix_get(hdr);
+	bits = ix_get(hdr + 8);
+    }
+    if (best < 0 || out <= stream_pos) {
+	close(fd);
+	return inflate();
+    }
+    n = lseek(fd, best + 16, SEEK_SET) == best + 16 ?
+	read(fd, (char*)slide, WSIZE) : -1;
+    close(fd);
+    if (n != WSIZE) {
+	WARN((stderr, "%s: %s: truncated index %s ignored\n",
+	      progname, ifname, ix_name));
+	return inflate();
+    }
+
+    /* Continue from there, the window was loaded above */
+    seek_input(ifd, bits >> 3);
+    wp = 0;
+    bk = (unsigned)(bits & 7);
+    bb = bk ? (ulg)get_byte() >> bk : 0;
+    bk = bk ? 8 - bk : 0;
+    stream_pos = out;
+    return inflate_more();
+}
+
+/* Determine whether string value is affirmation or negative response
+   according to current locale's data.
+   Copyright (C) 1996, 1998, 2000 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.  */
+
+int
+rpmatch (const char *response)
+{
+  /* Test against "^[yY]" and "^[nN]", hardcoded to avoid requiring regex */
+  return (*response == 'y' || *response == 'Y' ? 1
+	  : *response == 'n' || *response == 'N' ? 0 : -1);
+}
+
+
+int
+getopt_long (argc, argv, options, long_options, opt_index)
+     int argc;
+     char *const *argv;
+     const char *options;
+     const struct option *long_options;
+     int *opt_index;
+{
+  return _getopt_internal (argc, argv, options, long_options, opt_index, 0);
+}
+
+/* Like getopt_long, but '-' as well as '--' can indicate a long option.
+   If an option that starts with '-' (not '--') doesn't match a long option,
+   but does match a short option, it is parsed as a short option
+   instead.  */
+
+int
+getopt_long_only (argc, argv, options, long_options, opt_index)
+     int argc;
+     char *const *argv;
+     const char *options;
+     const struct option *long_options;
+     int *opt_index;
+{
+  return _getopt_internal (argc, argv, options, long_options, opt_index, 1);
+}
+
+/* bench.c -- in-memory benchmark (--bench option)
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License, see the file COPYING.
+ */
+
+/*
+ *  PURPOSE
+ *
+ *      Measure the speed of compression and decompression at each level,
+ *      to make regressions in the hot loops visible.
+ *
+ *  DISCUSSION
+ *
+ *      gzip --bench file... reads each file in memory, then for levels 1
+ *      to 9 runs zip() and unzip() from memory to memory, each repeated
+ *      for at least BENCH_TIME seconds, and checks that the data comes
+ *      back unchanged. No file is written. The other options, such as
+ *      -p, --rsyncable or --fast-greedy, apply as usual.
+ *
+ *      On x86, one more compression and decompression is then run by a
+ *      single thread with the time stamp counter read around the main
+ *      phases (see BENCH in gzip.h), and the cycles per input byte of
+ *      each phase are printed; "other" is the rest of deflate (hashing,
+ *      window sliding) and "inflate" all of the decompression but the
+ *      crc. Reading the counter costs some cycles, so this run is slower
+ *      than the timed ones.
+ *
+ *  INTERFACE
+ *
+ *      void bench_file (char *name)
+ *          Run the benchmark on the given file, "-" for standard input,
+ *          and print the results on standard output.
+ */
+
+#ifndef BENCH_TIME
+#  define BENCH_TIME 0.5  /* minimum duration of each measurement, seconds */
+#endif
+
+int bench = 0;            /* --bench: measure speed instead of writing files */
+#ifdef BENCH_PHASES
+int bench_phases = 0;     /* set while the phases are counted */
+bench_t bench_cycles[BP_COUNT]; /* cycles of each phase */
+#endif
+
+local double bench_now   OF((void));
+local void   bench_zip   OF((uch *buf, ulg len));
+local void   bench_unzip OF((uch *buf, ulg len));
+
+/* ===========================================================================
+ * Return the current time in seconds.
+ */
+local double bench_now()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+/* ===========================================================================
+ * Compress buf[0..len-1] to mem_outbuf with zip().
+ */
+local void bench_zip(buf, len)
+    uch *buf;
+    ulg len;
+{
+    mem_input(buf, (off_t)len);
+    clear_bufs();
+    mem_outcnt = 0;
+    ifile_size = (off_t)len;
+    read_buf = file_read; /* not set by bi_init for NO_FILE */
+    (void)zip(NO_FILE, NO_FILE);
+}
+
+/* ===========================================================================
+ * Decompress the gzip member buf[0..len-1] to mem_outbuf with unzip().
+ */
+local void bench_unzip(buf, len)
+    uch *buf;
+    ulg len;
+{
+    mem_input(buf, (off_t)len);
+    clear_bufs();
+    mem_outcnt = 0;
+    part_nb = 0;
+    method = get_method(NO_FILE);
+    if (method != DEFLATED || unzip(NO_FILE, NO_FILE) != OK) {
+	error("bench: invalid compressed data");
+    }
+}
+
+/* ===========================================================================
+ * Run the benchmark on the given file.
+ */
+void bench_file(name)
+    char *name;
+{
+    int fd;               /* input file descriptor */
+    uch *data = NULL;     /* contents of the file */
+    ulg len = 0, size = 0;
+    uch *zdata = NULL;    /* compressed data */
+    ulg zlen;
+    int n, lev;
+    long runs;
+    double t, zt, ut;
+#ifdef BENCH_PHASES
+    bench_t zc[BP_COUNT]; /* cycles of each phase of compression */
+    bench_t zall, uall, sum;
+    int p, i;
+#endif
+
+    if (strequ(name, "-")) {
+	strcpy(ifname, "stdin");
+	fd = fileno(stdin);
+    } else {
+	if (strlen(name) >= sizeof(ifname)) {
+	    WARN((stderr, "%s: %s: file name too long\n", progname, name));
+	    return;
+	}
+	strcpy(ifname, name);
+	fd = OPEN(ifname, O_RDONLY | O_BINARY, RW_USER);
+	if (fd == -1) {
+	    progerror(ifname);
+	    return;
+	}
+    }
+    for (;;) {
+	if (len == size) {
+	    size = size ? 2*size : 0x10000L;
+	    data = (uch*)realloc((char*)data, size);
+	    if (data == NULL) error("out of memory");
+	}
+	n = read(fd, (char*)data + len,
+		 size - len < 0x40000000L ? (unsigned)(size - len) : 0x40000000);
+	if (n < 0) read_error();
+	if (n <= 0) break;
+	len += (ulg)n;
+    }
+    if (fd != fileno(stdin)) close(fd);
+
+    printf("%s: %lu bytes\n", ifname, len);
+    printf("level  ratio  comp MB/s decomp MB/s");
+#ifdef BENCH_PHASES
+    printf(" | cycles/byte: match  tally  trees   send    crc  other"
+	   " | inflate    crc");
+#endif
+    printf("\n");
+
+    save_orig_name = 0;
+    time_stamp = 0;
+    for (lev = 1; lev <= 9; lev++) {
+	level = lev;
+	runs = 0;
+	t = bench_now();
+	do {
+	    bench_zip(data, len);
+	    runs++;
+	} while ((zt = bench_now() - t) < BENCH_TIME);
+	zt /= runs;
+
+	zlen = mem_outcnt;
+	zdata = (uch*)realloc((char*)zdata, zlen);
+	if (zdata == NULL) error("out of memory");
+	memcpy((char*)zdata, (char*)mem_outbuf, zlen);
+
+	runs = 0;
+	t = bench_now();
+	do {
+	    bench_unzip(zdata, zlen);
+	    runs++;
+	} while ((ut = bench_now() - t) < BENCH_TIME);
+	ut /= runs;
+	if (mem_outcnt != len ||
+	    (len != 0 && memcmp((char*)mem_outbuf, (char*)data, len) != 0)) {
+	    error("bench: decompressed data differs");
+	}
+
+	printf("%5d ", lev);
+	display_ratio((off_t)len - (off_t)zlen, (off_t)len, stdout);
+	printf(" %10.1f %11.1f", len / zt / 1e6, len / ut / 1e6);
+
+#ifdef BENCH_PHASES
+	p = processes;
+	processes = 1;
+	bench_phases = 1;
+	memzero((char*)bench_cycles, sizeof(bench_cycles));
+	zall = bench_clock();
+	bench_zip(data, len);
+	zall = bench_clock() - zall;
+	memcpy((char*)zc, (char*)bench_cycles, sizeof(zc));
+
+	memzero((char*)bench_cycles, sizeof(bench_cycles));
+	uall = bench_clock();
+	bench_unzip(zdata, zlen);
+	uall = bench_clock() - uall;
+	bench_phases = 0;
+	processes = p;
+
+	if (len != 0) {
+	    printf(" |            ");
+	    for (i = 0, sum = 0; i < BP_COUNT; i++) {
+		printf(" %6.2f", (double)zc[i] / len);
+		sum += zc[i];
+	    }
+	    printf(" %6.2f |  %6.2f %6.2f",
+		   (double)(zall - sum) / len,
+		   (double)(uall - bench_cycles[BP_CRC]) / len,
+		   (double)bench_cycles[BP_CRC] / len);
+	}
+#endif
+	printf("\n");
+	fflush(stdout);
+    }
+
+    free((char*)data);
+    free((char*)zdata);
+    free((char*)mem_outbuf);
+    mem_outbuf = NULL;
+    mem_outsize = mem_outcnt = 0;
+    mem_input(NULL, (off_t)0);
 }